@@ -0,0 +1,262 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include <pico/stdlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include <hardware/clocks.h>
+#include <hardware/pio.h>
+#include <hardware/pwm.h>
+#include <hardware/vreg.h>
+
+extern "C" {
+    #include "sram.h"
+
+    #include "pio_spi.h"
+}
+
+// Throughput and latency benchmark, run with pio1 as the master on the
+// emulator's own pins.  Connect nothing to the SPI pins.  The results are
+// printed over stdio as CSV.
+
+static_assert(SIM_SRAM_ADDR_BITS == 16, "The benchmark sends 16-bit addresses");
+
+// SYS clocks to sweep, in kHz.  The core voltage is raised above 200MHz.
+static const uint32_t sys_khz[] = {125000, 150000, 200000, 250000};
+
+// SCK periods in SYS clocks, slowest first.  The master takes 2 SYS clocks
+// per divider step for each bit.
+static const uint sck_periods[] = {16, 14, 12, 10, 8, 6, 4};
+
+// Data bytes in each transaction
+static const uint lengths[] = {1, 4, 16, 64, 256, 1024, 4096, 16384, 65536};
+
+// CS is held high for at least this many SYS clocks between transactions,
+// which covers every entry in the CS high table in the README.  The DMA adds
+// some more setting up the next transaction.
+#define BENCH_CS_HIGH_CYCLES 64
+
+// Each rate runs batches until it has done this many transactions or sent
+// this many data bytes.
+#define BENCH_MIN_TRANSACTIONS 512
+#define BENCH_MIN_BYTES (256 * 1024)
+#define BENCH_MAX_BATCH 128
+
+// PWM slice used as the cycle counter for the transaction timestamps
+#define BENCH_PWM_SLICE 7
+
+enum bench_op { OP_READ, OP_FAST_READ, OP_WRITE, OP_MIXED, NUM_OPS };
+static const char* op_names[NUM_OPS] = {"READ", "FAST READ", "WRITE", "Mixed"};
+
+struct transaction {
+    uint8_t* buf;
+    uint32_t addr;
+    uint32_t seed;
+    uint8_t op;
+};
+
+struct result {
+    bool pass;
+    uint transactions;
+    float mb_s;
+    uint32_t latency_ns[4];
+};
+
+struct max_rate {
+    uint32_t sys_khz;
+    uint8_t op;
+    uint8_t align;
+    uint len;
+    uint period;
+    float mb_s;
+};
+
+// The transactions are sent from, and received back into, the same buffer
+static uint8_t arena[65536 + 4];
+static uint8_t shadow[SIM_SRAM_SIZE];
+static uint32_t queue_storage[PIO_SPI_QUEUE_WORDS(BENCH_MAX_BATCH)];
+static uint32_t stamps[2 * BENCH_MAX_BATCH];
+static transaction batch[BENCH_MAX_BATCH];
+static uint32_t latencies[BENCH_MIN_TRANSACTIONS + BENCH_MAX_BATCH];
+static max_rate max_rates[NUM_OPS * count_of(lengths) * 4 * count_of(sys_khz)];
+
+static uint32_t xorshift(uint32_t& x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static int header_len(int op) {
+    return op == OP_FAST_READ ? 4 : 3;
+}
+
+// Fill the arena with as many transactions as fit, and queue them.
+static uint fill_batch(pio_spi_queue_t* q, const pio_spi_inst_t* spi, bench_op op, uint len, uint align) {
+    pio_spi_queue_init(q, spi, queue_storage, count_of(queue_storage), stamps,
+                       &pwm_hw->slice[BENCH_PWM_SLICE].ctr, BENCH_CS_HIGH_CYCLES);
+
+    uint8_t* buf = arena;
+    uint n = 0;
+    for (; n < BENCH_MAX_BATCH; ++n) {
+        transaction& t = batch[n];
+        t.op = op == OP_MIXED ? rand() % 3 : op;
+        const int hdr = header_len(t.op);
+        if (buf + hdr + len > arena + sizeof(arena)) break;
+
+        t.buf = buf;
+        t.addr = (rand() % ((SIM_SRAM_SIZE - len - align) / 4 + 1)) * 4 + align;
+        t.seed = rand() | 1;
+        buf[0] = t.op == OP_READ ? 0x3 : (t.op == OP_FAST_READ ? 0xB : 0x2);
+        buf[1] = t.addr >> 8;
+        buf[2] = t.addr & 0xff;
+        buf[3] = 0;
+        if (t.op == OP_WRITE) {
+            uint32_t x = t.seed;
+            for (uint j = 0; j < len; ++j) buf[hdr + j] = xorshift(x);
+        }
+        pio_spi_queue_add(q, buf, buf, hdr + len);
+        buf += hdr + len;
+    }
+    return n;
+}
+
+// Check each READ against the RAM as it was at that point, and the RAM
+// against all the WRITEs.
+static bool check_batch(const uint8_t* emu_ram, uint n, uint len) {
+    for (uint i = 0; i < n; ++i) {
+        const transaction& t = batch[i];
+        const uint8_t* data = t.buf + header_len(t.op);
+        if (t.op == OP_WRITE) {
+            uint32_t x = t.seed;
+            for (uint j = 0; j < len; ++j) shadow[t.addr + j] = xorshift(x);
+        }
+        else if (memcmp(data, &shadow[t.addr], len) != 0) return false;
+    }
+    return memcmp(emu_ram, shadow, SIM_SRAM_SIZE) == 0;
+}
+
+static result run_rate(pio_spi_queue_t* q, const pio_spi_inst_t* spi, uint8_t* emu_ram,
+                       bench_op op, uint len, uint align, uint period) {
+    // Slow the timestamp counter so the longest transaction fits in its 16 bits
+    const uint32_t expected_cycles = (len + 4) * 8 * period + 1024;
+    const uint div = std::min<uint32_t>(expected_cycles / 49152 + 1, 255);
+    pwm_set_clkdiv_int_frac(BENCH_PWM_SLICE, div, 0);
+
+    result r = {true, 0, 0.f, {0, 0, 0, 0}};
+    uint64_t bytes = 0, elapsed_us = 0;
+    while (r.transactions < BENCH_MIN_TRANSACTIONS && bytes < BENCH_MIN_BYTES) {
+        uint n = fill_batch(q, spi, op, len, align);
+        memcpy(shadow, emu_ram, SIM_SRAM_SIZE);
+
+        uint32_t start = time_us_32();
+        pio_spi_queue_start(q);
+        pio_spi_queue_wait(q);
+        elapsed_us += time_us_32() - start;
+
+        if (!check_batch(emu_ram, n, len)) {
+            r.pass = false;
+            break;
+        }
+        for (uint i = 0; i < n; ++i) {
+            latencies[r.transactions++] = ((stamps[2 * i + 1] - stamps[2 * i]) & 0xffff) * div;
+        }
+        bytes += n * len;
+    }
+    if (!r.pass || !r.transactions) return r;
+
+    r.mb_s = (float)bytes / elapsed_us;
+
+    // Latency from just before CS falls to just after it rises, at the
+    // 50th, 90th and 99th percentiles and the maximum.
+    std::sort(latencies, latencies + r.transactions);
+    const uint percentiles[4] = {50, 90, 99, 100};
+    const uint32_t khz = clock_get_hz(clk_sys) / 1000;
+    for (int i = 0; i < 4; ++i) {
+        uint idx = std::min(r.transactions * percentiles[i] / 100, r.transactions - 1);
+        r.latency_ns[i] = (uint64_t)latencies[idx] * 1000000 / khz;
+    }
+    return r;
+}
+
+static void run_benchmark(uint8_t* emu_ram) {
+    pio_spi_inst_t spi = {
+        .pio = pio1,
+        .sm = (int)pio_claim_unused_sm(pio1, true),
+        .cs_pin = SIM_SRAM_SPI_CS
+    };
+
+    gpio_init(SIM_SRAM_SPI_CS);
+    gpio_put(SIM_SRAM_SPI_CS, true);
+    gpio_set_dir(SIM_SRAM_SPI_CS, true);
+
+    uint pio_spi_offset = pio_add_program(spi.pio, &spi_cpha0_program);
+    pio_spi_setup(&spi);
+    pio_spi_queue_setup(&spi);
+
+    pwm_config pwm = pwm_get_default_config();
+    pwm_config_set_wrap(&pwm, 0xffff);
+    pwm_init(BENCH_PWM_SLICE, &pwm, true);
+
+    pio_spi_queue_t q;
+    uint num_max = 0;
+
+    printf("sys_mhz,op,len,align,sck_div,sck_mhz,transactions,pass,mb_s,lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_max_ns\n");
+    for (uint32_t khz : sys_khz) {
+        if (khz > 200000) {
+            vreg_set_voltage(VREG_VOLTAGE_1_20);
+            sleep_ms(10);
+        }
+        set_sys_clock_khz(khz, true);
+
+        for (int op = 0; op < NUM_OPS; ++op) {
+            for (uint len : lengths) {
+                for (uint align = 0; align < 4; ++align) {
+                    if (len + align > SIM_SRAM_SIZE) continue;
+
+                    // Stop at the first failure, the fastest passing rate is
+                    // the one before.
+                    max_rate& m = max_rates[num_max++];
+                    m = {khz, (uint8_t)op, (uint8_t)align, len, 0, 0.f};
+                    for (uint period : sck_periods) {
+                        pio_spi_init(spi.pio, spi.sm, pio_spi_offset, 8, period / 2, false, false,
+                                     SIM_SRAM_SPI_SCK, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MISO);
+                        result r = run_rate(&q, &spi, emu_ram, (bench_op)op, len, align, period);
+                        printf("%.1f,%s,%u,%u,%u,%.2f,%u,%d,%.3f,%lu,%lu,%lu,%lu\n", khz / 1000.f, op_names[op],
+                               len, align, period, khz / 1000.f / period, r.transactions, r.pass, r.mb_s,
+                               r.latency_ns[0], r.latency_ns[1], r.latency_ns[2], r.latency_ns[3]);
+                        if (!r.pass) break;
+                        m.period = period;
+                        m.mb_s = r.mb_s;
+                    }
+                }
+            }
+        }
+    }
+
+    // A max_sck_div of 0 means it failed at the slowest rate.
+    printf("\nsys_mhz,op,len,align,max_sck_div,max_sck_mhz,mb_s\n");
+    for (uint i = 0; i < num_max; ++i) {
+        const max_rate& m = max_rates[i];
+        printf("%.1f,%s,%u,%u,%u,%.2f,%.3f\n", m.sys_khz / 1000.f, op_names[m.op], m.len, m.align, m.period,
+               m.period ? m.sys_khz / 1000.f / m.period : 0.f, m.mb_s);
+    }
+}
+
+int main() {
+    stdio_init_all();
+
+    uint8_t* emu_ram = setup_simulated_sram();
+
+    // Init the RAM to known values
+    for (int i = 0; i < SIM_SRAM_SIZE; ++i) emu_ram[i] = i;
+
+    sleep_ms(5000);
+
+    run_benchmark(emu_ram);
+    printf("\nDone\n");
+
+    while (true) sleep_ms(1000);
+}
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pico/stdlib.h"
 #include "hardware/pio.h"
 #include "hardware/dma.h"
 #include "hardware/structs/bus_ctrl.h"
 
+#include "logic.h"
+#include "sram_protocol.h"
+
 static inline uint bits_packed_per_word(uint pin_count) {
     // If the number of pins to be sampled divides the shift register size, we
     // can use the full SR and FIFO width, and push when the input shift count
@@ -83,4 +87,210 @@ void print_capture_buf(const uint32_t *buf, uint pin_base, uint pin_count, uint3
         }
         printf("\n");
     }
-}
\ No newline at end of file
+}
+
+void print_capture_words(const uint32_t *buf, uint32_t n_words) {
+    // The raw capture, 8 words to a line, for sim/trace_main.cpp to decode
+    printf("Words:\n");
+    for (uint32_t i = 0; i < n_words; ++i) {
+        printf("%08lx%c", buf[i], i % 8 == 7 || i == n_words - 1 ? '\n' : ' ');
+    }
+}
+
+// Continuous capture.  The data channel writes the samples into the ring
+// buffer, and chains to the control channel each time its count runs out,
+// which rewrites the count and so restarts it where it left off.
+#define LOGIC_STREAM_COUNT 0x40000000u
+static uint32_t stream_count = LOGIC_STREAM_COUNT;
+
+void logic_stream_start(logic_stream_t* s, PIO pio, uint sm, uint pin_base, uint32_t* ring, uint ring_bits,
+                        uint dma_chan, uint ctrl_chan) {
+    pio_sm_set_enabled(pio, sm, false);
+    pio_sm_clear_fifos(pio, sm);
+    pio_sm_restart(pio, sm);
+
+    s->pio = pio;
+    s->sm = sm;
+    s->ring = ring;
+    s->ring_words = (1u << ring_bits) / 4;
+    s->dma_chan = dma_chan;
+    s->ctrl_chan = ctrl_chan;
+    s->read_index = 0;
+    s->unread = 0;
+    s->last_remaining = LOGIC_STREAM_COUNT;
+    s->word = 0;
+    s->shift = 32;
+    s->prev = (gpio_get_all() >> pin_base) & 0xf;
+    s->time = 0;
+    s->lost = 0;
+    s->gap = false;
+
+    dma_channel_config c = dma_channel_get_default_config(dma_chan);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, ring_bits);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+    channel_config_set_chain_to(&c, ctrl_chan);
+    dma_channel_configure(dma_chan, &c, ring, &pio->rxf[sm], LOGIC_STREAM_COUNT, true);
+
+    c = dma_channel_get_default_config(ctrl_chan);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    dma_channel_configure(ctrl_chan, &c, &dma_hw->ch[dma_chan].al1_transfer_count_trig, &stream_count, 1, false);
+
+    pio_sm_set_enabled(pio, sm, true);
+}
+
+void logic_stream_stop(logic_stream_t* s) {
+    pio_sm_set_enabled(s->pio, s->sm, false);
+    dma_channel_abort(s->ctrl_chan);
+    dma_channel_abort(s->dma_chan);
+}
+
+// Load the next word of samples.  Returns false if the DMA hasn't written it yet.
+static bool stream_next_word(logic_stream_t* s) {
+    if (s->unread < 2) {
+        // The count reloads to LOGIC_STREAM_COUNT when the control channel restarts the data channel
+        uint32_t remaining = dma_hw->ch[s->dma_chan].transfer_count;
+        if (remaining <= s->last_remaining) s->unread += s->last_remaining - remaining;
+        else s->unread += s->last_remaining + LOGIC_STREAM_COUNT - remaining;
+        s->last_remaining = remaining;
+
+        // Once the DMA is close to lapping the reader, drop the older
+        // samples and carry on from the newest half of the ring
+        if (s->unread > s->ring_words - 8) {
+            const uint32_t dropped = s->unread - s->ring_words / 2;
+            s->lost += dropped * 8;
+            s->time += dropped * 8;
+            s->read_index = (s->read_index + dropped) & (s->ring_words - 1);
+            s->unread -= dropped;
+            s->gap = true;
+        }
+
+        // The newest word is left in case its write hasn't completed
+        if (s->unread < 2) return false;
+    }
+    s->word = s->ring[s->read_index];
+    s->read_index = (s->read_index + 1) & (s->ring_words - 1);
+    --s->unread;
+    s->shift = 0;
+    return true;
+}
+
+bool logic_stream_next_change(logic_stream_t* s, logic_change_t* change) {
+    while (true) {
+        if (s->shift == 32 && !stream_next_word(s)) return false;
+
+        // Skip the samples that match the last one, a whole word at a time if possible
+        const uint32_t diff = (s->word ^ (s->prev * 0x11111111u)) >> s->shift;
+        if (!diff) {
+            s->time += (32 - s->shift) / 4;
+            s->shift = 32;
+            continue;
+        }
+        const uint same = __builtin_ctz(diff) / 4;
+        s->time += same;
+        s->shift += same * 4;
+
+        s->prev = (s->word >> s->shift) & 0xf;
+        change->sample = s->prev;
+        change->time = s->time;
+        change->gap = s->gap;
+        s->gap = false;
+        s->time += 1;
+        s->shift += 4;
+        return true;
+    }
+}
+
+void logic_spi_decoder_init(logic_spi_decoder_t* d, const logic_stream_t* s, uint pin_base, uint mosi, uint sck,
+                            uint cs, uint miso) {
+    d->mosi_bit = mosi - pin_base;
+    d->sck_bit = sck - pin_base;
+    d->cs_bit = cs - pin_base;
+    d->miso_bit = miso - pin_base;
+    d->prev = s->prev;
+    // If CS is already low, the transaction in progress is skipped
+    d->selected = false;
+    d->cs_rise = 0;
+    d->last_sck = 0;
+}
+
+bool logic_spi_decode(logic_spi_decoder_t* d, logic_stream_t* s, logic_spi_transaction_t* out) {
+    logic_change_t c;
+    while (logic_stream_next_change(s, &c)) {
+        const uint32_t changed = c.sample ^ d->prev;
+        d->prev = c.sample;
+        logic_spi_transaction_t* t = &d->t;
+        if (c.gap && d->selected) t->lost = true;
+
+        if (changed & (1u << d->cs_bit)) {
+            if (!(c.sample & (1u << d->cs_bit))) {
+                memset(t, 0, sizeof(*t));
+                t->start = c.time;
+                t->cs_high = c.time - d->cs_rise;
+                t->lost = c.gap;
+                d->selected = true;
+            }
+            else {
+                d->cs_rise = c.time;
+                if (d->selected) {
+                    d->selected = false;
+                    t->cs_low = c.time - t->start;
+                    if (t->bits) t->last_sck = c.time - d->last_sck;
+                    *out = *t;
+                    return true;
+                }
+            }
+        }
+        else if (d->selected && (changed & c.sample & (1u << d->sck_bit))) {
+            // SCK rose, in mode 0 both data lines are sampled on the rising edge
+            if (t->bits == 0) t->first_sck = c.time - t->start;
+            else {
+                const uint32_t period = c.time - d->last_sck;
+                if (t->bits == 1 || period < t->sck_min) t->sck_min = period;
+                if (period > t->sck_max) t->sck_max = period;
+            }
+            d->last_sck = c.time;
+
+            const uint i = t->bits / 8;
+            if (i < LOGIC_SPI_MAX_BYTES) {
+                t->mosi[i] = (t->mosi[i] << 1) | ((c.sample >> d->mosi_bit) & 1);
+                t->miso[i] = (t->miso[i] << 1) | ((c.sample >> d->miso_bit) & 1);
+            }
+            ++t->bits;
+        }
+    }
+    return false;
+}
+
+void print_spi_transaction(const logic_spi_transaction_t* t, uint addr_bytes) {
+    // One line per transaction, with the times in samples:
+    // 1234567 +200 low 160 sck 8-8 first 12 last 4: 03 1234 <- 00 01 02 03
+    printf("%llu +%lu low %lu sck %lu-%lu first %lu last %lu:", (unsigned long long)t->start, t->cs_high, t->cs_low,
+           t->sck_min, t->sck_max, t->first_sck, t->last_sck);
+
+    const uint bytes = t->bits / 8;
+    const uint stored = bytes < LOGIC_SPI_MAX_BYTES ? bytes : LOGIC_SPI_MAX_BYTES;
+    if (bytes == 0) printf(" no command");
+    else {
+        const uint8_t cmd = t->mosi[0];
+        printf(" %02x", cmd);
+        uint data = 1;
+        if ((cmd == SIM_SRAM_READ_CMD || cmd == SIM_SRAM_FAST_READ_CMD || cmd == SIM_SRAM_WRITE_CMD) &&
+            stored > addr_bytes) {
+            printf(" ");
+            for (uint i = 1; i <= addr_bytes; ++i) printf("%02x", t->mosi[i]);
+            data = 1 + addr_bytes + (cmd == SIM_SRAM_FAST_READ_CMD);
+        }
+        // The data is on MISO for reads, and on MOSI for everything else
+        const bool read = cmd == SIM_SRAM_READ_CMD || cmd == SIM_SRAM_FAST_READ_CMD;
+        const uint8_t* buf = read ? t->miso : t->mosi;
+        if (data < stored) printf(read ? " <-" : " ->");
+        for (uint i = data; i < stored; ++i) printf(" %02x", buf[i]);
+        if (bytes > stored) printf(" ... %u bytes", bytes);
+    }
+    if (t->bits % 8) printf(" +%lu bits", t->bits % 8);
+    if (t->lost) printf(" LOST SAMPLES");
+    printf("\n");
+}
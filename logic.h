@@ -2,3 +2,78 @@ void logic_analyser_init(PIO pio, uint sm, uint pin_base, uint pin_count, float
 void logic_analyser_arm(PIO pio, uint sm, uint dma_chan, uint32_t *capture_buf, size_t capture_size_words,
                         uint trigger_pin, bool trigger_level);
 void print_capture_buf(const uint32_t *buf, uint pin_base, uint pin_count, uint32_t n_samples);
+void print_capture_words(const uint32_t *buf, uint32_t n_words);
+
+// Continuous capture of 4 pins, set up with logic_analyser_init(), into a
+// ring buffer that core0 reads behind the DMA.  Runs of unchanged samples
+// are skipped, so core0 only does work for each change.
+typedef struct {
+    PIO pio;
+    uint sm;
+    const uint32_t* ring;
+    uint32_t ring_words;
+    uint dma_chan, ctrl_chan;
+    uint32_t read_index;        // Next word of the ring to read
+    uint32_t unread;            // Words the DMA has written that haven't been read
+    uint32_t last_remaining;    // The data channel's transfer count when last read
+    uint32_t word;              // The word being read, and the bit of the next sample in it
+    uint shift;
+    uint32_t prev;              // The last sample
+    uint64_t time;              // Index of the next sample
+    uint64_t lost;              // Samples dropped because core0 fell behind
+    bool gap;                   // Samples were dropped before the next change
+} logic_stream_t;
+
+typedef struct {
+    uint32_t sample;            // The pins, pin_base in bit 0
+    uint64_t time;              // Index of the sample since the capture started
+    bool gap;                   // Samples were dropped since the last change
+} logic_change_t;
+
+// The ring must be 1 << ring_bits bytes, aligned to its size.  Two DMA
+// channels are used, and run until logic_stream_stop().
+void logic_stream_start(logic_stream_t* s, PIO pio, uint sm, uint pin_base, uint32_t* ring, uint ring_bits,
+                        uint dma_chan, uint ctrl_chan);
+void logic_stream_stop(logic_stream_t* s);
+
+// Returns the next sample that differs from the one before, or false if
+// there is none in the samples captured so far.
+bool logic_stream_next_change(logic_stream_t* s, logic_change_t* change);
+
+// Bytes of MOSI and MISO kept for each transaction, longer transactions are
+// counted but not stored
+#define LOGIC_SPI_MAX_BYTES 32
+
+// An SPI mode 0 transaction.  Times are in samples.
+typedef struct {
+    uint64_t start;             // When CS fell
+    uint32_t cs_high;           // CS high time before the transaction
+    uint32_t cs_low;            // CS low time
+    uint32_t first_sck;         // From CS falling to the first rising edge of SCK
+    uint32_t last_sck;          // From the last rising edge of SCK to CS rising
+    uint32_t sck_min, sck_max;  // Shortest and longest SCK period, between rising edges
+    uint32_t bits;              // Rising edges of SCK
+    bool lost;                  // Samples were dropped during the transaction
+    uint8_t mosi[LOGIC_SPI_MAX_BYTES];
+    uint8_t miso[LOGIC_SPI_MAX_BYTES];
+} logic_spi_transaction_t;
+
+typedef struct {
+    uint mosi_bit, sck_bit, cs_bit, miso_bit;
+    uint32_t prev;
+    bool selected;
+    uint64_t cs_rise, last_sck;
+    logic_spi_transaction_t t;
+} logic_spi_decoder_t;
+
+// The pins must all be in the 4 captured from pin_base
+void logic_spi_decoder_init(logic_spi_decoder_t* d, const logic_stream_t* s, uint pin_base, uint mosi, uint sck,
+                            uint cs, uint miso);
+
+// Decode the changes captured so far.  Returns true when a transaction
+// finishes, with it in out, and false once it runs out of samples.
+bool logic_spi_decode(logic_spi_decoder_t* d, logic_stream_t* s, logic_spi_transaction_t* out);
+
+// Print a transaction on one line, the command, the address of READs, FAST
+// READs and WRITEs and the data
+void print_spi_transaction(const logic_spi_transaction_t* t, uint addr_bytes);
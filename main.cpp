@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <hardware/clocks.h>
 #include <hardware/pio.h>
 
 extern "C" {
@@ -14,20 +15,73 @@ extern "C" {
 
 uint32_t logic_buf[1024];
 
-int main() {
-    stdio_init_all();
-
-    uint8_t* emu_ram = setup_simulated_sram();
+// Set to measure the fastest SCK with and without core0 hammering its RAM,
+// instead of running the logic analyser.  Connect nothing to the SPI pins:
+// pio1 drives them as the master.
+#define RUN_CONTENTION_BENCHMARK 0
+
+// Set to stream each SPI transaction seen on the pins over stdio, decoded
+// from a continuous capture, instead of the one shot logic analyser.
+#define RUN_LOGIC_STREAM 0
+
+// Set to also print the one shot captures as words, for spi-trace to decode.
+#define PRINT_CAPTURE_WORDS 0
+
+// The capture runs at SYS clock / LOGIC_STREAM_DIV.  Core0 has to decode the
+// edges as fast as they arrive, or samples are dropped, so sample no faster
+// than needed to see each half of SCK.
+#define LOGIC_STREAM_DIV 2
+
+#if RUN_CONTENTION_BENCHMARK
+// Core0's load: copying between two buffers in its RAM as fast as it can.
+// In the default layout these are striped over the same banks as the
+// emulated RAM, in the non-striped layout they are in the other banks.
+static uint32_t load_buf[2][1024];
+
+// Run one transaction with the master's DMA, copying load_buf until it
+// finishes if load is set.
+static void transfer_under_load(const pio_spi_inst_t* spi, uint8_t* out, uint8_t* in, size_t len, bool load) {
+    gpio_put(SIM_SRAM_SPI_CS, false);
+    pio_spi_write8_read8_start(spi, out, in, len);
+    while (pio_spi_is_busy(spi)) {
+        if (load) memcpy(load_buf[1], load_buf[0], 256);
+    }
+    gpio_put(SIM_SRAM_SPI_CS, true);
+}
 
-    // Init the RAM to known values
-    for (int i = 0; i < 65536; ++i) emu_ram[i] = i;
+// Random READs, FAST READs and WRITEs of 8 bytes, checked against the RAM.
+// Returns false on the first failure.
+static bool run_transactions(const pio_spi_inst_t* spi, uint8_t* emu_ram, int count, bool load) {
+    constexpr int BUF_LEN = 4 + 8;
+    uint8_t out_buf[BUF_LEN], in_buf[BUF_LEN];
+    for (int i = 0; i < count; ++i) {
+        int addr = rand() % (SIM_SRAM_SIZE - BUF_LEN);
+        int cmd = rand() % 3;
+        out_buf[0] = cmd == 0 ? 0x3 : (cmd == 1 ? 0xB : 0x2);
+        out_buf[1] = addr >> 8;
+        out_buf[2] = addr & 0xff;
+        for (int j = 3; j < BUF_LEN; ++j) out_buf[j] = rand();
+
+        // The data starts after the dummy byte for FAST READ
+        int data = cmd == 1 ? 4 : 3;
+        transfer_under_load(spi, out_buf, in_buf, cmd == 1 ? BUF_LEN : BUF_LEN - 1, load);
+        for (int j = 0; j < 8; ++j) {
+            uint8_t expected = cmd == 2 ? out_buf[3 + j] : emu_ram[addr + j];
+            uint8_t got = cmd == 2 ? emu_ram[addr + j] : in_buf[data + j];
+            if (got != expected) return false;
+        }
+    }
+    return true;
+}
 
-    sleep_ms(5000);
+// Sweep the SCK period down from SYS/16, without and with the load, and
+// report the fastest that passes each way.
+static void run_contention_benchmark(uint8_t* emu_ram) {
+    static_assert(SIM_SRAM_ADDR_BITS == 16, "The contention benchmark sends 16-bit addresses");
 
-#if 0
     pio_spi_inst_t spi = {
         .pio = pio1,
-        .sm = pio_claim_unused_sm(pio1, true),
+        .sm = (int)pio_claim_unused_sm(pio1, true),
         .cs_pin = SIM_SRAM_SPI_CS
     };
 
@@ -36,178 +90,127 @@ int main() {
     gpio_set_dir(SIM_SRAM_SPI_CS, true);
 
     uint pio_spi_offset = pio_add_program(spi.pio, &spi_cpha0_program);
-
     pio_spi_setup(&spi);
 
-    constexpr int BUF_LEN = 8 + 4;
-    uint8_t out_buf[BUF_LEN], in_buf[BUF_LEN];
-
-    //int logic_sm = pio_claim_unused_sm(pio1, true);
-    //logic_analyser_init(pio1, logic_sm, SIM_SRAM_SPI_MOSI, 4, 1);
-
-    int speed_incr = 1;
-    for (int divider = 12; divider > 1; divider -= speed_incr) 
-    {
-        if (divider <= 3) divider = 4;
-
-        pio_spi_init(spi.pio, spi.sm, pio_spi_offset, 8, divider, false, false, SIM_SRAM_SPI_SCK, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MISO);
-        printf("\nTesting at %.03fMHz\n", 125.f/(2 * divider));
-        for (int runs = 0; runs < 2000; ++runs) {
-            int addr = (rand() % (65536 - BUF_LEN)) & ~3;
-
-#if 1
-            // Read 8 bytes from addr
-            //logic_analyser_arm(pio1, logic_sm, 11, logic_buf, 128, SPI_CS, false);
-            out_buf[0] = 0x3;
-            out_buf[1] = addr >> 8;
-            out_buf[2] = addr & 0xff;
-            memset(&out_buf[3], 0, 9);
-            gpio_put(SIM_SRAM_SPI_CS, false);
-            pio_spi_write8_read8_blocking(&spi, out_buf, in_buf, BUF_LEN);
-            gpio_put(SIM_SRAM_SPI_CS, true);
-
-#if 0
-            printf("Read from addr %04x: ", addr);
-            bool ok = true;
-            uint8_t* data_buf = &in_buf[3];
-            for (int i = 0; i < 8; ++i) {
-                printf("%02hhx ", data_buf[i]);
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }
-            printf("%s", ok ? "OK\n" : "FAIL!\n");
-#else
-            bool ok = true;
-            uint8_t* data_buf = &in_buf[3];
-            for (int i = 0; i < 9; ++i) {
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }
-#endif
-            //print_capture_buf(logic_buf, 18, 4, 128*8);
-            //sleep_ms(1000);
-            //sleep_us(1);
-            if (!ok) {
-                printf("Read from addr %04x: ", addr);
-                uint8_t* data_buf = &in_buf[3];
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", data_buf[i]);
-                }
-                printf("FAIL!\nExpected:            ");
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", emu_ram[addr + i]);
-                }
-                printf("\n");
-                //print_capture_buf(logic_buf, 18, 4, 128*8);
-                divider += 2;
-                speed_incr = 1;
-                break;
-            }
-#endif 
-
-#if 1
-            // Fast read 8 bytes from addr
-            addr = rand() % (65536 - BUF_LEN);
-            out_buf[0] = 0xB;
-            out_buf[1] = addr >> 8;
-            out_buf[2] = addr & 0xff;
-            memset(&out_buf[3], 0, 9);
-            gpio_put(SIM_SRAM_SPI_CS, false);
-            pio_spi_write8_read8_blocking(&spi, out_buf, in_buf, BUF_LEN);
-            gpio_put(SIM_SRAM_SPI_CS, true);
-
-#if 0
-            printf("Fast read from addr %04x: ", addr);
-            bool ok = true;
-            uint8_t* data_buf = &in_buf[4];
-            for (int i = 0; i < 8; ++i) {
-                printf("%02hhx ", data_buf[i]);
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }
-            printf("%s", ok ? "OK\n" : "FAIL!\n");
-#else
-            ok = true;
-            data_buf = &in_buf[4];
-            for (int i = 0; i < 8; ++i) {
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }
-#endif
-            //print_capture_buf(logic_buf, 18, 4, 128*8);
-            //sleep_ms(1000);
-            //sleep_us(1);
-            if (!ok) {
-                printf("Fast read from addr %04x: ", addr);
-                uint8_t* data_buf = &in_buf[4];
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", data_buf[i]);
-                }
-                printf("FAIL!\nExpected:                 ");
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", emu_ram[addr + i]);
-                }
-                printf("\n");
-                divider += 2;
-                speed_incr = 1;
-                break;
+    while (true) {
+        uint fastest[2] = {0, 0};
+        for (int load = 0; load < 2; ++load) {
+            // The master takes 2 SYS clocks per divider step for each bit
+            for (uint period = 16; period >= 4; period -= 2) {
+                pio_spi_init(spi.pio, spi.sm, pio_spi_offset, 8, period / 2, false, false,
+                             SIM_SRAM_SPI_SCK, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MISO);
+                if (!run_transactions(&spi, emu_ram, 10000, load)) break;
+                fastest[load] = period;
             }
-#endif
+        }
+        printf("\nFastest SCK passing 10000 transactions:\n");
+        for (int load = 0; load < 2; ++load) {
+            if (fastest[load]) printf("%-14s SYS/%u, %.1fMHz\n", load ? "core0 load" : "no load", fastest[load],
+                                      clock_get_hz(clk_sys) / 1e6f / fastest[load]);
+            else printf("%-14s fails at SYS/16\n", load ? "core0 load" : "no load");
+        }
 
-            // Write 8 bytes to addr
-            addr = rand() % (65536 - BUF_LEN);
-            out_buf[0] = 0x2;
-            out_buf[1] = addr >> 8;
-            out_buf[2] = addr & 0xff;
-            for (int i = 0; i < 8; ++i) {
-                out_buf[i+3] = rand();
-            }
-            gpio_put(SIM_SRAM_SPI_CS, false);
-            pio_spi_write8_read8_blocking(&spi, out_buf, in_buf, BUF_LEN);
-            gpio_put(SIM_SRAM_SPI_CS, true);
-
-#if 0
-            printf("Write to addr %04x: ", addr);
-            ok = true;
-            data_buf = &out_buf[3];
-            for (int i = 0; i < 8; ++i) {
-                printf("%02hhx ", emu_ram[addr + i]);
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }
-            printf("%s", ok ? "OK\r" : "FAIL!\n");
-#else
-            ok = true;
-            data_buf = &out_buf[3];
-            for (int i = 0; i < 9; ++i) {
-                if (data_buf[i] != emu_ram[addr + i]) ok = false;
-            }            
+        // The row of the contention table in the README for this layout
+        printf("| %s |", SIM_SRAM_NON_STRIPED ? "Non-striped" : "Striped");
+        for (int load = 0; load < 2; ++load) {
+            if (fastest[load]) printf(" SYS clock / %u |", fastest[load]);
+            else printf(" fails at SYS clock / 16 |");
+        }
+        printf("\n");
+        sleep_ms(5000);
+    }
+}
 #endif
 
-            //sleep_us(1);
-            if (!ok) {
-                printf("Write to addr %x: ", addr);
-                uint8_t* data_buf = &out_buf[3];
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", emu_ram[addr + i]);
-                }
-                printf("FAIL!\nExpected:             ");
-                for (int i = 0; i < 8; ++i) {
-                    printf("%02hhx ", data_buf[i]);
-                }
-                printf("\n");
-                //divider++;
-                speed_incr = 0;
-                break;
-            }
+#if RUN_LOGIC_STREAM
+// 32kB of samples, the largest DMA ring.  It must be aligned to its size.
+#define LOGIC_RING_BITS 15
+static uint32_t logic_ring[(1 << LOGIC_RING_BITS) / 4] __attribute__((aligned(1 << LOGIC_RING_BITS)));
+
+static void run_logic_stream() {
+    static_assert(SIM_SRAM_SPI_MISO >= SIM_SRAM_SPI_MOSI && SIM_SRAM_SPI_MISO < SIM_SRAM_SPI_MOSI + 4,
+                  "The capture is of the 4 pins from MOSI");
+
+    int logic_sm = pio_claim_unused_sm(pio1, true);
+    logic_analyser_init(pio1, logic_sm, SIM_SRAM_SPI_MOSI, 4, LOGIC_STREAM_DIV);
+
+    logic_stream_t stream;
+    logic_stream_start(&stream, pio1, logic_sm, SIM_SRAM_SPI_MOSI, logic_ring, LOGIC_RING_BITS, 11, 10);
+    logic_spi_decoder_t decoder;
+    logic_spi_decoder_init(&decoder, &stream, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_SCK,
+                           SIM_SRAM_SPI_CS, SIM_SRAM_SPI_MISO);
+
+    printf("\nStreaming transactions, times in samples of %d SYS clocks\n", LOGIC_STREAM_DIV);
+    uint64_t lost = 0;
+    logic_spi_transaction_t t;
+    while (true) {
+        while (logic_spi_decode(&decoder, &stream, &t)) print_spi_transaction(&t, SIM_SRAM_ADDR_BITS / 8);
+        if (stream.lost != lost) {
+            lost = stream.lost;
+            printf("%llu samples lost\n", lost);
         }
-        if (divider > 50) divider = 50;
     }
+}
+#endif
+
+#if SIM_SRAM_ENABLE_STATS
+static void print_sram_stats() {
+    static const char* names[SIM_SRAM_STATS_NUM_COMMANDS] = {
+        "READ", "FAST READ", "WRITE", "CONT READ", "Other", "Unknown", "Aborted"
+    };
+    sim_sram_stats_t stats;
+    get_simulated_sram_stats(&stats);
+
+    printf("\nCommand     Count      Bytes      CS low histogram, <16 << n polls\n");
+    for (int i = 0; i < SIM_SRAM_STATS_NUM_COMMANDS; ++i) {
+        const sim_sram_command_stats_t& s = stats.command[i];
+        printf("%-10s %10lu %10lu ", names[i], s.count, s.bytes);
+        for (int b = 0; b < SIM_SRAM_STATS_BUCKETS; ++b) printf(" %lu", s.cs_low[b]);
+        printf("\n");
+    }
+}
+#endif
+
+int main() {
+    stdio_init_all();
+
+    uint8_t* emu_ram = setup_simulated_sram();
+
+    // Init the RAM to known values
+    for (int i = 0; i < 65536; ++i) emu_ram[i] = i;
+
+    sleep_ms(5000);
+
+#if RUN_CONTENTION_BENCHMARK
+    run_contention_benchmark(emu_ram);
+#elif RUN_LOGIC_STREAM
+    run_logic_stream();
 #else
     int logic_sm = pio_claim_unused_sm(pio1, true);
     logic_analyser_init(pio1, logic_sm, SIM_SRAM_SPI_MOSI, 4, 1);
+#if SIM_SRAM_ENABLE_STATS
+    absolute_time_t next_stats = make_timeout_time_ms(5000);
+#endif
 
     while (true) {
         while (gpio_get(SIM_SRAM_SPI_CS) == 0);
         logic_analyser_arm(pio1, logic_sm, 11, logic_buf, 128, SIM_SRAM_SPI_CS, false);
-        while (gpio_get(SIM_SRAM_SPI_CS) == 1);
+        while (gpio_get(SIM_SRAM_SPI_CS) == 1) {
+#if SIM_SRAM_ENABLE_STATS
+            // Print the statistics every 5 seconds while waiting for the
+            // next capture.  The capture is triggered by the PIO, so it
+            // isn't missed while printing.
+            if (time_reached(next_stats)) {
+                print_sram_stats();
+                next_stats = make_timeout_time_ms(5000);
+            }
+#endif
+        }
         while (gpio_get(SIM_SRAM_SPI_CS) == 0);
         print_capture_buf(logic_buf, SIM_SRAM_SPI_MOSI, 4, 128*8);
+#if PRINT_CAPTURE_WORDS
+        print_capture_words(logic_buf, 128);
+#endif
     }
 #endif
 }
\ No newline at end of file
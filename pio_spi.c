@@ -6,6 +6,7 @@
 
 #include <hardware/dma.h>
 #include <hardware/sync.h>
+#include <hardware/structs/iobank0.h>
 #include "pio_spi.h"
 
 // Just 8 bit functions provided here. The PIO program supports any frame size
@@ -53,13 +54,24 @@ void __time_critical_func(pio_spi_read8_blocking)(const pio_spi_inst_t *spi, uin
 
 static uint tx_channel;
 static uint rx_channel;
+static dma_channel_config tx_config;
+static dma_channel_config rx_config;
 
-void __time_critical_func(pio_spi_write8_read8_blocking)(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst,
-                                                         size_t len) {
+void __time_critical_func(pio_spi_write8_read8_start)(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst,
+                                                      size_t len) {
     uint32_t interrupt_status = save_and_disable_interrupts();
     dma_channel_transfer_from_buffer_now(tx_channel, src, len);
     dma_channel_transfer_to_buffer_now(rx_channel, dst, len);
     restore_interrupts(interrupt_status);
+}
+
+bool pio_spi_is_busy(const pio_spi_inst_t *spi) {
+    return dma_channel_is_busy(rx_channel);
+}
+
+void __time_critical_func(pio_spi_write8_read8_blocking)(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst,
+                                                         size_t len) {
+    pio_spi_write8_read8_start(spi, src, dst, len);
     dma_channel_wait_for_finish_blocking(rx_channel);
 }
 
@@ -72,6 +84,7 @@ void pio_spi_setup(const pio_spi_inst_t *spi) {
     channel_config_set_read_increment(&c, false);
     channel_config_set_write_increment(&c, true);
     channel_config_set_dreq(&c, pio_get_dreq(spi->pio, spi->sm, false));
+    rx_config = c;
 
     dma_channel_configure(
         rx_channel,          // Channel to be configured
@@ -87,6 +100,7 @@ void pio_spi_setup(const pio_spi_inst_t *spi) {
     channel_config_set_read_increment(&c, true);
     channel_config_set_write_increment(&c, false);
     channel_config_set_dreq(&c, pio_get_dreq(spi->pio, spi->sm, true));
+    tx_config = c;
 
     dma_channel_configure(
         tx_channel,          // Channel to be configured
@@ -97,3 +111,132 @@ void pio_spi_setup(const pio_spi_inst_t *spi) {
         false           // Start immediately.
     );
 }
+
+// The queue is run by two channels.  The control channel copies each 4 word
+// op into the op channel's READ_ADDR, WRITE_ADDR, TRANS_COUNT and CTRL_TRIG,
+// and the op channel chains back to it when done, unless the op starts the
+// transfer, in which case the rx channel chains back when the last byte
+// arrives.  Ops write the CS pin's output override directly, as the DMA can't
+// reach the SIO.
+static uint queue_ctrl_channel;
+static uint queue_op_channel;
+static uint32_t rx_idle_ctrl;
+static const uint32_t queue_done_value = 1;
+
+static uint32_t *add_queue_op(uint32_t *op, const volatile void *src, volatile void *dst, uint count,
+                              bool increment, bool chain) {
+    dma_channel_config c = dma_channel_get_default_config(queue_op_channel);
+    channel_config_set_read_increment(&c, increment);
+    channel_config_set_write_increment(&c, increment);
+    channel_config_set_chain_to(&c, chain ? queue_ctrl_channel : queue_op_channel);
+    channel_config_set_irq_quiet(&c, true);
+    op[0] = (uint32_t)src;
+    op[1] = (uint32_t)dst;
+    op[2] = count;
+    op[3] = channel_config_get_ctrl_value(&c);
+    return op + 4;
+}
+
+static uint32_t cs_ctrl_value(enum gpio_override over) {
+    return (GPIO_FUNC_SIO << IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB) | (over << IO_BANK0_GPIO0_CTRL_OUTOVER_LSB);
+}
+
+void pio_spi_queue_init(pio_spi_queue_t *q, const pio_spi_inst_t *spi, uint32_t *storage, size_t storage_words,
+                        uint32_t *stamps, const volatile uint32_t *stamp_src, uint cs_high_cycles) {
+    q->spi = spi;
+    q->ops = storage;
+    q->next = storage;
+    q->arm = storage + storage_words;
+    q->stamps = stamps;
+    q->stamp_src = stamp_src;
+    q->count = 0;
+    q->cs_high_cycles = cs_high_cycles;
+    q->cs_low = cs_ctrl_value(GPIO_OVERRIDE_LOW);
+    q->cs_high = cs_ctrl_value(GPIO_OVERRIDE_HIGH);
+    q->cs_normal = cs_ctrl_value(GPIO_OVERRIDE_NORMAL);
+    q->done = 1;
+}
+
+bool pio_spi_queue_add(pio_spi_queue_t *q, const uint8_t *src, uint8_t *dst, size_t len) {
+    if (q->arm - q->next < PIO_SPI_QUEUE_WORDS(1)) return false;
+
+    // The rx and tx channels are set up through their first alias, CTRL,
+    // READ_ADDR, WRITE_ADDR and TRANS_COUNT_TRIG, from the top of the storage.
+    q->arm -= 8;
+    uint32_t *rx_arm = q->arm;
+    uint32_t *tx_arm = q->arm + 4;
+    dma_channel_config c = rx_config;
+    channel_config_set_chain_to(&c, queue_ctrl_channel);
+    rx_arm[0] = channel_config_get_ctrl_value(&c);
+    rx_arm[1] = (uint32_t)&q->spi->pio->rxf[q->spi->sm];
+    rx_arm[2] = (uint32_t)dst;
+    rx_arm[3] = len;
+    tx_arm[0] = channel_config_get_ctrl_value(&tx_config);
+    tx_arm[1] = (uint32_t)src;
+    tx_arm[2] = (uint32_t)&q->spi->pio->txf[q->spi->sm];
+    tx_arm[3] = len;
+
+    io_rw_32 *cs_ctrl = &io_bank0_hw->io[q->spi->cs_pin].ctrl;
+    uint32_t *op = q->next;
+    if (q->stamps) op = add_queue_op(op, q->stamp_src, &q->stamps[2 * q->count], 1, false, true);
+    op = add_queue_op(op, &q->cs_low, cs_ctrl, 1, false, true);
+
+    // The rx channel is armed first, so that no byte can be missed, and
+    // chains back to the control channel after the last one.
+    op = add_queue_op(op, rx_arm, &dma_hw->ch[rx_channel].al1_ctrl, 4, true, true);
+    op = add_queue_op(op, tx_arm, &dma_hw->ch[tx_channel].al1_ctrl, 4, true, false);
+
+    op = add_queue_op(op, &q->cs_high, cs_ctrl, 1, false, true);
+    if (q->stamps) op = add_queue_op(op, q->stamp_src, &q->stamps[2 * q->count + 1], 1, false, true);
+
+    // Each transfer takes at least a cycle, so this holds CS high for at
+    // least cs_high_cycles before the next transaction.
+    if (q->cs_high_cycles) op = add_queue_op(op, &q->cs_high, &q->dummy, q->cs_high_cycles, false, true);
+
+    q->next = op;
+    q->count++;
+    return true;
+}
+
+void pio_spi_queue_start(pio_spi_queue_t *q) {
+    // Put the rx channel and CS back as pio_spi_write8_read8_start() expects
+    // them, then flag the queue done.  These go after the last transaction
+    // without being counted, so a queue can be started again.
+    uint32_t *op = q->next;
+    op = add_queue_op(op, &rx_idle_ctrl, &dma_hw->ch[rx_channel].al1_ctrl, 1, false, true);
+    op = add_queue_op(op, &q->cs_normal, &io_bank0_hw->io[q->spi->cs_pin].ctrl, 1, false, true);
+    add_queue_op(op, &queue_done_value, &q->done, 1, false, false);
+
+    q->done = 0;
+    dma_channel_set_read_addr(queue_ctrl_channel, q->ops, true);
+}
+
+bool pio_spi_queue_is_busy(const pio_spi_queue_t *q) {
+    return !q->done;
+}
+
+void pio_spi_queue_wait(const pio_spi_queue_t *q) {
+    while (!q->done) tight_loop_contents();
+}
+
+void pio_spi_queue_setup(const pio_spi_inst_t *spi) {
+    queue_ctrl_channel = dma_claim_unused_channel(true);
+    queue_op_channel = dma_claim_unused_channel(true);
+    rx_idle_ctrl = channel_config_get_ctrl_value(&rx_config);
+
+    // Copy 4 words into the op channel's first registers, wrapping the write
+    // address so each op lands in the same place.
+    dma_channel_config c = dma_channel_get_default_config(queue_ctrl_channel);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, 4);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_configure(
+        queue_ctrl_channel,
+        &c,
+        &dma_hw->ch[queue_op_channel].read_addr,
+        NULL,
+        4,
+        false
+    );
+}
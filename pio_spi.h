@@ -21,6 +21,56 @@ void pio_spi_read8_blocking(const pio_spi_inst_t *spi, uint8_t *dst, size_t len)
 
 void pio_spi_write8_read8_blocking(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst, size_t len);
 
+// Start a full duplex transfer run by the DMA, leaving the CPU free until
+// pio_spi_is_busy() returns false.
+void pio_spi_write8_read8_start(const pio_spi_inst_t *spi, uint8_t *src, uint8_t *dst, size_t len);
+
+bool pio_spi_is_busy(const pio_spi_inst_t *spi);
+
 void pio_spi_setup(const pio_spi_inst_t *spi);
 
+// A queue of full duplex transfers, each framed by CS, that the DMA runs back
+// to back without the CPU.  The CS pin must be set up as a SIO output driving
+// high.  src and dst may be the same buffer, each byte is sent before the
+// byte received in its place arrives.
+typedef struct pio_spi_queue {
+    const pio_spi_inst_t *spi;
+    uint32_t *ops;
+    uint32_t *next;
+    uint32_t *arm;
+    uint32_t *stamps;
+    const volatile uint32_t *stamp_src;
+    uint count;
+    uint cs_high_cycles;
+    uint32_t cs_low;
+    uint32_t cs_high;
+    uint32_t cs_normal;
+    uint32_t dummy;
+    volatile uint32_t done;
+} pio_spi_queue_t;
+
+// Words of storage needed by a queue of n transfers
+#define PIO_SPI_QUEUE_WORDS(n) ((n) * 36 + 12)
+
+// Claim the DMA channels for queues, after pio_spi_setup().
+void pio_spi_queue_setup(const pio_spi_inst_t *spi);
+
+// If stamps is set, the DMA copies *stamp_src, for example a free running
+// counter, into stamps[2 * i] before CS falls for transfer i and into
+// stamps[2 * i + 1] after CS rises.  CS is held high for at least
+// cs_high_cycles SYS clocks after each transfer.
+void pio_spi_queue_init(pio_spi_queue_t *q, const pio_spi_inst_t *spi, uint32_t *storage, size_t storage_words,
+                        uint32_t *stamps, const volatile uint32_t *stamp_src, uint cs_high_cycles);
+
+// Returns false if the storage is full.
+bool pio_spi_queue_add(pio_spi_queue_t *q, const uint8_t *src, uint8_t *dst, size_t len);
+
+// Run the queued transfers.  The queue may be started again once done, to
+// repeat them.
+void pio_spi_queue_start(pio_spi_queue_t *q);
+
+bool pio_spi_queue_is_busy(const pio_spi_queue_t *q);
+
+void pio_spi_queue_wait(const pio_spi_queue_t *q);
+
 #endif
@@ -0,0 +1,1199 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "core1_model.h"
+
+#include "firmware_config.h"
+#include "soc.h"
+
+// Cycle costs of the operations core1_main performs, for the Cortex-M0+
+// running from scratch X.  Loads from the PIO and DMA go over the AHB-Lite
+// crossbar, loads from the SIO are single cycle.
+namespace cost {
+    constexpr uint32_t FIFO_POLL = 5;       // Iteration of while (pio_sm_is_rx_fifo_empty())
+    constexpr uint32_t FIFO_READ = 3;       // Load from the RX FIFO
+    constexpr uint32_t CMP_BRANCH = 2;      // One arm of the if/else chain
+    constexpr uint32_t REG_WRITE = 2;       // Store of a precomputed value to a peripheral
+    constexpr uint32_t ATOMIC_WRITE = 4;    // hw_set_bits/hw_clear_bits, including building the mask
+    constexpr uint32_t ALU = 1;
+    constexpr uint32_t GPIO_READ = 1;       // gpio_get
+    constexpr uint32_t GPIO_POLL = 4;       // Iteration of the loop in wait_for_cs_high()
+    constexpr uint32_t ABORT_POLL = 5;      // Iteration of while (dma_hw->abort & mask)
+    constexpr uint32_t SM_EXEC = 3;
+    constexpr uint32_t FLASH_ADDR = 5;      // flash_addr(): mask, shift and two adds
+    constexpr uint32_t SECTOR_RANGE = 8;    // mark_sectors_written(): the checks and first and last sector
+    constexpr uint32_t SECTOR_MARK = 6;     // Loop iteration of mark_sectors_written(), incrementing an SRAM word
+    constexpr uint32_t WRITE_EVENT = 18;    // push_write_event(): the full check and 5 stores to SRAM
+    constexpr uint32_t DOORBELL_CHECK = 8;  // check_doorbell(): finding the last byte and the window compare
+    constexpr uint32_t DOORBELL = 20;       // Queueing the doorbell: the full check, loading the word, 4 stores and SEV
+    constexpr uint32_t SNAPSHOT_BEGIN = 6;  // begin_snapshot_write(): storing 0, and the load, add and store of gen
+    constexpr uint32_t SNAPSHOT_END = 8;    // end_snapshot_range(): two stores, and the load, add and store of gen
+    constexpr uint32_t STATS_UPDATE = 18;   // update_stats(): the count, bytes and histogram updates in SRAM
+    constexpr uint32_t STATS_BUCKET = 5;    // Iteration of the histogram bucket loop
+    constexpr uint32_t CRC_STATUS = 12;     // update_crc_status(): two DMA loads, byte reverse and two stores
+    constexpr uint32_t CRC_LEN = 7;         // Clipping the length in start_crc()
+    constexpr uint32_t BULK_STATUS = 14;    // update_bulk_status(): two DMA loads, shifts, byte reverse and two stores
+    constexpr uint32_t BULK_START = 16;     // start_bulk(): clipping the length and choosing the transfer size
+    constexpr uint32_t BULK_ARG = 8;        // Iteration of the inner loop of get_bulk_args()
+    constexpr uint32_t CMD_POLL = 8;        // Iteration of the loop in wait_for_cmd() or get_device_word(), reading CS and the FIFO level
+    constexpr uint32_t DEVICE_CMD_POLL = 13;  // Iteration of the loop in get_device_cmd(), also reading one SM's address and moving to the next
+    constexpr uint32_t SRAM_LOAD = 2;       // Load of a variable from SRAM
+    constexpr uint32_t MODE_SWITCH = 1000;  // Rough cost of enter/exit_multi_io_mode(), which run from flash
+}
+
+Core1Model::Core1Model(Soc& soc, const SramSetup& setup)
+    : sector_writes(setup.cfg.num_sectors())
+    , soc_(soc)
+    , setup_(setup)
+    , wrap_size_(setup.cfg.enable_psram_spi ? 1024 : 0)
+{
+}
+
+void Core1Model::launch() {
+    main_ = std::make_unique<Task>(setup_.cfg.num_devices > 1 ? core1_multi_device_main() : core1_main());
+    waiting_ = main_->handle;
+    pred_ = nullptr;
+    resume_at_ = soc_.cycle();
+}
+
+void Core1Model::suspend(std::coroutine_handle<> h, std::function<bool()> pred, uint32_t poll, uint32_t after) {
+    waiting_ = h;
+    pred_ = std::move(pred);
+    poll_ = poll;
+    after_ = after;
+    resume_at_ = soc_.cycle() + (pred_ ? 0 : after);
+}
+
+void Core1Model::tick() {
+    if (!waiting_ || soc_.cycle() < resume_at_) return;
+    if (pred_) {
+        if (pred_()) {
+            pred_ = nullptr;
+            resume_at_ = soc_.cycle() + after_;
+            if (after_) return;
+        }
+        else {
+            resume_at_ = soc_.cycle() + poll_;
+            return;
+        }
+    }
+    auto h = waiting_;
+    waiting_ = nullptr;
+    h.resume();
+}
+
+Core1Model::Task Core1Model::pio_sm_get_blocking(uint32_t pio, uint32_t sm, uint32_t& value) {
+    PioSm& s = soc_.pio[pio].sm[sm];
+    co_await Wait{*this, [&s] { return !s.rx_fifo.empty(); }, cost::FIFO_POLL, cost::FIFO_READ};
+    value = s.rx_fifo.front();
+    s.rx_fifo.pop_front();
+}
+
+// wait_for_cmd() in sram.c.  ok is false if CS went high after the read SM
+// left its wait for CS, before it pushed the command.
+Core1Model::Task Core1Model::wait_for_cmd(uint32_t& cmd, bool& ok) {
+    PioSm& s = soc_.pio[fw::pio_read].sm[fw::pio_read_sm];
+    co_await Wait{*this, [this, &s] {
+        return !s.rx_fifo.empty() || (s.pc != setup_.pio_read_offset && soc_.gpio.synced_pin(setup_.cfg.cs));
+    }, cost::CMD_POLL, 0};
+    // An abort also reads the SM's address, CS again and the FIFO level
+    ok = !s.rx_fifo.empty();
+    co_await cycles(ok ? cost::FIFO_READ : cost::FIFO_READ + cost::GPIO_READ + cost::FIFO_POLL);
+    if (ok) {
+        cmd = s.rx_fifo.front();
+        s.rx_fifo.pop_front();
+    }
+}
+
+// get_cmd() in sram.c, with the PSRAM personality.  If CS went high before
+// the command was pushed, the bits read are the command if the low bits of X,
+// shifted in below them, show there were the 8 of a wrap boundary toggle or
+// reset.
+Core1Model::Task Core1Model::get_cmd(uint32_t& cmd, bool& ok) {
+    co_await wait_for_cmd(cmd, ok);
+    if (ok) co_return;
+
+    Pio& rp = soc_.pio[fw::pio_read];
+    co_await cycles(cost::SM_EXEC);
+    rp.sm_exec(fw::pio_read_sm, pio_encode::in(1, 4));
+    co_await cycles(cost::SM_EXEC);
+    rp.sm_exec(fw::pio_read_sm, pio_encode::push(false, false));
+    uint32_t bits;
+    co_await pio_sm_get_blocking(fw::pio_read, fw::pio_read_sm, bits);
+    co_await cycles(2 * cost::ALU);
+    cmd = (bits >> 4) << 7;
+    co_await cycles(cost::ALU + cost::CMP_BRANCH);
+    ok = (bits & 0xf) == 14 - 8;
+}
+
+// get_device_word() in sram.c, pio_sm_get_blocking() giving up if CS goes high
+Core1Model::Task Core1Model::get_device_word(uint32_t read_sm, uint32_t cs, uint32_t& value, bool& ok) {
+    PioSm& s = soc_.pio[fw::pio_read].sm[read_sm];
+    co_await Wait{*this, [this, read_sm, cs] {
+        return !soc_.pio[fw::pio_read].sm[read_sm].rx_fifo.empty() || soc_.gpio.synced_pin(cs);
+    }, cost::CMD_POLL, 0};
+    ok = !s.rx_fifo.empty();
+    co_await cycles(ok ? cost::FIFO_READ : cost::GPIO_READ);
+    if (ok) {
+        value = s.rx_fifo.front();
+        s.rx_fifo.pop_front();
+    }
+}
+
+Core1Model::Task Core1Model::get_word(uint32_t& value, bool& ok) {
+    co_await get_device_word(fw::pio_read_sm, setup_.cfg.cs, value, ok);
+}
+
+Core1Model::Task Core1Model::get_device_addr(uint32_t read_sm, uint32_t cs, uint32_t& addr, bool& ok) {
+    uint32_t addr_low;
+    co_await get_device_word(read_sm, cs, addr, ok);
+    if (ok) co_await get_device_word(read_sm, cs, addr_low, ok);
+    if (ok) {
+        co_await cycles(cost::ALU);
+        addr |= addr_low;
+    }
+}
+
+Core1Model::Task Core1Model::get_addr(uint32_t& addr, bool& ok) {
+    co_await get_device_addr(fw::pio_read_sm, setup_.cfg.cs, addr, ok);
+}
+
+// With the statistics enabled the loop also counts the polls.
+Core1Model::Task Core1Model::wait_for_device_cs_high(uint32_t cs, uint32_t* polls) {
+    const uint32_t poll = cost::GPIO_POLL + (setup_.cfg.enable_stats ? cost::ALU : 0);
+    const uint64_t start = soc_.cycle();
+    while (true) {
+        co_await Wait{*this, [this, cs] { return soc_.gpio.synced_pin(cs); }, poll, cost::GPIO_READ};
+        if (soc_.gpio.synced_pin(cs)) {
+            // Must be high for 2 cycles to count - avoids deselecting on a glitch.
+            break;
+        }
+    }
+    if (polls) *polls = (soc_.cycle() - start) / poll;
+}
+
+Core1Model::Task Core1Model::wait_for_cs_high(uint32_t* polls) {
+    co_await wait_for_device_cs_high(setup_.cfg.cs, polls);
+}
+
+Core1Model::Task Core1Model::dma_channel_abort(uint32_t channel) {
+    co_await cycles(cost::REG_WRITE);
+    soc_.dma.abort(channel);
+    co_await Wait{*this, [this, channel] { return !soc_.dma.is_busy(channel); }, cost::ABORT_POLL, 0};
+}
+
+// Every step is a single store of a constant
+Core1Model::Task Core1Model::reset_device_pios(uint32_t read_sm) {
+    Pio& wp = soc_.pio[fw::pio_write];
+    Pio& rp = soc_.pio[fw::pio_read];
+
+    co_await cycles(cost::REG_WRITE);
+    wp.sm_set_enabled(fw::pio_write_sm, false);
+    co_await cycles(cost::REG_WRITE);
+    rp.sm_set_enabled(read_sm, false);
+
+    // Two XORs of FJOIN_RX each
+    co_await cycles(2 * cost::REG_WRITE);
+    wp.sm_clear_fifos(fw::pio_write_sm);
+    co_await cycles(2 * cost::REG_WRITE);
+    rp.sm_clear_fifos(read_sm);
+
+    co_await cycles(cost::REG_WRITE);
+    wp.sm_exec(fw::pio_write_sm, pio_encode::jmp(fw::pio_write_offset));
+    co_await cycles(cost::REG_WRITE);
+    rp.sm_exec(read_sm, pio_encode::jmp(setup_.pio_read_offset));
+
+    // SM_RESTART and SM_ENABLE in one write to CTRL
+    co_await cycles(cost::REG_WRITE);
+    wp.sm_restart(fw::pio_write_sm);
+    wp.sm_set_enabled(fw::pio_write_sm, true);
+    co_await cycles(cost::REG_WRITE);
+    rp.sm_restart(read_sm);
+    rp.sm_set_enabled(read_sm, true);
+}
+
+Core1Model::Task Core1Model::reset_pios() {
+    co_await reset_device_pios(fw::pio_read_sm);
+}
+
+Core1Model::Task Core1Model::abort_device_transaction(uint32_t read_sm) {
+    co_await reset_device_pios(read_sm);
+    co_await update_stats(SIM_SRAM_STATS_ABORTED, 0, 0);
+}
+
+Core1Model::Task Core1Model::abort_transaction() {
+    co_await abort_device_transaction(fw::pio_read_sm);
+}
+
+Core1Model::Task Core1Model::set_continuous_read(bool continuous) {
+    const uint32_t read_cmd = setup_.pio_read_offset + setup_.read_program->offset_of("read_cmd");
+    const uint32_t cmd_addr_count = fw::pio_write_offset + setup_.write_program->offset_of("cmd_addr_count");
+
+    // read_cmd_instr and read_cmd_continuous_instr
+    uint32_t read_cmd_instr, read_cmd_continuous_instr;
+    if (setup_.cfg.addr_bits == 24) {
+        read_cmd_instr = pio_encode::set_x(14);
+        read_cmd_continuous_instr = pio_encode::set_x(6);
+    }
+    else {
+        read_cmd_instr = pio_encode::set_x(7);
+        read_cmd_continuous_instr = pio_encode::jmp(setup_.pio_read_offset + setup_.read_program->offset_of("read_cmd_end"));
+    }
+
+    co_await cycles(cost::ALU + 2 * cost::REG_WRITE);
+    soc_.pio[fw::pio_read].instr_mem[read_cmd] = continuous ? read_cmd_continuous_instr : read_cmd_instr;
+    const uint32_t clocks = setup_.cfg.cmd_addr_clocks();
+    soc_.pio[fw::pio_write].instr_mem[cmd_addr_count] = pio_encode::set_x(continuous ? clocks - 9 : clocks - 1);
+}
+
+// A FAST READ aborted before its mode byte leaves the mode
+Core1Model::Task Core1Model::update_continuous_read(bool& continuous) {
+    uint32_t mode = 0;
+    bool ok;
+    co_await get_word(mode, ok);
+    continuous = ok && mode == fw::continuous_read_mode;
+    co_await set_continuous_read(continuous);
+}
+
+Core1Model::Task Core1Model::core1_continuous_read_main(uint32_t polls, uint32_t bytes) {
+    uint32_t command = SIM_SRAM_STATS_FAST_READ;
+    bool continuous;
+    do {
+        co_await reset_pios();
+        co_await update_stats(command, polls, bytes);
+        command = SIM_SRAM_STATS_CONT_READ;
+
+        // If the master aborts before the address the mode is left
+        uint32_t addr_top, addr;
+        bool ok;
+        co_await wait_for_cmd(addr_top, ok);
+        if (ok) co_await get_addr(addr, ok);
+        if (!ok) {
+            co_await set_continuous_read(false);
+            command = SIM_SRAM_STATS_ABORTED;
+            polls = bytes = 0;
+            break;
+        }
+        if (setup_.cfg.enable_flash) co_await flash_addr(addr_top, addr);
+        co_await cycles(cost::REG_WRITE);
+        soc_.bus_write(dma_al3_read_addr_trig(fw::tx_channel), 4, addr);
+        co_await update_continuous_read(continuous);
+
+        co_await wait_for_cs_high(&polls);
+        co_await abort_tx_channel(bytes);
+        co_await cycles(cost::CMP_BRANCH);
+    } while (continuous);
+    co_await reset_pios();
+    co_await update_stats(command, polls, bytes);
+}
+
+// The if (is_flash_addr(addr_top)) addr = flash_addr(addr_top, addr) in sram.c
+Core1Model::Task Core1Model::flash_addr(uint32_t addr_top, uint32_t& addr) {
+    co_await cycles(cost::CMP_BRANCH);
+    if (addr_top & 0x40) {
+        co_await cycles(cost::FLASH_ADDR);
+        addr = setup_.cfg.flash_base + ((addr_top & 0x3f) << 17) + (addr & 0x1ffff);
+    }
+}
+
+Core1Model::Task Core1Model::mark_sectors_written(uint32_t start, uint32_t end) {
+    co_await cycles(cost::SECTOR_RANGE);
+    const uint32_t base = setup_.cfg.emu_ram_base();
+    for (uint32_t s = (start - base) / 4096; s <= (end - 1 - base) / 4096; ++s) {
+        co_await cycles(cost::SECTOR_MARK);
+        ++sector_writes[s];
+    }
+}
+
+// Called with the DMA write address, which is loaded first
+Core1Model::Task Core1Model::record_write(uint32_t start, uint32_t end) {
+    co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+    if (end == start) co_return;
+    if (setup_.cfg.enable_persist) co_await mark_sectors_written(start, end);
+    if (setup_.cfg.enable_write_events) {
+        co_await cycles(cost::WRITE_EVENT);
+        write_events.push_back({start - setup_.cfg.emu_ram_base(), end - start, (uint32_t)write_events.size()});
+    }
+}
+
+// Reads the transfer count first if the statistics are enabled
+Core1Model::Task Core1Model::abort_tx_channel(uint32_t& bytes) {
+    const DmaChannel& tx = soc_.dma.ch[fw::tx_channel];
+    uint32_t transferred = 0;
+    if (setup_.cfg.enable_stats) {
+        co_await cycles(cost::FIFO_READ + cost::ALU);
+        transferred = tx.trans_count_reload - tx.trans_count;
+    }
+    co_await dma_channel_abort(fw::tx_channel);
+    if (setup_.cfg.enable_stats) co_await cycles(cost::FIFO_READ + 3 * cost::ALU);
+    bytes = transferred * tx.data_size;
+}
+
+Core1Model::Task Core1Model::update_stats(uint32_t command, uint32_t polls, uint32_t bytes) {
+    if (!setup_.cfg.enable_stats) co_return;
+    co_await cycles(cost::STATS_UPDATE);
+    sim_sram_command_stats_t& s = stats[command];
+    ++s.count;
+    s.bytes += bytes;
+
+    uint32_t bucket = 0;
+    while (bucket < SIM_SRAM_STATS_BUCKETS - 1 && polls >= (16u << bucket)) {
+        co_await cycles(cost::STATS_BUCKET);
+        ++bucket;
+    }
+    ++s.cs_low[bucket];
+}
+
+Core1Model::Task Core1Model::update_crc_status() {
+    co_await cycles(cost::CRC_STATUS);
+    const uint32_t status = setup_.cfg.crc_status_addr();
+    const uint32_t crc = soc_.dma.sniff_result();
+    soc_.bus_write(status, 4, soc_.dma.ch[fw::crc_channel].busy ? 0x01010101 : 0);
+    soc_.bus_write(status + 4, 4, __builtin_bswap32(crc));
+}
+
+Core1Model::Task Core1Model::start_crc(uint32_t addr, uint32_t end, uint32_t len) {
+    co_await cycles(cost::CRC_LEN);
+    const uint32_t max_len = end - addr;
+    len = std::min(len, max_len);
+
+    co_await dma_channel_abort(fw::crc_channel);
+    co_await cycles(cost::REG_WRITE);
+    soc_.dma.sniff_data = 0xffffffff;
+    co_await cycles(cost::REG_WRITE);
+    soc_.dma.ch[fw::crc_channel].read_addr = addr;
+    co_await cycles(cost::REG_WRITE);
+    soc_.bus_write(dma_al1_transfer_count_trig(fw::crc_channel), 4, len);
+}
+
+Core1Model::Task Core1Model::update_bulk_status() {
+    co_await cycles(cost::BULK_STATUS);
+    const DmaChannel& bulk = soc_.dma.ch[fw::bulk_channel];
+    const uint32_t status = setup_.cfg.bulk_status_addr();
+    soc_.bus_write(status + 4, 4, __builtin_bswap32(bulk.trans_count * bulk.data_size));
+    soc_.bus_write(status, 4, bulk.busy ? 0x01010101 : 0);
+}
+
+// The bulk channel has been aborted by the caller
+Core1Model::Task Core1Model::start_bulk(uint32_t dst, uint32_t src, uint32_t& len, bool copy) {
+    co_await cycles(cost::BULK_START);
+    const uint32_t last = (copy && src > dst) ? src : dst;
+    len = std::min(len, setup_.cfg.emu_ram_base() + setup_.cfg.emu_ram_size() - last);
+
+    const uint32_t align = dst | len | (copy ? src : 0);
+    DmaChannel& bulk = soc_.dma.ch[fw::bulk_channel];
+    co_await cycles(cost::REG_WRITE);
+    bulk.read_addr = src;
+    co_await cycles(cost::REG_WRITE);
+    bulk.write_addr = dst;
+    co_await cycles(cost::REG_WRITE);
+    bulk.data_size = (align & 1) ? 1 : ((align & 2) ? 2 : 4);
+    bulk.trans_count_reload = len / bulk.data_size;
+    co_await cycles(cost::REG_WRITE);
+    bulk.incr_read = copy;
+    soc_.dma.trigger(fw::bulk_channel);
+}
+
+Core1Model::Task Core1Model::get_bulk_args(uint32_t& value, uint32_t n, uint32_t& count) {
+    PioSm& rsm = soc_.pio[fw::pio_read].sm[fw::pio_read_sm];
+    count = 0;
+    value = 0;
+    while (count < n) {
+        co_await cycles(cost::GPIO_READ + cost::CMP_BRANCH);
+        const bool cs_high = soc_.gpio.synced_pin(setup_.cfg.cs);
+        while (true) {
+            co_await cycles(cost::FIFO_POLL);
+            if (count == n || rsm.rx_fifo.empty()) break;
+            co_await cycles(cost::BULK_ARG);
+            value = (value << 8) | (rsm.rx_fifo.front() & 0xff);
+            rsm.rx_fifo.pop_front();
+            ++count;
+        }
+        if (cs_high) break;
+    }
+}
+
+bool Core1Model::is_status_read(uint32_t cmd) const {
+    return (setup_.cfg.enable_crc && cmd == fw::crc_read_cmd) || (setup_.cfg.enable_bulk && cmd == fw::bulk_status_cmd);
+}
+
+Core1Model::Task Core1Model::update_status_block(uint32_t cmd, uint32_t& status) {
+    status = 0;
+    if (setup_.cfg.enable_crc) {
+        co_await cycles(cost::CMP_BRANCH);
+        if (cmd == fw::crc_read_cmd) {
+            co_await update_crc_status();
+            status = setup_.cfg.crc_status_addr();
+            co_return;
+        }
+    }
+    if (setup_.cfg.enable_bulk) {
+        co_await cycles(cost::CMP_BRANCH);
+        if (cmd == fw::bulk_status_cmd) {
+            co_await update_bulk_status();
+            status = setup_.cfg.bulk_status_addr();
+        }
+    }
+}
+
+Core1Model::Task Core1Model::set_wrap(uint32_t bits) {
+    co_await cycles(2 * cost::ALU + cost::REG_WRITE);
+    wrap_size_ = bits ? 1u << bits : 0;
+    co_await cycles(2 * cost::ATOMIC_WRITE);
+    soc_.dma.ch[fw::rx_channel].ring_size = 0;
+    soc_.dma.ch[fw::tx_channel].ring_size = 0;
+    co_await cycles(cost::ATOMIC_WRITE);
+    soc_.dma.ch[fw::rx_channel].ring_size = bits;
+    co_await cycles(cost::ATOMIC_WRITE);
+    soc_.dma.ch[fw::tx_channel].ring_size = bits;
+}
+
+Core1Model::Task Core1Model::set_mode(uint32_t mode) {
+    co_await cycles(cost::CMP_BRANCH);
+    if (!(mode & 0xc0)) co_return;
+    co_await cycles(cost::ALU + cost::REG_WRITE + cost::CMP_BRANCH);
+    mode_reg_ = mode & 0xc0;
+    co_await set_wrap(page_mode() ? 5 : 0);
+}
+
+// Start the receive channel for a WRITE.  Unless the write wraps, the count
+// stops the channel at the end of the RAM.
+Core1Model::Task Core1Model::start_write(uint32_t addr) {
+    const uint32_t size = setup_.cfg.emu_ram_size();
+    co_await cycles(3 * cost::ALU);
+    uint32_t count = size - (addr & (size - 1));
+    if (setup_.cfg.wraps()) {
+        co_await cycles(cost::SRAM_LOAD + cost::CMP_BRANCH);
+        if (wrap_size_) count = size;
+    }
+    co_await cycles(cost::REG_WRITE);
+    soc_.bus_write(DMA_BASE + fw::rx_channel * DMA_CH_STRIDE + 0x08, 4, count);
+    co_await cycles(cost::REG_WRITE);
+    soc_.bus_write(dma_al2_write_addr_trig(fw::rx_channel), 4, addr);
+}
+
+// Wait for the receive channel to empty the read SM's FIFO after a WRITE,
+// unless it has stopped at the end of the RAM.
+Core1Model::Task Core1Model::drain_write(uint32_t sm) {
+    PioSm& rsm = soc_.pio[fw::pio_read].sm[sm];
+    co_await Wait{*this, [this, &rsm] { return rsm.rx_fifo.empty() || !soc_.dma.is_busy(fw::rx_channel); },
+                  cost::FIFO_POLL, 0};
+}
+
+// The abort and reset_pios() of a WRITE, and the bytes written.  When reads
+// and writes can wrap the length is taken from the transfer count before the
+// abort, as the write address may have wrapped.  The count start_write() set
+// is the transfer count reload.
+Core1Model::Task Core1Model::write_len(uint32_t addr, uint32_t& len) {
+    const DmaChannel& rx = soc_.dma.ch[fw::rx_channel];
+    if (setup_.cfg.wraps()) {
+        co_await cycles(cost::FIFO_READ + cost::ALU);
+        len = rx.trans_count_reload - rx.trans_count;
+    }
+    co_await dma_channel_abort(fw::rx_channel);
+    co_await reset_pios();
+    if (!setup_.cfg.wraps()) len = rx.write_addr - addr;
+}
+
+// A WRITE that wrapped is recorded as the whole block it wraps within
+Core1Model::Task Core1Model::record_write_len(uint32_t addr, uint32_t len) {
+    if (setup_.cfg.wraps()) {
+        co_await cycles(cost::CMP_BRANCH + 4 * cost::ALU);
+        if (wrap_size_ && len > wrap_size_ - (addr & (wrap_size_ - 1))) {
+            co_await cycles(2 * cost::ALU);
+            addr &= ~(wrap_size_ - 1);
+            len = wrap_size_;
+        }
+    }
+    co_await record_write(addr, addr + len);
+}
+
+// The word is read from the RAM once the WRITE has finished
+Core1Model::Task Core1Model::check_doorbell(uint32_t addr, uint32_t len) {
+    co_await cycles(cost::DOORBELL_CHECK + (setup_.cfg.wraps() ? cost::CMP_BRANCH + 4 * cost::ALU : 0));
+    if (len == 0) co_return;
+    uint32_t last = addr + len - 1;
+    if (wrap_size_) last = (addr & ~(wrap_size_ - 1)) | (last & (wrap_size_ - 1));
+    const uint32_t offset = last - setup_.cfg.emu_ram_base();
+    if ((offset & (setup_.cfg.emu_ram_size() - 1)) - fw::doorbell_addr >= fw::doorbell_size) co_return;
+
+    co_await cycles(cost::DOORBELL);
+    const uint32_t value = soc_.bus_read(last & ~3u, 4);
+    doorbells.push_back({offset & ~3u, value, (uint32_t)doorbells.size()});
+}
+
+Core1Model::Task Core1Model::begin_snapshot_write() {
+    co_await cycles(cost::SNAPSHOT_BEGIN);
+    snapshot.active_low = 0;
+    ++snapshot.gen;
+}
+
+Core1Model::Task Core1Model::set_snapshot_write_addr(uint32_t addr) {
+    co_await cycles(cost::REG_WRITE + (setup_.cfg.wraps() ? cost::CMP_BRANCH + 2 * cost::ALU : 0));
+    if (wrap_size_) addr &= ~(wrap_size_ - 1);
+    snapshot.active_low = addr;
+}
+
+Core1Model::Task Core1Model::end_snapshot_range(uint32_t start, uint32_t end) {
+    co_await cycles(cost::SNAPSHOT_END);
+    snapshot.last_start = start;
+    snapshot.last_end = end;
+    ++snapshot.gen;
+}
+
+// The range is recorded as for record_write_len()
+Core1Model::Task Core1Model::end_snapshot_write(uint32_t addr, uint32_t len) {
+    if (setup_.cfg.wraps()) {
+        co_await cycles(cost::CMP_BRANCH + 4 * cost::ALU);
+        if (wrap_size_ && len > wrap_size_ - (addr & (wrap_size_ - 1))) {
+            co_await cycles(2 * cost::ALU);
+            addr &= ~(wrap_size_ - 1);
+            len = wrap_size_;
+        }
+    }
+    co_await end_snapshot_range(addr, addr + len);
+}
+
+// pio_sm_put and the two execs, which all complete without stalling.
+void Core1Model::set_y(uint32_t pio, uint32_t sm, uint32_t y) {
+    soc_.pio[pio].sm[sm].y = y;
+}
+
+void Core1Model::load_programs(const PioProgram& read_program, const PioSmConfig& read_config,
+                               const PioProgram& write_program, const PioSmConfig& write_config) {
+    Pio& wp = soc_.pio[fw::pio_write];
+    Pio& rp = soc_.pio[fw::pio_read];
+    wp.sm_set_enabled(fw::pio_write_sm, false);
+    rp.sm_set_enabled(fw::pio_read_sm, false);
+    wp.load_program(write_program, fw::pio_write_offset);
+    rp.load_program(read_program, setup_.pio_read_offset);
+    wp.sm[fw::pio_write_sm].cfg = write_config;
+    rp.sm[fw::pio_read_sm].cfg = read_config;
+}
+
+Core1Model::Task Core1Model::enter_multi_io_mode(const PioProgram& read_program, const PioSmConfig& read_config,
+                                                 const PioProgram& write_program, const PioSmConfig& write_config) {
+    co_await cycles(cost::MODE_SWITCH);
+    load_programs(read_program, read_config, write_program, write_config);
+
+    soc_.pio[fw::pio_write].pin_dirs &= ~setup_.cfg.data_pins_mask();
+    set_y(fw::pio_read, fw::pio_read_sm, setup_.cfg.addr_prefix_reversed());
+    soc_.dma.ch[fw::tx_channel].data_size = 1;
+}
+
+Core1Model::Task Core1Model::exit_multi_io_mode() {
+    co_await cycles(cost::MODE_SWITCH);
+    load_programs(*setup_.read_program, setup_.spi_read_config, *setup_.write_program, setup_.spi_write_config);
+
+    Pio& wp = soc_.pio[fw::pio_write];
+    wp.pin_dirs = (wp.pin_dirs & ~setup_.cfg.data_pins_mask()) | (1u << setup_.cfg.miso);
+    set_y(fw::pio_read, fw::pio_read_sm, setup_.cfg.addr_prefix());
+    soc_.dma.ch[fw::tx_channel].data_size = 4;
+}
+
+Core1Model::Task Core1Model::core1_multi_io_main(uint32_t& polls) {
+    Pio& wp = soc_.pio[fw::pio_write];
+
+    co_await reset_pios();
+    while (true) {
+        uint32_t cmd, command, bytes = 0;
+        bool ok;
+        co_await wait_for_cmd(cmd, ok);
+        if (!ok) {
+            co_await abort_transaction();
+            continue;
+        }
+        if (cmd == SIM_SRAM_READ_CMD || cmd == SIM_SRAM_FAST_READ_CMD) {
+            // Read and fast read
+            co_await cycles(2 * cost::CMP_BRANCH + cost::REG_WRITE);
+            soc_.dma.trigger(fw::tx_channel2);
+
+            co_await wait_for_cs_high(&polls);
+
+            co_await cycles(cost::SM_EXEC);
+            wp.sm_exec(fw::pio_write_sm, pio_encode::set_pindirs(0));
+            co_await abort_tx_channel(bytes);
+            command = cmd == SIM_SRAM_READ_CMD ? SIM_SRAM_STATS_READ : SIM_SRAM_STATS_FAST_READ;
+            if (setup_.cfg.enable_stats) co_await cycles(cost::CMP_BRANCH);
+            co_await reset_pios();
+
+            // The address never arrived if tx2 is still waiting for it
+            co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+            if (soc_.dma.is_busy(fw::tx_channel2)) {
+                co_await dma_channel_abort(fw::tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+                polls = bytes = 0;
+            }
+            co_await update_stats(command, polls, bytes);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
+            // Write
+            co_await cycles(3 * cost::CMP_BRANCH);
+            if (setup_.cfg.enable_snapshot) co_await begin_snapshot_write();
+            uint32_t addr;
+            co_await get_word(addr, ok);
+            if (!ok) {
+                if (setup_.cfg.enable_snapshot) co_await end_snapshot_range(0, 0);
+                co_await abort_transaction();
+                continue;
+            }
+            co_await start_write(addr);
+            if (setup_.cfg.enable_snapshot) co_await set_snapshot_write_addr(addr);
+
+            co_await wait_for_cs_high(&polls);
+            co_await drain_write(fw::pio_read_sm);
+            uint32_t len;
+            co_await write_len(addr, len);
+            if (setup_.cfg.enable_snapshot) co_await end_snapshot_write(addr, len);
+            if (setup_.cfg.enable_doorbell) co_await check_doorbell(addr, len);
+            if (setup_.cfg.enable_write_events) co_await record_write_len(addr, len);
+            if (setup_.cfg.enable_stats && !setup_.cfg.wraps()) co_await cycles(cost::FIFO_READ + cost::ALU);
+            co_await update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+        else if (cmd == 0xFF) {
+            // RSTIO
+            co_await cycles(4 * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            co_await exit_multi_io_mode();
+            co_return;
+        }
+        else {
+            // Ignore unknown command
+            co_await cycles(4 * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            command = SIM_SRAM_STATS_UNKNOWN;
+        }
+        co_await reset_pios();
+        co_await update_stats(command, polls, bytes);
+    }
+}
+
+// Polls the RX FIFO empty flags of all the read SMs together, checking one
+// device for an abort each time round, then finds the first SM with a command.
+Core1Model::Task Core1Model::get_device_cmd(uint32_t& sm, uint32_t& cmd, bool& ok) {
+    Pio& rp = soc_.pio[fw::pio_read];
+    check_device_ = 0;
+    co_await Wait{*this, [this, &rp] {
+        const uint32_t num_devices = setup_.cfg.num_devices;
+        for (uint32_t device = 0; device < num_devices; ++device) {
+            if (!rp.sm[fw::pio_read_sm + device].rx_fifo.empty()) return true;
+        }
+        const uint32_t device = check_device_;
+        if (rp.sm[fw::pio_read_sm + device].pc != setup_.pio_read_offset &&
+            soc_.gpio.synced_pin(setup_.cfg.device_cs(device))) {
+            return true;
+        }
+        check_device_ = device + 1 == num_devices ? 0 : device + 1;
+        return false;
+    }, cost::DEVICE_CMD_POLL, 0};
+
+    ok = false;
+    for (uint32_t device = 0; device < setup_.cfg.num_devices; ++device) {
+        if (!rp.sm[fw::pio_read_sm + device].rx_fifo.empty()) ok = true;
+    }
+    if (!ok) {
+        // The abort also reads CS again and the FIFO level
+        co_await cycles(cost::GPIO_READ + cost::FIFO_POLL);
+        sm = fw::pio_read_sm + check_device_;
+        co_return;
+    }
+
+    sm = fw::pio_read_sm;
+    co_await cycles(cost::ALU);
+    while (rp.sm[sm].rx_fifo.empty()) {
+        co_await cycles(cost::CMP_BRANCH + cost::ALU);
+        ++sm;
+    }
+    co_await cycles(cost::CMP_BRANCH + cost::FIFO_READ);
+    cmd = rp.sm[sm].rx_fifo.front();
+    rp.sm[sm].rx_fifo.pop_front();
+}
+
+Core1Model::Task Core1Model::select_device(uint32_t sm) {
+    DmaChannel& rx = soc_.dma.ch[fw::rx_channel];
+    DmaChannel& tx2 = soc_.dma.ch[fw::tx_channel2];
+    co_await cycles(2 * cost::ALU + cost::REG_WRITE);
+    rx.read_addr = pio_rxf(fw::pio_read, sm);
+    co_await cycles(cost::SRAM_LOAD + cost::REG_WRITE);
+    rx.treq = dma_dreq_pio(fw::pio_read, sm, false);
+    co_await cycles(cost::REG_WRITE);
+    tx2.read_addr = pio_rxf(fw::pio_read, sm);
+    co_await cycles(cost::SRAM_LOAD + cost::REG_WRITE);
+    tx2.treq = dma_dreq_pio(fw::pio_read, sm, false);
+}
+
+Core1Model::Task Core1Model::core1_multi_device_main() {
+    Pio& wp = soc_.pio[fw::pio_write];
+    PioSm& wsm = wp.sm[fw::pio_write_sm];
+    DmaChannel& tx = soc_.dma.ch[fw::tx_channel];
+    const uint32_t addr_loop_end = fw::pio_write_offset + setup_.write_program->offset_of("addr_loop_end");
+    const uint32_t fast_read = fw::pio_write_offset + setup_.write_program->offset_of("fast_read");
+    const uint32_t addr_two = fw::pio_write_offset + setup_.write_program->offset_of("addr_two");
+
+    while (true) {
+        uint32_t sm, cmd, command, polls, bytes = 0;
+        bool ok;
+        co_await get_device_cmd(sm, cmd, ok);
+        if (!ok) {
+            co_await abort_device_transaction(sm);
+            continue;
+        }
+        co_await select_device(sm);
+        co_await cycles(cost::ALU + cost::SRAM_LOAD);
+        const uint32_t cs = setup_.cfg.device_cs(sm - fw::pio_read_sm);
+
+        if (cmd == SIM_SRAM_READ_CMD) {
+            // Read
+            co_await cycles(cost::CMP_BRANCH + cost::REG_WRITE);
+            soc_.dma.trigger(fw::tx_channel2);
+
+            co_await wait_for_device_cs_high(cs, &polls);
+            co_await abort_tx_channel(bytes);
+
+            // An aborted READ is found as in core1_main
+            command = SIM_SRAM_STATS_READ;
+            if (setup_.cfg.enable_stats) {
+                co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+                if (soc_.pio[fw::pio_read].sm[sm].rx_fifo.empty()) command = SIM_SRAM_STATS_ABORTED;
+            }
+            co_await reset_device_pios(sm);
+            co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+            if (soc_.dma.is_busy(fw::tx_channel2)) {
+                co_await dma_channel_abort(fw::tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+            }
+            if (command == SIM_SRAM_STATS_ABORTED) polls = bytes = 0;
+            co_await update_stats(command, polls, bytes);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_FAST_READ_CMD) {
+            // Fast read
+            co_await cycles(2 * cost::CMP_BRANCH + cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp(fast_read);
+            co_await cycles(cost::ATOMIC_WRITE);
+            tx.data_size = 1;
+            co_await cycles(cost::ATOMIC_WRITE);
+            wsm.cfg.pull_thresh = 8;
+
+            uint32_t addr;
+            co_await get_device_addr(sm, cs, addr, ok);
+            if (!ok) co_await abort_device_transaction(sm);
+            else {
+                co_await cycles(cost::REG_WRITE);
+                soc_.bus_write(dma_al3_read_addr_trig(fw::tx_channel), 4, addr);
+
+                co_await wait_for_device_cs_high(cs, &polls);
+                co_await abort_tx_channel(bytes);
+                co_await reset_device_pios(sm);
+                co_await update_stats(SIM_SRAM_STATS_FAST_READ, polls, bytes);
+            }
+
+            co_await cycles(cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp_pin(addr_two);
+            co_await cycles(cost::ATOMIC_WRITE);
+            tx.data_size = 4;
+            co_await cycles(cost::ATOMIC_WRITE);
+            wsm.cfg.pull_thresh = 32;
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
+            // Write
+            co_await cycles(3 * cost::CMP_BRANCH);
+            if (setup_.cfg.enable_snapshot) co_await begin_snapshot_write();
+            uint32_t addr;
+            co_await get_device_addr(sm, cs, addr, ok);
+            if (!ok) {
+                if (setup_.cfg.enable_snapshot) co_await end_snapshot_range(0, 0);
+                co_await abort_device_transaction(sm);
+                continue;
+            }
+            co_await start_write(addr);
+            if (setup_.cfg.enable_snapshot) co_await set_snapshot_write_addr(addr);
+
+            co_await wait_for_device_cs_high(cs, &polls);
+            co_await drain_write(sm);
+            co_await dma_channel_abort(fw::rx_channel);
+            co_await reset_device_pios(sm);
+            co_await cycles(cost::FIFO_READ + cost::ALU);
+            const uint32_t len = soc_.dma.ch[fw::rx_channel].write_addr - addr;
+            if (setup_.cfg.enable_snapshot) co_await end_snapshot_write(addr, len);
+            if (setup_.cfg.enable_doorbell) co_await check_doorbell(addr, len);
+            if (setup_.cfg.enable_write_events) co_await record_write(addr, addr + len);
+            co_await update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+        else {
+            // Ignore unknown command
+            co_await cycles(3 * cost::CMP_BRANCH);
+            co_await wait_for_device_cs_high(cs, &polls);
+            command = SIM_SRAM_STATS_UNKNOWN;
+        }
+        co_await reset_device_pios(sm);
+        co_await update_stats(command, polls, bytes);
+    }
+}
+
+Core1Model::Task Core1Model::core1_main() {
+    Pio& wp = soc_.pio[fw::pio_write];
+    PioSm& wsm = wp.sm[fw::pio_write_sm];
+    DmaChannel& tx = soc_.dma.ch[fw::tx_channel];
+    const uint32_t addr_loop_end = fw::pio_write_offset + setup_.write_program->offset_of("addr_loop_end");
+    const uint32_t fast_read = fw::pio_write_offset + setup_.write_program->offset_of("fast_read");
+    const uint32_t addr_two = fw::pio_write_offset + setup_.write_program->offset_of("addr_two");
+
+    const uint32_t write_loop = fw::pio_write_offset + setup_.write_program->offset_of("write_loop");
+    const uint32_t write_wait = fw::pio_write_offset + setup_.write_program->offset_of("write_wait");
+
+    // Compares in the if/else chain ahead of the optional commands
+    const uint32_t rdmr = setup_.cfg.enable_mode_register && setup_.cfg.addr_bits == 16;
+    const uint32_t status_reads = setup_.cfg.enable_crc + setup_.cfg.enable_bulk;
+    const uint32_t before_crc = rdmr + 3 + status_reads;
+    const uint32_t before_bulk = before_crc + setup_.cfg.enable_crc;
+    const uint32_t before_psram = before_bulk + 2 * setup_.cfg.enable_bulk;
+    const uint32_t before_wrmr = before_psram + 3 * setup_.cfg.enable_psram_spi;
+    const uint32_t before_multi_io = before_wrmr + setup_.cfg.enable_mode_register;
+
+    while (true) {
+        uint32_t cmd, addr_top = 0, command, polls, bytes = 0;
+        bool cmd_ok;
+        if (setup_.cfg.enable_psram_spi) co_await get_cmd(cmd, cmd_ok);
+        else co_await wait_for_cmd(cmd, cmd_ok);
+        if (!cmd_ok) {
+            co_await abort_transaction();
+            continue;
+        }
+        if (setup_.cfg.addr_bits == 24) {
+            // The top 7 bits of the address are pushed with the command
+            const bool need_top = setup_.cfg.enable_flash || setup_.cfg.enable_mode_register;
+            co_await cycles(need_top ? 2 * cost::ALU : cost::ALU);
+            addr_top = cmd & 0x7f;
+            cmd >>= 7;
+        }
+        if (rdmr && cmd == fw::rdmr_cmd) {
+            // RDMR, the write SM is sent straight to its data loop
+            co_await cycles(cost::CMP_BRANCH + cost::ALU + cost::REG_WRITE);
+            soc_.bus_write(pio_txf(fw::pio_write, fw::pio_write_sm), 4, mode_reg_ << 24);
+            co_await cycles(cost::SM_EXEC);
+            wp.sm_exec(fw::pio_write_sm, pio_encode::jmp(write_loop));
+            co_await wait_for_cs_high(&polls);
+            command = SIM_SRAM_STATS_OTHER;
+        }
+        else if (cmd == SIM_SRAM_READ_CMD) {
+            // Read
+            co_await cycles((rdmr + 1) * cost::CMP_BRANCH);
+            if (setup_.cfg.enable_flash) co_await cycles(cost::CMP_BRANCH);
+            if (setup_.cfg.enable_flash && (addr_top & 0x40)) {
+                uint32_t addr;
+                bool ok;
+                co_await get_word(addr, ok);
+                if (!ok) {
+                    co_await abort_transaction();
+                    continue;
+                }
+                co_await cycles(cost::FLASH_ADDR + cost::REG_WRITE);
+                soc_.bus_write(dma_al3_read_addr_trig(fw::tx_channel), 4,
+                               setup_.cfg.flash_base + ((addr_top & 0x3f) << 17) + (addr & 0x1ffff));
+            }
+            else {
+                co_await cycles(cost::REG_WRITE);
+                soc_.dma.trigger(fw::tx_channel2);
+            }
+
+            co_await wait_for_cs_high(&polls);
+            co_await abort_tx_channel(bytes);
+
+            // The word with the bottom 2 bits of the address is checked for
+            // before the FIFO is cleared, for the statistics
+            command = SIM_SRAM_STATS_READ;
+            if (setup_.cfg.enable_stats) {
+                co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+                if (soc_.pio[fw::pio_read].sm[fw::pio_read_sm].rx_fifo.empty()) command = SIM_SRAM_STATS_ABORTED;
+            }
+            co_await reset_pios();
+
+            // The top of the address never arrived if tx2 is still waiting for it
+            co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+            if (soc_.dma.is_busy(fw::tx_channel2)) {
+                co_await dma_channel_abort(fw::tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+            }
+            if (command == SIM_SRAM_STATS_ABORTED) polls = bytes = 0;
+            co_await update_stats(command, polls, bytes);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_FAST_READ_CMD || is_status_read(cmd)) {
+            // Fast read, or a status read
+            co_await cycles((rdmr + 2 + (cmd == SIM_SRAM_FAST_READ_CMD ? 0 : status_reads)) * cost::CMP_BRANCH + cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp(fast_read);
+
+            co_await cycles(cost::ATOMIC_WRITE);
+            tx.data_size = 1;
+            co_await cycles(cost::ATOMIC_WRITE);
+            wsm.cfg.pull_thresh = 8;
+
+            uint32_t status = 0;
+            if (status_reads) co_await update_status_block(cmd, status);
+
+            uint32_t addr;
+            bool ok;
+            co_await get_addr(addr, ok);
+            if (!ok) co_await abort_transaction();
+            else {
+                if (status_reads) co_await cycles(cost::CMP_BRANCH);
+                if (status) {
+                    co_await cycles(2 * cost::ALU);
+                    addr = status | (addr & 7);
+                }
+                else if (setup_.cfg.enable_flash) co_await flash_addr(addr_top, addr);
+                co_await cycles(cost::REG_WRITE);
+                soc_.bus_write(dma_al3_read_addr_trig(fw::tx_channel), 4, addr);
+
+                bool continuous = false;
+                if (setup_.cfg.enable_continuous_read && cmd == SIM_SRAM_FAST_READ_CMD) co_await update_continuous_read(continuous);
+
+                co_await wait_for_cs_high(&polls);
+                co_await abort_tx_channel(bytes);
+                if (setup_.cfg.enable_continuous_read) co_await cycles(cost::CMP_BRANCH);
+                if (continuous) co_await core1_continuous_read_main(polls, bytes);
+                else {
+                    co_await reset_pios();
+                    co_await update_stats(cmd == SIM_SRAM_FAST_READ_CMD ? SIM_SRAM_STATS_FAST_READ : SIM_SRAM_STATS_OTHER, polls, bytes);
+                }
+            }
+
+            co_await cycles(cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp_pin(addr_two);
+
+            co_await cycles(cost::ATOMIC_WRITE);
+            tx.data_size = 4;
+            co_await cycles(cost::ATOMIC_WRITE);
+            wsm.cfg.pull_thresh = 32;
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
+            // Write
+            co_await cycles(before_crc * cost::CMP_BRANCH);
+            if (setup_.cfg.enable_snapshot) co_await begin_snapshot_write();
+            uint32_t addr;
+            bool ok;
+            co_await get_addr(addr, ok);
+            if (!ok) {
+                if (setup_.cfg.enable_snapshot) co_await end_snapshot_range(0, 0);
+                co_await abort_transaction();
+                continue;
+            }
+            if (setup_.cfg.enable_flash) {
+                co_await cycles(cost::CMP_BRANCH);
+                if (addr_top & 0x40) {
+                    // The flash region is read only, the data is discarded
+                    co_await wait_for_cs_high(&polls);
+                    co_await reset_pios();
+                    if (setup_.cfg.enable_snapshot) co_await end_snapshot_write(addr, 0);
+                    co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+                    continue;
+                }
+            }
+            co_await start_write(addr);
+            if (setup_.cfg.enable_snapshot) co_await set_snapshot_write_addr(addr);
+
+            co_await wait_for_cs_high(&polls);
+            co_await drain_write(fw::pio_read_sm);
+            uint32_t len;
+            co_await write_len(addr, len);
+            if (setup_.cfg.enable_snapshot) co_await end_snapshot_write(addr, len);
+            if (setup_.cfg.enable_doorbell) co_await check_doorbell(addr, len);
+            if (setup_.cfg.enable_persist || setup_.cfg.enable_write_events) co_await record_write_len(addr, len);
+            if (setup_.cfg.enable_stats && !setup_.cfg.wraps()) co_await cycles(cost::FIFO_READ + cost::ALU);
+            co_await update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+        else if (cmd == fw::crc_cmd && setup_.cfg.enable_crc) {
+            // CRC
+            co_await cycles((before_crc + 1) * cost::CMP_BRANCH);
+            uint32_t addr;
+            bool ok;
+            co_await get_addr(addr, ok);
+            if (!ok) {
+                co_await abort_transaction();
+                continue;
+            }
+
+            co_await wait_for_cs_high(&polls);
+            PioSm& rsm = soc_.pio[fw::pio_read].sm[fw::pio_read_sm];
+            co_await cycles(cost::FIFO_READ + cost::CMP_BRANCH);
+            const bool have_len = rsm.rx_fifo.size() >= 4;
+            uint32_t len = 0;
+            if (have_len) {
+                for (int i = 0; i < 4; ++i) {
+                    co_await cycles(cost::FIFO_READ + 2 * cost::ALU);
+                    len = (len << 8) | (rsm.rx_fifo.front() & 0xff);
+                    rsm.rx_fifo.pop_front();
+                }
+            }
+
+            co_await reset_pios();
+            if (have_len) {
+                co_await cycles(cost::ALU);
+                uint32_t end = setup_.cfg.emu_ram_base() + setup_.cfg.emu_ram_size();
+                if (setup_.cfg.enable_flash) {
+                    if (addr_top & 0x40) {
+                        co_await cycles(cost::ALU);
+                        end = setup_.cfg.flash_base + 0x800000;
+                    }
+                    co_await flash_addr(addr_top, addr);
+                }
+                co_await start_crc(addr, end, len);
+            }
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+        else if ((cmd == fw::fill_cmd || cmd == fw::copy_cmd) && setup_.cfg.enable_bulk) {
+            // FILL or COPY
+            const bool copy = cmd == fw::copy_cmd;
+            co_await cycles((before_bulk + 1 + copy) * cost::CMP_BRANCH);
+            uint32_t addr;
+            bool have_addr;
+            co_await get_addr(addr, have_addr);
+            if (!have_addr) {
+                co_await abort_transaction();
+                continue;
+            }
+
+            uint32_t dst = addr, value = 0, len, count;
+            bool ok;
+            co_await cycles(cost::CMP_BRANCH);
+            if (!copy) {
+                co_await get_bulk_args(len, 4, count);
+                ok = count == 4;
+                if (ok) {
+                    co_await get_bulk_args(value, 1, count);
+                    ok = count == 1;
+                }
+            }
+            else {
+                const uint32_t addr_bytes = setup_.cfg.addr_bits / 8;
+                co_await get_bulk_args(dst, addr_bytes, count);
+                ok = count == addr_bytes;
+                if (ok) {
+                    co_await get_bulk_args(len, 4, count);
+                    ok = count == 4;
+                }
+                if (setup_.cfg.enable_flash) {
+                    co_await cycles(cost::CMP_BRANCH);
+                    if (dst & 0x800000) ok = false;
+                }
+                co_await cycles(2 * cost::ALU);
+                dst = setup_.cfg.emu_ram_base() + (dst & (setup_.cfg.emu_ram_size() - 1));
+            }
+            if (setup_.cfg.enable_flash) {
+                co_await cycles(cost::CMP_BRANCH);
+                if (addr_top & 0x40) ok = false;
+            }
+            co_await wait_for_cs_high(&polls);
+            co_await reset_pios();
+
+            co_await cycles(cost::CMP_BRANCH);
+            if (ok) {
+                co_await dma_channel_abort(fw::bulk_channel);
+                co_await cycles(cost::ALU + cost::REG_WRITE);
+                soc_.bus_write(setup_.cfg.fill_value_addr(), 4, value * 0x01010101);
+                if (setup_.cfg.enable_snapshot) co_await begin_snapshot_write();
+                co_await start_bulk(dst, copy ? addr : setup_.cfg.fill_value_addr(), len, copy);
+                if (setup_.cfg.enable_snapshot) co_await end_snapshot_range(dst, dst + len);
+                if (setup_.cfg.enable_persist || setup_.cfg.enable_write_events) co_await record_write(dst, dst + len);
+            }
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+        else if (cmd == fw::read_id_cmd && setup_.cfg.enable_psram_spi) {
+            // Read ID, the ID is sent straight away, with the write program
+            // patched not to skip bytes for the bottom 2 bits of the address
+            co_await cycles((before_psram + 1) * cost::CMP_BRANCH + cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp(write_wait);
+            co_await cycles(cost::REG_WRITE);
+            soc_.bus_write(dma_al3_read_addr_trig(fw::tx_channel), 4, setup_.cfg.psram_id_addr());
+
+            co_await wait_for_cs_high(&polls);
+            co_await abort_tx_channel(bytes);
+            co_await reset_pios();
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, bytes);
+
+            co_await cycles(cost::REG_WRITE);
+            wp.instr_mem[addr_loop_end] = pio_encode::jmp_pin(addr_two);
+            continue;
+        }
+        else if ((cmd == fw::wrap_toggle_cmd || cmd == fw::reset_cmd) && setup_.cfg.enable_psram_spi) {
+            // Wrap boundary toggle or reset
+            co_await cycles((before_psram + 2 + (cmd == fw::reset_cmd)) * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            co_await reset_pios();
+            co_await cycles(2 * cost::CMP_BRANCH);
+            co_await set_wrap(cmd == fw::wrap_toggle_cmd && wrap_size_ != 32 ? 5 : 10);
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+        else if (cmd == fw::wrmr_cmd && setup_.cfg.enable_mode_register) {
+            // WRMR
+            co_await cycles((before_wrmr + 1) * cost::CMP_BRANCH);
+            uint32_t mode;
+            if (setup_.cfg.addr_bits == 24) {
+                // All but the last bit of the mode byte were pushed with the command
+                co_await cycles(cost::ALU);
+                mode = addr_top << 1;
+                co_await wait_for_cs_high(&polls);
+            }
+            else {
+                // The mode byte is left in the bottom of the read SM's ISR, and
+                // X gives the number of bits of it read, shifted in below it
+                Pio& rp = soc_.pio[fw::pio_read];
+                co_await wait_for_cs_high(&polls);
+                co_await cycles(cost::SM_EXEC);
+                rp.sm_exec(fw::pio_read_sm, pio_encode::in(1, 4));
+                co_await cycles(cost::SM_EXEC);
+                rp.sm_exec(fw::pio_read_sm, pio_encode::push(false, false));
+                co_await pio_sm_get_blocking(fw::pio_read, fw::pio_read_sm, mode);
+                co_await cycles(cost::ALU + cost::CMP_BRANCH);
+                if ((mode & 0xf) > 12 - 7) {
+                    // Cut short in the mode byte
+                    co_await abort_transaction();
+                    continue;
+                }
+                co_await cycles(cost::ALU);
+                mode >>= 4;
+            }
+            co_await reset_pios();
+            co_await set_mode(mode);
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+        else if (cmd == 0x3B && setup_.cfg.enable_sdi) {
+            // EDIO
+            co_await cycles((before_multi_io + 1) * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            co_await enter_multi_io_mode(*setup_.dual_read_program, setup_.dual_read_config,
+                                         *setup_.dual_write_program, setup_.dual_write_config);
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            co_await core1_multi_io_main(polls);
+            command = SIM_SRAM_STATS_OTHER;
+        }
+        else if (cmd == 0x38 && setup_.cfg.enable_sqi) {
+            // EQIO
+            co_await cycles((before_multi_io + 1 + setup_.cfg.enable_sdi) * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            co_await enter_multi_io_mode(*setup_.quad_read_program, setup_.quad_read_config,
+                                         *setup_.quad_write_program, setup_.quad_write_config);
+            co_await update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            co_await core1_multi_io_main(polls);
+            command = SIM_SRAM_STATS_OTHER;
+        }
+        else {
+            // Ignore unknown command
+            co_await cycles((before_multi_io + setup_.cfg.enable_sdi + setup_.cfg.enable_sqi) * cost::CMP_BRANCH);
+            co_await wait_for_cs_high(&polls);
+            command = SIM_SRAM_STATS_UNKNOWN;
+        }
+        co_await reset_pios();
+        co_await update_stats(command, polls, bytes);
+    }
+}
@@ -0,0 +1,204 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "firmware_config.h"
+#include "pio_asm.h"
+#include "pio_sim.h"
+
+class Soc;
+
+// The state setup_sram_pio() leaves for core1_main.
+struct SramSetup {
+    FirmwareConfig cfg;
+    const PioProgram* read_program = nullptr;
+    const PioProgram* write_program = nullptr;
+    const PioProgram* dual_read_program = nullptr;
+    const PioProgram* dual_write_program = nullptr;
+    const PioProgram* quad_read_program = nullptr;
+    const PioProgram* quad_write_program = nullptr;
+    uint32_t pio_read_offset = 0;
+
+    PioSmConfig spi_read_config;
+    PioSmConfig spi_write_config;
+    PioSmConfig dual_read_config;
+    PioSmConfig dual_write_config;
+    PioSmConfig quad_read_config;
+    PioSmConfig quad_write_config;
+};
+
+// Cycle cost model of core1_main in sram.c.
+//
+// The model is written as a coroutine that follows the structure of
+// core1_main line by line.  Each access to a peripheral happens at the
+// cycle it would complete on the RP2040, assuming core1 runs from scratch X
+// with no bus contention, and every busy-wait loop is modelled as polling
+// at the rate of the compiled loop.
+class Core1Model {
+public:
+    // A coroutine running on the model core.  Tasks can co_await each other.
+    struct Task {
+        struct promise_type {
+            std::coroutine_handle<> continuation;
+
+            Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    auto c = h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { throw; }
+        };
+
+        explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+        Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+        Task(const Task&) = delete;
+        ~Task() { if (handle) handle.destroy(); }
+
+        bool await_ready() { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) {
+            handle.promise().continuation = c;
+            return handle;
+        }
+        void await_resume() {}
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Suspend until pred() is true, checking it every poll_cycles, then
+    // spend a further after_cycles before resuming.
+    struct Wait {
+        Core1Model& core;
+        std::function<bool()> pred;
+        uint32_t poll_cycles;
+        uint32_t after_cycles;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { core.suspend(h, pred, poll_cycles, after_cycles); }
+        void await_resume() {}
+    };
+
+    Core1Model(Soc& soc, const SramSetup& setup);
+
+    // sector_writes in sram.c, when persisting the RAM
+    std::vector<uint32_t> sector_writes;
+
+    // The write events core1 has queued.  Core0 is assumed to keep up, so
+    // none are dropped.
+    struct WriteEvent {
+        uint32_t addr, len, seq;
+        bool operator==(const WriteEvent&) const = default;
+    };
+    std::vector<WriteEvent> write_events;
+
+    // The doorbells core1 has queued.  Like the write events, none are dropped.
+    struct Doorbell {
+        uint32_t addr, value, seq;
+        bool operator==(const Doorbell&) const = default;
+    };
+    std::vector<Doorbell> doorbells;
+
+    // The snapshot state in sram.c, with the addresses in the RP2040's SRAM
+    struct Snapshot {
+        uint32_t gen = 0, active_low = 0, last_start = 0, last_end = 0;
+    };
+    Snapshot snapshot;
+
+    // The statistics core1 has counted, if enabled, indexed by SIM_SRAM_STATS_*
+    sim_sram_command_stats_t stats[SIM_SRAM_STATS_NUM_COMMANDS] = {};
+
+    // Start core1_main, as multicore_launch_core1 does.
+    void launch();
+
+    // Advance one cycle
+    void tick();
+
+private:
+    void suspend(std::coroutine_handle<> h, std::function<bool()> pred, uint32_t poll, uint32_t after);
+
+    Wait cycles(uint32_t n) { return Wait{*this, nullptr, 0, n}; }
+
+    // SDK functions used by core1_main
+    Task pio_sm_get_blocking(uint32_t pio, uint32_t sm, uint32_t& value);
+    Task wait_for_cmd(uint32_t& cmd, bool& ok);
+    Task get_cmd(uint32_t& cmd, bool& ok);
+    Task get_device_word(uint32_t read_sm, uint32_t cs, uint32_t& value, bool& ok);
+    Task get_word(uint32_t& value, bool& ok);
+    Task get_device_addr(uint32_t read_sm, uint32_t cs, uint32_t& addr, bool& ok);
+    Task get_addr(uint32_t& addr, bool& ok);
+    Task wait_for_device_cs_high(uint32_t cs, uint32_t* polls = nullptr);
+    Task wait_for_cs_high(uint32_t* polls = nullptr);
+    Task dma_channel_abort(uint32_t channel);
+    Task reset_device_pios(uint32_t read_sm);
+    Task reset_pios();
+    Task abort_device_transaction(uint32_t read_sm);
+    Task abort_transaction();
+    Task set_continuous_read(bool continuous);
+    Task update_continuous_read(bool& continuous);
+    Task core1_continuous_read_main(uint32_t polls, uint32_t bytes);
+    Task flash_addr(uint32_t addr_top, uint32_t& addr);
+    Task mark_sectors_written(uint32_t start, uint32_t end);
+    Task record_write(uint32_t start, uint32_t end);
+    Task abort_tx_channel(uint32_t& bytes);
+    Task update_stats(uint32_t command, uint32_t polls, uint32_t bytes);
+    Task update_crc_status();
+    Task start_crc(uint32_t addr, uint32_t end, uint32_t len);
+    Task update_bulk_status();
+    Task start_bulk(uint32_t dst, uint32_t src, uint32_t& len, bool copy);
+    Task get_bulk_args(uint32_t& value, uint32_t n, uint32_t& count);
+    bool is_status_read(uint32_t cmd) const;
+    Task update_status_block(uint32_t cmd, uint32_t& status);
+    Task set_wrap(uint32_t bits);
+    Task set_mode(uint32_t mode);
+    bool page_mode() const { return !(mode_reg_ & fw::mode_sequential); }
+    Task start_write(uint32_t addr);
+    Task drain_write(uint32_t sm);
+    Task write_len(uint32_t addr, uint32_t& len);
+    Task record_write_len(uint32_t addr, uint32_t len);
+    Task check_doorbell(uint32_t addr, uint32_t len);
+    Task begin_snapshot_write();
+    Task set_snapshot_write_addr(uint32_t addr);
+    Task end_snapshot_range(uint32_t start, uint32_t end);
+    Task end_snapshot_write(uint32_t addr, uint32_t len);
+
+    void set_y(uint32_t pio, uint32_t sm, uint32_t y);
+    void load_programs(const PioProgram& read_program, const PioSmConfig& read_config,
+                       const PioProgram& write_program, const PioSmConfig& write_config);
+    Task enter_multi_io_mode(const PioProgram& read_program, const PioSmConfig& read_config,
+                             const PioProgram& write_program, const PioSmConfig& write_config);
+    Task exit_multi_io_mode();
+    Task core1_multi_io_main(uint32_t& polls);
+    Task get_device_cmd(uint32_t& sm, uint32_t& cmd, bool& ok);
+    Task select_device(uint32_t sm);
+    Task core1_multi_device_main();
+    Task core1_main();
+
+    Soc& soc_;
+    const SramSetup& setup_;
+
+    std::coroutine_handle<> waiting_;
+    std::function<bool()> pred_;
+    uint32_t poll_ = 0;
+    uint32_t after_ = 0;
+    uint64_t resume_at_ = 0;
+    std::unique_ptr<Task> main_;
+
+    // mode_reg and wrap_size in sram.c
+    uint32_t mode_reg_ = fw::mode_sequential;
+    uint32_t wrap_size_ = 0;
+
+    // The device get_device_cmd() checks for an abort next
+    uint32_t check_device_ = 0;
+};
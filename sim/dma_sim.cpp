@@ -0,0 +1,128 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "dma_sim.h"
+
+#include "soc.h"
+
+namespace {
+
+uint32_t byte_swap(uint32_t data, uint32_t size) {
+    if (size == 4) return __builtin_bswap32(data);
+    if (size == 2) return ((data & 0xff) << 8) | ((data >> 8) & 0xff);
+    return data;
+}
+
+// Increment an address, wrapping within the ring if it has one
+uint32_t ring_increment(uint32_t addr, uint32_t size, uint32_t ring_size) {
+    if (!ring_size) return addr + size;
+    const uint32_t mask = (1u << ring_size) - 1;
+    return (addr & ~mask) | ((addr + size) & mask);
+}
+
+}  // namespace
+
+void Dma::trigger(uint32_t channel) {
+    DmaChannel& c = ch[channel];
+    c.trans_count = c.trans_count_reload;
+    c.busy = c.trans_count != 0;
+    c.earliest_issue = soc_.cycle() + TRIGGER_LATENCY;
+}
+
+void Dma::abort(uint32_t channel) {
+    // Transfers already in flight still complete, is_busy() stays true until they have.
+    ch[channel].busy = false;
+    ch[channel].trans_count = 0;
+}
+
+bool Dma::write_register(uint32_t addr, uint32_t data) {
+    if (addr < DMA_BASE || addr >= DMA_BASE + NUM_CHANNELS * DMA_CH_STRIDE) return false;
+    uint32_t channel = (addr - DMA_BASE) / DMA_CH_STRIDE;
+    DmaChannel& c = ch[channel];
+    switch ((addr - DMA_BASE) % DMA_CH_STRIDE) {
+    case 0x00: case 0x14: case 0x28: c.read_addr = data; break;
+    case 0x04: case 0x18: case 0x34: c.write_addr = data; break;
+    case 0x08: case 0x24: case 0x38: c.trans_count_reload = data; break;
+    case 0x1c: c.trans_count_reload = data; trigger(channel); break;
+    case 0x2c: c.write_addr = data; trigger(channel); break;
+    case 0x3c: c.read_addr = data; trigger(channel); break;
+    default: break;
+    }
+    return true;
+}
+
+bool Dma::dreq_ok(const DmaChannel& c, uint32_t channel) const {
+    if (c.treq == DMA_TREQ_PERMANENT) return true;
+    const Pio& pio = soc_.pio[c.treq / 8];
+    const PioSm& sm = pio.sm[c.treq % 4];
+    if ((c.treq % 8) < 4) return sm.tx_fifo.size() + c.in_flight < sm.tx_depth();
+    return sm.rx_fifo.size() > 0;
+}
+
+void Dma::step(uint64_t cycle) {
+    // Retire writes
+    while (!pending_.empty() && pending_.front().at <= cycle) {
+        PendingWrite w = pending_.front();
+        pending_.pop_front();
+        --ch[w.channel].in_flight;
+        soc_.bus_write(w.addr, w.size, w.data);
+    }
+
+    // Track how long each channel's DREQ has been asserted
+    for (uint32_t i = 0; i < NUM_CHANNELS; ++i) {
+        DmaChannel& c = ch[i];
+        if (c.busy && dreq_ok(c, i)) {
+            if (c.dreq_since == UINT64_MAX) c.dreq_since = cycle;
+        }
+        else {
+            c.dreq_since = UINT64_MAX;
+        }
+    }
+
+    // Issue at most one read
+    if (cycle < read_stalled_until_) return;
+    for (uint32_t n = 0; n < NUM_CHANNELS; ++n) {
+        uint32_t i = (next_channel_ + n) % NUM_CHANNELS;
+        if (ch[i].high_priority && ready(ch[i], cycle)) {
+            issue(i, cycle);
+            next_channel_ = (i + 1) % NUM_CHANNELS;
+            return;
+        }
+    }
+    for (uint32_t n = 0; n < NUM_CHANNELS; ++n) {
+        uint32_t i = (next_low_priority_channel_ + n) % NUM_CHANNELS;
+        if (!ch[i].high_priority && ready(ch[i], cycle)) {
+            issue(i, cycle);
+            next_low_priority_channel_ = (i + 1) % NUM_CHANNELS;
+            return;
+        }
+    }
+}
+
+bool Dma::ready(const DmaChannel& c, uint64_t cycle) const {
+    if (!c.busy || cycle < c.earliest_issue) return false;
+    return c.treq == DMA_TREQ_PERMANENT || (c.dreq_since != UINT64_MAX && cycle - c.dreq_since >= DREQ_LATENCY);
+}
+
+void Dma::issue(uint32_t channel, uint64_t cycle) {
+    DmaChannel& c = ch[channel];
+    const uint32_t stall = soc_.bus_read_stall(c.read_addr);
+    read_stalled_until_ = cycle + stall;
+    uint32_t data = soc_.bus_read(c.read_addr, c.data_size);
+    if (c.sniff) sniff(data, c.data_size);
+    if (c.bswap) data = byte_swap(data, c.data_size);
+    pending_.push_back({cycle + stall + WRITE_LATENCY, channel, c.write_addr, data, c.data_size});
+    ++c.in_flight;
+    if (c.incr_read) c.read_addr = ring_increment(c.read_addr, c.data_size, c.ring_write ? 0 : c.ring_size);
+    if (c.incr_write) c.write_addr = ring_increment(c.write_addr, c.data_size, c.ring_write ? c.ring_size : 0);
+    if (--c.trans_count == 0) c.busy = false;
+
+    // The DREQ counter has been used, it must be re-sampled before the next transfer
+    c.dreq_since = UINT64_MAX;
+}
+
+void Dma::sniff(uint32_t data, uint32_t size) {
+    for (uint32_t b = 0; b < size; ++b) {
+        sniff_data ^= (data >> (8 * b)) & 0xff;
+        for (int i = 0; i < 8; ++i) sniff_data = (sniff_data >> 1) ^ (0xEDB88320u & (0u - (sniff_data & 1)));
+    }
+}
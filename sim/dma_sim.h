@@ -0,0 +1,94 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <deque>
+
+class Soc;
+
+// DREQ numbers, as returned by pio_get_dreq
+inline uint32_t dma_dreq_pio(uint32_t pio, uint32_t sm, bool is_tx) {
+    return pio * 8 + (is_tx ? 0 : 4) + sm;
+}
+constexpr uint32_t DMA_TREQ_PERMANENT = 0x3f;
+
+struct DmaChannel {
+    uint32_t read_addr = 0;
+    uint32_t write_addr = 0;
+    uint32_t trans_count = 0;         // Remaining transfers
+    uint32_t trans_count_reload = 0;  // Value loaded on trigger
+    uint32_t data_size = 4;           // Bytes per transfer
+    bool incr_read = true;
+    bool incr_write = false;
+    bool bswap = false;
+    bool high_priority = false;
+    bool sniff = false;               // Data read is passed to the sniffer
+    uint32_t ring_size = 0;           // Log2 of the ring the address wraps within, 0 for none
+    bool ring_write = false;          // The ring wraps the write address, rather than the read
+    uint32_t treq = DMA_TREQ_PERMANENT;
+
+    bool busy = false;
+    uint64_t earliest_issue = 0;
+    uint64_t dreq_since = UINT64_MAX;
+    uint32_t in_flight = 0;
+};
+
+// Cycle level model of the DMA, sufficient for the channels used by the
+// SRAM emulation.  Each channel has a read and write phase, and the
+// DMA can issue one read and retire one write per cycle, round robin
+// between the high priority channels that are ready, then between the rest.
+// A read that stalls, on an XIP cache miss, holds up the reads of all
+// channels.  The sniffer only calculates CRC32 with bit reversed data, as
+// used by sram.c.
+class Dma {
+public:
+    static constexpr uint32_t NUM_CHANNELS = 12;
+
+    // Cycles from a trigger register write until the channel's first read.
+    static constexpr uint32_t TRIGGER_LATENCY = 2;
+    // Cycles a DREQ must be asserted before the DMA acts on it.
+    static constexpr uint32_t DREQ_LATENCY = 2;
+    // Cycles from a read being issued until the data is written.
+    static constexpr uint32_t WRITE_LATENCY = 2;
+
+    explicit Dma(Soc& soc) : soc_(soc) {}
+
+    DmaChannel ch[NUM_CHANNELS];
+
+    // The sniffer, in the form the reflected CRC32 algorithm works on.  Seeding
+    // it with 0xffffffff and reading it reversed and inverted gives the zlib CRC32.
+    uint32_t sniff_data = 0;
+    uint32_t sniff_result() const { return ~sniff_data; }
+
+    // Register interface used by bus writes and the core1 model
+    void trigger(uint32_t channel);
+    void abort(uint32_t channel);
+    bool is_busy(uint32_t channel) const { return ch[channel].busy || ch[channel].in_flight; }
+
+    // Handle a write to a channel register.  Returns false if the
+    // address is not a DMA register.
+    bool write_register(uint32_t addr, uint32_t data);
+
+    void step(uint64_t cycle);
+
+private:
+    struct PendingWrite {
+        uint64_t at;
+        uint32_t channel;
+        uint32_t addr;
+        uint32_t data;
+        uint32_t size;
+    };
+
+    bool dreq_ok(const DmaChannel& c, uint32_t channel) const;
+    bool ready(const DmaChannel& c, uint64_t cycle) const;
+    void issue(uint32_t channel, uint64_t cycle);
+    void sniff(uint32_t data, uint32_t size);
+
+    Soc& soc_;
+    std::deque<PendingWrite> pending_;
+    uint32_t next_channel_ = 0;
+    uint32_t next_low_priority_channel_ = 0;
+    uint64_t read_stalled_until_ = 0;
+};
@@ -0,0 +1,294 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+
+// Pull in the pin, PIO and DMA channel configuration from the firmware,
+// so the simulator always models the configuration that will be built.
+#define pio0 0
+#define pio1 1
+extern "C" {
+#include "sram.h"
+}
+
+namespace fw {
+    constexpr uint32_t mosi = SIM_SRAM_SPI_MOSI;
+    constexpr uint32_t sck = SIM_SRAM_SPI_SCK;
+    constexpr uint32_t cs = SIM_SRAM_SPI_CS;
+    constexpr uint32_t miso = SIM_SRAM_SPI_MISO;
+    constexpr bool enable_sdi = SIM_SRAM_ENABLE_SDI;
+    constexpr bool enable_sqi = SIM_SRAM_ENABLE_SQI;
+    constexpr uint32_t addr_bits = SIM_SRAM_ADDR_BITS;
+    constexpr bool non_striped = SIM_SRAM_NON_STRIPED;
+    constexpr bool enable_continuous_read = SIM_SRAM_ENABLE_CONTINUOUS_READ;
+    constexpr uint32_t continuous_read_mode = SIM_SRAM_CONTINUOUS_READ_MODE;
+    constexpr bool enable_flash = SIM_SRAM_ENABLE_FLASH;
+    constexpr uint32_t flash_base = SIM_SRAM_FLASH_BASE;
+    constexpr bool enable_persist = SIM_SRAM_ENABLE_PERSIST;
+    constexpr bool enable_write_events = SIM_SRAM_ENABLE_WRITE_EVENTS;
+    constexpr bool enable_doorbell = SIM_SRAM_ENABLE_DOORBELL;
+    constexpr uint32_t doorbell_addr = SIM_SRAM_DOORBELL_ADDR;
+    constexpr uint32_t doorbell_size = SIM_SRAM_DOORBELL_SIZE;
+    constexpr uint32_t status_addr = SIM_SRAM_STATUS_ADDR;
+    constexpr uint32_t status_size = SIM_SRAM_STATUS_SIZE;
+    constexpr bool enable_snapshot = SIM_SRAM_ENABLE_SNAPSHOT;
+    constexpr bool enable_stats = SIM_SRAM_ENABLE_STATS;
+    constexpr bool enable_crc = SIM_SRAM_ENABLE_CRC;
+    constexpr uint32_t crc_cmd = SIM_SRAM_CRC_CMD;
+    constexpr uint32_t crc_read_cmd = SIM_SRAM_CRC_READ_CMD;
+    constexpr bool enable_bulk = SIM_SRAM_ENABLE_BULK;
+    constexpr uint32_t fill_cmd = SIM_SRAM_FILL_CMD;
+    constexpr uint32_t copy_cmd = SIM_SRAM_COPY_CMD;
+    constexpr uint32_t bulk_status_cmd = SIM_SRAM_BULK_STATUS_CMD;
+    constexpr bool enable_mode_register = SIM_SRAM_ENABLE_MODE_REGISTER;
+    constexpr uint32_t wrmr_cmd = SIM_SRAM_WRMR_CMD;
+    constexpr uint32_t rdmr_cmd = SIM_SRAM_RDMR_CMD;
+    constexpr uint32_t mode_page = SIM_SRAM_MODE_PAGE;
+    constexpr uint32_t mode_sequential = SIM_SRAM_MODE_SEQUENTIAL;
+    constexpr uint32_t page_size = SIM_SRAM_PAGE_SIZE;
+    constexpr bool enable_psram_spi = SIM_SRAM_ENABLE_PSRAM_SPI;
+    constexpr uint32_t read_id_cmd = SIM_SRAM_READ_ID_CMD;
+    constexpr uint32_t wrap_toggle_cmd = SIM_SRAM_WRAP_TOGGLE_CMD;
+    constexpr uint32_t reset_cmd = SIM_SRAM_RESET_CMD;
+    constexpr uint8_t psram_id[8] = SIM_SRAM_PSRAM_ID;
+    constexpr uint32_t num_devices = SIM_SRAM_NUM_DEVICES;
+    constexpr uint32_t cs1 = SIM_SRAM_SPI_CS1;
+    constexpr uint32_t cs2 = SIM_SRAM_SPI_CS2;
+
+    constexpr uint32_t pio_read = SIM_SRAM_pio_read;
+    constexpr uint32_t pio_read_sm = SIM_SRAM_pio_read_sm;
+    constexpr uint32_t pio_write = SIM_SRAM_pio_write;
+    constexpr uint32_t pio_write_sm = SIM_SRAM_pio_write_sm;
+
+    constexpr uint32_t rx_channel = SIM_SRAM_rx_channel;
+    constexpr uint32_t tx_channel = SIM_SRAM_tx_channel;
+    constexpr uint32_t tx_channel2 = SIM_SRAM_tx_channel2;
+    constexpr uint32_t crc_channel = SIM_SRAM_crc_channel;
+    constexpr uint32_t bulk_channel = SIM_SRAM_bulk_channel;
+
+    constexpr uint32_t pio_write_offset = SIM_SRAM_pio_write_offset;
+}
+
+#undef pio0
+#undef pio1
+
+// The pin layout and build options of the firmware being simulated,
+// defaulting to sram.h.
+struct FirmwareConfig {
+    uint32_t mosi = fw::mosi;
+    uint32_t sck = fw::sck;
+    uint32_t cs = fw::cs;
+    uint32_t miso = fw::miso;
+    bool enable_sdi = fw::enable_sdi;
+    bool enable_sqi = fw::enable_sqi;
+    bool enable_continuous_read = fw::enable_continuous_read;
+    uint32_t addr_bits = fw::addr_bits;
+    bool non_striped = fw::non_striped;
+    bool enable_flash = fw::enable_flash;
+    uint32_t flash_base = fw::flash_base;
+    bool enable_persist = fw::enable_persist;
+    bool enable_write_events = fw::enable_write_events;
+    bool enable_doorbell = fw::enable_doorbell;
+    bool enable_snapshot = fw::enable_snapshot;
+    bool enable_stats = fw::enable_stats;
+    bool enable_crc = fw::enable_crc;
+    bool enable_bulk = fw::enable_bulk;
+    bool enable_mode_register = fw::enable_mode_register;
+    bool enable_psram_spi = fw::enable_psram_spi;
+    uint32_t num_devices = fw::num_devices;
+    uint32_t cs1 = fw::cs1;
+    uint32_t cs2 = fw::cs2;
+
+    uint32_t sio3() const { return mosi - 3; }
+
+    // The CS and read SM of each device
+    uint32_t device_cs(uint32_t device) const { return device == 0 ? cs : (device == 1 ? cs1 : cs2); }
+    uint32_t device_sm(uint32_t device) const { return fw::pio_read_sm + device; }
+
+    // The RAM of all the devices, SIM_SRAM_RAM_BASE, at the top of SRAM0-3 or of
+    // their non-striped aliases as placed by the linker script.  Each device has
+    // emu_ram_size() bytes.
+    uint32_t emu_ram_base() const { return (non_striped ? 0x21040000 : 0x20040000) - num_devices * emu_ram_size(); }
+    uint32_t emu_ram_size() const { return addr_bits == 24 ? 131072 : 65536; }
+
+    // ram_addr_prefix and ram_addr_prefix_reversed in sram.c, the read SM's Y
+    uint32_t addr_prefix() const { return emu_ram_base() >> (addr_bits == 24 ? 17 : 16); }
+    uint32_t addr_prefix_reversed() const {
+        uint32_t r = 0;
+        for (uint32_t i = 0; i < 16; ++i) r |= ((addr_prefix() >> i) & 1) << (15 - i);
+        return r;
+    }
+
+    // crc_status, crc_sink, bulk_status, fill_value and psram_id in sram.c, placed
+    // anywhere outside the RAM
+    uint32_t crc_status_addr() const { return 0x20000008; }
+    uint32_t crc_sink_addr() const { return 0x20000010; }
+    uint32_t bulk_status_addr() const { return 0x20000018; }
+    uint32_t fill_value_addr() const { return 0x20000020; }
+    uint32_t psram_id_addr() const { return 0x20000028; }
+
+    // SIM_SRAM_WRAP in sram.c
+    bool wraps() const { return enable_mode_register || enable_psram_spi; }
+
+    // Sectors tracked for persistence, FLASH_SECTOR_SIZE is 4kB
+    uint32_t num_sectors() const { return emu_ram_size() / 4096; }
+
+    // cmd_addr_clocks in sram.c
+    uint32_t cmd_addr_clocks() const { return 8 + addr_bits - 1; }
+
+    // The pins driven in SDI and SQI modes
+    uint32_t data_pins_mask() const { return enable_sqi ? 0xfu << sio3() : 3u << miso; }
+
+    // sram.h if it enables SDI and SQI, otherwise the example layout from
+    // sram.h with both enabled, write events and statistics.
+    static FirmwareConfig multi_io() {
+        FirmwareConfig c;
+        if (!c.enable_sdi || !c.enable_sqi) {
+            c.mosi = 5;
+            c.sck = 6;
+            c.cs = 7;
+            c.miso = 4;
+            c.enable_sdi = true;
+            c.enable_sqi = true;
+            c.addr_bits = 16;
+            c.enable_flash = false;
+            c.enable_persist = false;
+            c.enable_write_events = true;
+            c.enable_stats = true;
+        }
+        return c;
+    }
+
+    // sram.h with 24-bit addresses
+    static FirmwareConfig addr_24() {
+        FirmwareConfig c;
+        c.addr_bits = 24;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        return c;
+    }
+
+    // sram.h with 24-bit addresses and the flash region
+    static FirmwareConfig flash() {
+        FirmwareConfig c = addr_24();
+        c.enable_flash = true;
+        c.enable_persist = false;
+        return c;
+    }
+
+    // sram.h with the CRC commands
+    static FirmwareConfig crc() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.enable_crc = true;
+        return c;
+    }
+
+    // sram.h with the FILL and COPY commands, and write events
+    static FirmwareConfig bulk() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.enable_bulk = true;
+        c.enable_write_events = true;
+        return c;
+    }
+
+    // sram.h with the mode register, write events and statistics
+    static FirmwareConfig mode_register() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.addr_bits = 16;
+        c.enable_flash = false;
+        c.enable_persist = false;
+        c.enable_mode_register = true;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+
+    // sram.h with the PSRAM personality, write events and statistics
+    static FirmwareConfig psram() {
+        FirmwareConfig c = addr_24();
+        c.enable_flash = false;
+        c.enable_persist = false;
+        c.enable_mode_register = false;
+        c.enable_psram_spi = true;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+
+    // sram.h with 3 devices, write events and statistics
+    static FirmwareConfig multi_device() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.addr_bits = 16;
+        c.enable_continuous_read = false;
+        c.enable_flash = false;
+        c.enable_persist = false;
+        c.enable_crc = false;
+        c.enable_bulk = false;
+        c.enable_mode_register = false;
+        c.enable_psram_spi = false;
+        c.num_devices = 3;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+
+    // sram.h with the doorbell and status windows, write events and statistics
+    static FirmwareConfig doorbell() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.addr_bits = 16;
+        c.enable_flash = false;
+        c.enable_persist = false;
+        c.enable_doorbell = true;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+
+    // sram.h with the snapshot generation count, write events and statistics
+    static FirmwareConfig snapshot() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.addr_bits = 16;
+        c.enable_flash = false;
+        c.enable_persist = false;
+        c.enable_snapshot = true;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+
+    // sram.h with the RAM in the non-striped bank aliases
+    static FirmwareConfig non_striped_banks(uint32_t addr_bits) {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.addr_bits = addr_bits;
+        c.enable_flash = false;
+        c.non_striped = true;
+        return c;
+    }
+
+    // sram.h with the RAM persisted to flash, write events and statistics
+    static FirmwareConfig record_writes() {
+        FirmwareConfig c;
+        c.enable_sdi = false;
+        c.enable_sqi = false;
+        c.enable_flash = false;
+        c.enable_persist = true;
+        c.enable_write_events = true;
+        c.enable_stats = true;
+        return c;
+    }
+};
@@ -0,0 +1,36 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+
+// Pin levels seen on the bus, with the history needed to model
+// the input synchronisers on the RP2040.
+class Gpio {
+public:
+    // Latency through the 2 flop input synchroniser on PIO and SIO inputs.
+    static constexpr uint32_t SYNC_DELAY = 2;
+
+    static constexpr uint32_t HISTORY = 16;
+
+    // Set the level of all pins for the current cycle.
+    void record(uint64_t cycle, uint32_t levels) {
+        cycle_ = cycle;
+        history_[cycle % HISTORY] = levels;
+    }
+
+    // Level of all pins as seen by the PIO or SIO through the synchronisers.
+    uint32_t synced() const { return at(SYNC_DELAY); }
+
+    // Level of all pins some cycles ago.
+    uint32_t at(uint32_t cycles_ago) const {
+        if (cycles_ago > cycle_) return history_[0];
+        return history_[(cycle_ - cycles_ago) % HISTORY];
+    }
+
+    bool synced_pin(uint32_t pin) const { return (synced() >> pin) & 1; }
+
+private:
+    uint64_t cycle_ = 0;
+    uint32_t history_[HISTORY] = {};
+};
@@ -0,0 +1,428 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "pio_asm.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+enum : uint16_t {
+    OP_JMP  = 0x0000,
+    OP_WAIT = 0x2000,
+    OP_IN   = 0x4000,
+    OP_OUT  = 0x6000,
+    OP_PUSH = 0x8000,
+    OP_PULL = 0x8080,
+    OP_MOV  = 0xa000,
+    OP_IRQ  = 0xc000,
+    OP_SET  = 0xe000,
+};
+
+struct SourceLine {
+    int line_no;
+    std::string text;
+};
+
+struct Assembler {
+    std::string filename;
+    std::map<std::string, int> defines;
+
+    [[noreturn]] void error(int line_no, const std::string& msg) const {
+        throw std::runtime_error(filename + ":" + std::to_string(line_no) + ": " + msg);
+    }
+};
+
+std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos) return "";
+    size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+std::string strip_comment(const std::string& s) {
+    size_t pos = s.find(';');
+    size_t pos2 = s.find("//");
+    if (pos2 < pos) pos = pos2;
+    return pos == std::string::npos ? s : s.substr(0, pos);
+}
+
+// Split an instruction into tokens, treating commas as whitespace but keeping
+// [delay] and operators attached to their operands.
+std::vector<std::string> tokenize(const std::string& s) {
+    std::vector<std::string> tokens;
+    std::string cur;
+    for (char c : s) {
+        if (c == ',' || std::isspace((unsigned char)c)) {
+            if (!cur.empty()) tokens.push_back(cur);
+            cur.clear();
+        }
+        else if (c == '[') {
+            if (!cur.empty()) tokens.push_back(cur);
+            cur.assign(1, '[');
+        }
+        else {
+            cur += c;
+        }
+    }
+    if (!cur.empty()) tokens.push_back(cur);
+    return tokens;
+}
+
+struct ProgramBuilder {
+    PioProgram program;
+    std::vector<SourceLine> instr_lines;
+};
+
+int parse_value(const Assembler& as, int line_no, const std::string& tok,
+                const std::map<std::string, int>* labels = nullptr) {
+    std::string t = tok;
+    if (t.size() > 2 && t.front() == '(' && t.back() == ')') t = t.substr(1, t.size() - 2);
+    if (t.empty()) as.error(line_no, "missing value");
+    bool negate = false;
+    if (t[0] == '-') {
+        negate = true;
+        t = t.substr(1);
+    }
+    int value;
+    if (std::isdigit((unsigned char)t[0])) {
+        try {
+            if (t.size() > 2 && (t[1] == 'x' || t[1] == 'X')) value = std::stoi(t.substr(2), nullptr, 16);
+            else if (t.size() > 2 && (t[1] == 'b' || t[1] == 'B')) value = std::stoi(t.substr(2), nullptr, 2);
+            else value = std::stoi(t, nullptr, 10);
+        }
+        catch (const std::exception&) {
+            as.error(line_no, "bad number '" + tok + "'");
+        }
+    }
+    else if (labels && labels->count(t)) {
+        value = labels->at(t);
+    }
+    else if (as.defines.count(t)) {
+        value = as.defines.at(t);
+    }
+    else {
+        as.error(line_no, "unknown symbol '" + tok + "'");
+    }
+    return negate ? -value : value;
+}
+
+uint16_t encode_instruction(const Assembler& as, const PioProgram& prog, const SourceLine& line) {
+    std::vector<std::string> tok = tokenize(line.text);
+    int delay = 0;
+    int side = -1;
+
+    // Strip the trailing [delay] and side <n>
+    std::vector<std::string> args;
+    for (size_t i = 0; i < tok.size(); ++i) {
+        if (tok[i].front() == '[') {
+            std::string d = tok[i].substr(1);
+            if (d.empty() || d.back() != ']') as.error(line.line_no, "bad delay");
+            delay = parse_value(as, line.line_no, d.substr(0, d.size() - 1));
+        }
+        else if (lower(tok[i]) == "side" || lower(tok[i]) == "sideset") {
+            if (i + 1 >= tok.size()) as.error(line.line_no, "missing side set value");
+            side = parse_value(as, line.line_no, tok[++i]);
+        }
+        else {
+            args.push_back(tok[i]);
+        }
+    }
+    if (args.empty()) as.error(line.line_no, "empty instruction");
+
+    std::string op = lower(args[0]);
+    auto arg = [&](size_t i) -> std::string {
+        if (i >= args.size()) as.error(line.line_no, "missing operand for " + op);
+        return lower(args[i]);
+    };
+    auto value = [&](size_t i) { return parse_value(as, line.line_no, args.at(i), &prog.labels); };
+
+    uint16_t instr;
+    if (op == "nop") {
+        instr = OP_MOV | (2 << 5) | 2;  // mov y, y
+    }
+    else if (op == "jmp") {
+        static const std::map<std::string, int> conds = {
+            {"!x", 1}, {"x--", 2}, {"!y", 3}, {"y--", 4}, {"x!=y", 5}, {"pin", 6}, {"!osre", 7}};
+        int cond = 0;
+        size_t target = 1;
+        if (args.size() > 2) {
+            auto it = conds.find(arg(1));
+            if (it == conds.end()) as.error(line.line_no, "bad jmp condition '" + args[1] + "'");
+            cond = it->second;
+            target = 2;
+        }
+        int addr = value(target);
+        if (addr < 0 || addr > 31) as.error(line.line_no, "jmp target out of range");
+        instr = OP_JMP | (cond << 5) | addr;
+    }
+    else if (op == "wait") {
+        int pol = value(1);
+        std::string src = arg(2);
+        int src_bits;
+        if (src == "gpio") src_bits = 0;
+        else if (src == "pin") src_bits = 1;
+        else if (src == "irq") src_bits = 2;
+        else as.error(line.line_no, "bad wait source '" + src + "'");
+        int index = value(3);
+        if (args.size() > 4 && arg(4) == "rel") index |= 0x10;
+        instr = OP_WAIT | ((pol & 1) << 7) | (src_bits << 5) | (index & 0x1f);
+    }
+    else if (op == "in" || op == "out") {
+        static const std::map<std::string, int> in_srcs = {
+            {"pins", 0}, {"x", 1}, {"y", 2}, {"null", 3}, {"isr", 6}, {"osr", 7}};
+        static const std::map<std::string, int> out_dests = {
+            {"pins", 0}, {"x", 1}, {"y", 2}, {"null", 3}, {"pindirs", 4}, {"pc", 5}, {"isr", 6}, {"exec", 7}};
+        const auto& table = op == "in" ? in_srcs : out_dests;
+        auto it = table.find(arg(1));
+        if (it == table.end()) as.error(line.line_no, "bad " + op + " operand '" + args[1] + "'");
+        int count = value(2);
+        if (count < 1 || count > 32) as.error(line.line_no, "bit count out of range");
+        instr = (op == "in" ? OP_IN : OP_OUT) | (it->second << 5) | (count & 0x1f);
+    }
+    else if (op == "push" || op == "pull") {
+        bool if_flag = false;
+        bool block = true;
+        for (size_t i = 1; i < args.size(); ++i) {
+            std::string a = arg(i);
+            if (a == "iffull" || a == "ifempty") if_flag = true;
+            else if (a == "block") block = true;
+            else if (a == "noblock") block = false;
+            else as.error(line.line_no, "bad " + op + " operand '" + args[i] + "'");
+        }
+        instr = (op == "push" ? OP_PUSH : OP_PULL) | (if_flag << 6) | (block << 5);
+    }
+    else if (op == "mov") {
+        static const std::map<std::string, int> dests = {
+            {"pins", 0}, {"x", 1}, {"y", 2}, {"exec", 4}, {"pc", 5}, {"isr", 6}, {"osr", 7}};
+        static const std::map<std::string, int> srcs = {
+            {"pins", 0}, {"x", 1}, {"y", 2}, {"null", 3}, {"status", 5}, {"isr", 6}, {"osr", 7}};
+        auto d = dests.find(arg(1));
+        if (d == dests.end()) as.error(line.line_no, "bad mov destination '" + args[1] + "'");
+        std::string s = arg(2);
+        int mov_op = 0;
+        if (s[0] == '!' || s[0] == '~') {
+            mov_op = 1;
+            s = s.substr(1);
+        }
+        else if (s.rfind("::", 0) == 0) {
+            mov_op = 2;
+            s = s.substr(2);
+        }
+        auto sr = srcs.find(s);
+        if (sr == srcs.end()) as.error(line.line_no, "bad mov source '" + args[2] + "'");
+        instr = OP_MOV | (d->second << 5) | (mov_op << 3) | sr->second;
+    }
+    else if (op == "irq") {
+        int clr = 0, wait = 0;
+        size_t i = 1;
+        std::string mode = arg(1);
+        if (mode == "set" || mode == "nowait") ++i;
+        else if (mode == "wait") { wait = 1; ++i; }
+        else if (mode == "clear") { clr = 1; ++i; }
+        int index = value(i);
+        if (args.size() > i + 1 && arg(i + 1) == "rel") index |= 0x10;
+        instr = OP_IRQ | (clr << 6) | (wait << 5) | (index & 0x1f);
+    }
+    else if (op == "set") {
+        static const std::map<std::string, int> dests = {{"pins", 0}, {"x", 1}, {"y", 2}, {"pindirs", 4}};
+        auto d = dests.find(arg(1));
+        if (d == dests.end()) as.error(line.line_no, "bad set destination '" + args[1] + "'");
+        int v = value(2);
+        if (v < 0 || v > 31) as.error(line.line_no, "set value out of range");
+        instr = OP_SET | (d->second << 5) | v;
+    }
+    else {
+        as.error(line.line_no, "unknown instruction '" + args[0] + "'");
+    }
+
+    // Delay and side set share the 5 bit field
+    int side_bits = prog.side_set_count + (prog.side_set_opt ? 1 : 0);
+    int delay_bits = 5 - side_bits;
+    if (delay < 0 || delay >= (1 << delay_bits)) as.error(line.line_no, "delay out of range");
+    int field = delay;
+    if (side >= 0) {
+        if (prog.side_set_count == 0) as.error(line.line_no, "side set without .side_set");
+        int sv = side | (prog.side_set_opt ? (1 << prog.side_set_count) : 0);
+        field |= sv << delay_bits;
+    }
+    else if (prog.side_set_count && !prog.side_set_opt) {
+        as.error(line.line_no, "side set required");
+    }
+    instr |= field << 8;
+    return instr;
+}
+
+void finish_program(const Assembler& as, ProgramBuilder& b, std::vector<PioProgram>& out) {
+    PioProgram& p = b.program;
+    for (const auto& line : b.instr_lines) p.instructions.push_back(encode_instruction(as, p, line));
+    if (p.wrap < 0) p.wrap = (int)p.instructions.size() - 1;
+    out.push_back(std::move(p));
+}
+
+}  // namespace
+
+int PioProgram::offset_of(const std::string& label) const {
+    auto it = labels.find(label);
+    if (it == labels.end()) throw std::runtime_error("program " + name + " has no label " + label);
+    return it->second;
+}
+
+std::vector<PioProgram> pio_assemble(const std::string& source, const std::string& filename) {
+    Assembler as;
+    as.filename = filename;
+
+    std::vector<PioProgram> programs;
+    ProgramBuilder* cur = nullptr;
+    std::vector<ProgramBuilder> builders;
+    bool in_code_block = false;
+
+    std::istringstream in(source);
+    std::string raw;
+    int line_no = 0;
+    while (std::getline(in, raw)) {
+        ++line_no;
+        std::string t = trim(raw);
+        if (in_code_block) {
+            if (t.rfind("%}", 0) == 0) in_code_block = false;
+            continue;
+        }
+        if (t.rfind("%", 0) == 0) {
+            in_code_block = true;
+            continue;
+        }
+        t = trim(strip_comment(t));
+        if (t.empty()) continue;
+
+        if (t[0] == '.') {
+            std::vector<std::string> tok = tokenize(t);
+            std::string dir = lower(tok[0]);
+            if (dir == ".program") {
+                if (tok.size() < 2) as.error(line_no, ".program needs a name");
+                builders.emplace_back();
+                cur = &builders.back();
+                cur->program.name = tok[1];
+            }
+            else if (dir == ".define") {
+                size_t i = 1;
+                if (tok.size() > i && lower(tok[i]) == "public") ++i;
+                if (tok.size() < i + 2) as.error(line_no, "bad .define");
+                as.defines[tok[i]] = parse_value(as, line_no, tok[i + 1]);
+            }
+            else if (!cur) {
+                as.error(line_no, "directive before .program");
+            }
+            else if (dir == ".wrap_target") {
+                cur->program.wrap_target = (int)cur->instr_lines.size();
+            }
+            else if (dir == ".wrap") {
+                if (cur->instr_lines.empty()) as.error(line_no, ".wrap before any instruction");
+                cur->program.wrap = (int)cur->instr_lines.size() - 1;
+            }
+            else if (dir == ".origin") {
+                cur->program.origin = parse_value(as, line_no, tok.at(1));
+            }
+            else if (dir == ".side_set") {
+                cur->program.side_set_count = parse_value(as, line_no, tok.at(1));
+                for (size_t i = 2; i < tok.size(); ++i) {
+                    if (lower(tok[i]) == "opt") cur->program.side_set_opt = true;
+                    else if (lower(tok[i]) != "pindirs") as.error(line_no, "bad .side_set option");
+                }
+            }
+            else if (dir == ".lang_opt" || dir == ".fifo" || dir == ".clock_div") {
+                // Not relevant to the simulation
+            }
+            else {
+                as.error(line_no, "unknown directive " + tok[0]);
+            }
+            continue;
+        }
+
+        if (!cur) as.error(line_no, "instruction before .program");
+
+        // Labels, optionally PUBLIC, optionally followed by an instruction
+        size_t colon = t.find(':');
+        if (colon != std::string::npos && t.find("::") != colon) {
+            std::string label = trim(t.substr(0, colon));
+            bool is_public = false;
+            if (lower(label).rfind("public ", 0) == 0) {
+                is_public = true;
+                label = trim(label.substr(7));
+            }
+            int offset = (int)cur->instr_lines.size();
+            if (cur->program.labels.count(label)) as.error(line_no, "duplicate label " + label);
+            cur->program.labels[label] = offset;
+            if (is_public) cur->program.public_labels[label] = offset;
+            t = trim(t.substr(colon + 1));
+            if (t.empty()) continue;
+        }
+
+        cur->instr_lines.push_back({line_no, t});
+        if (cur->instr_lines.size() > 32) as.error(line_no, "program " + cur->program.name + " too long");
+    }
+
+    for (auto& b : builders) finish_program(as, b, programs);
+    return programs;
+}
+
+std::vector<PioProgram> pio_assemble_file(const std::string& path) {
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error("cannot open " + path);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return pio_assemble(ss.str(), path);
+}
+
+const PioProgram& pio_find_program(const std::vector<PioProgram>& programs, const std::string& name) {
+    for (const auto& p : programs) {
+        if (p.name == name) return p;
+    }
+    throw std::runtime_error("no program named " + name);
+}
+
+namespace pio_encode {
+    uint16_t jmp(uint32_t addr) { return OP_JMP | (addr & 0x1f); }
+    uint16_t jmp_pin(uint32_t addr) { return OP_JMP | (6 << 5) | (addr & 0x1f); }
+    uint16_t wait_pin(bool polarity, uint32_t pin) { return OP_WAIT | (polarity << 7) | (1 << 5) | (pin & 0x1f); }
+    uint16_t set_x(uint32_t value) { return OP_SET | (1 << 5) | (value & 0x1f); }
+    uint16_t set_pindirs(uint32_t value) { return OP_SET | (4 << 5) | (value & 0x1f); }
+    uint16_t push(bool if_full, bool block) { return OP_PUSH | (if_full << 6) | (block << 5); }
+    uint16_t in(uint32_t src, uint32_t count) { return OP_IN | ((src & 7) << 5) | (count & 0x1f); }
+}
+
+std::string pio_disassemble(uint16_t instr) {
+    static const char* jmp_conds[] = {"", "!x, ", "x--, ", "!y, ", "y--, ", "x!=y, ", "pin, ", "!osre, "};
+    static const char* in_srcs[] = {"pins", "x", "y", "null", "?", "?", "isr", "osr"};
+    static const char* out_dests[] = {"pins", "x", "y", "null", "pindirs", "pc", "isr", "exec"};
+    static const char* mov_dests[] = {"pins", "x", "y", "?", "exec", "pc", "isr", "osr"};
+    static const char* mov_srcs[] = {"pins", "x", "y", "null", "?", "status", "isr", "osr"};
+    static const char* mov_ops[] = {"", "!", "::", "?"};
+    static const char* set_dests[] = {"pins", "x", "y", "?", "pindirs", "?", "?", "?"};
+    static const char* wait_srcs[] = {"gpio", "pin", "irq", "?"};
+
+    char buf[64];
+    uint32_t a = (instr >> 5) & 7;
+    uint32_t b = instr & 0x1f;
+    switch (instr >> 13) {
+    case 0: snprintf(buf, sizeof(buf), "jmp %s%u", jmp_conds[a], b); break;
+    case 1: snprintf(buf, sizeof(buf), "wait %u %s %u", (instr >> 7) & 1, wait_srcs[a & 3], b); break;
+    case 2: snprintf(buf, sizeof(buf), "in %s, %u", in_srcs[a], b ? b : 32); break;
+    case 3: snprintf(buf, sizeof(buf), "out %s, %u", out_dests[a], b ? b : 32); break;
+    case 4: snprintf(buf, sizeof(buf), "%s", (instr & 0x80) ? "pull" : "push"); break;
+    case 5: snprintf(buf, sizeof(buf), "mov %s, %s%s", mov_dests[a], mov_ops[(instr >> 3) & 3], mov_srcs[instr & 7]); break;
+    case 6: snprintf(buf, sizeof(buf), "irq %u", b); break;
+    default: snprintf(buf, sizeof(buf), "set %s, %u", set_dests[a], b); break;
+    }
+    uint32_t delay = (instr >> 8) & 0x1f;
+    std::string s = buf;
+    if (delay) s += " [" + std::to_string(delay) + "]";
+    return s;
+}
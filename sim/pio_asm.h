@@ -0,0 +1,56 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Minimal PIO assembler for the host simulator.
+//
+// This understands the subset of pioasm syntax used by the programs in this
+// project, and produces the same machine code pioasm would, so that the
+// simulator runs exactly what is loaded into the PIO on the RP2040.
+// The % c-sdk blocks are skipped - the simulator replicates the init
+// functions itself.
+
+struct PioProgram {
+    std::string name;
+    std::vector<uint16_t> instructions;
+    int origin = -1;
+    int wrap_target = 0;
+    int wrap = -1;        // -1 until the end of the program is known
+    int side_set_count = 0;
+    bool side_set_opt = false;
+
+    // Label offsets, as exported in the generated header (PUBLIC only) and
+    // all labels for the benefit of tracing.
+    std::map<std::string, int> public_labels;
+    std::map<std::string, int> labels;
+
+    int offset_of(const std::string& label) const;
+};
+
+// Assemble every program in the file.  Throws std::runtime_error with the
+// file and line number on a syntax error.
+std::vector<PioProgram> pio_assemble_file(const std::string& path);
+std::vector<PioProgram> pio_assemble(const std::string& source, const std::string& filename);
+
+const PioProgram& pio_find_program(const std::vector<PioProgram>& programs, const std::string& name);
+
+// Encoders matching the SDK's pio_encode_* helpers, used by the core1 model
+// when it patches instruction memory or executes instructions directly.
+namespace pio_encode {
+    uint16_t jmp(uint32_t addr);
+    uint16_t jmp_pin(uint32_t addr);
+    uint16_t wait_pin(bool polarity, uint32_t pin);
+    uint16_t set_x(uint32_t value);
+    uint16_t set_pindirs(uint32_t value);
+    uint16_t push(bool if_full, bool block);
+    // src is the field of the instruction, so in(1, 4) is in x, 4
+    uint16_t in(uint32_t src, uint32_t count);
+}
+
+// Disassemble one instruction, for traces.
+std::string pio_disassemble(uint16_t instr);
@@ -0,0 +1,255 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "pio_sim.h"
+
+#include "gpio_sim.h"
+
+namespace {
+
+uint32_t mask_bits(uint32_t n) {
+    return n >= 32 ? 0xffffffffu : ((1u << n) - 1);
+}
+
+uint32_t bit_reverse(uint32_t v) {
+    uint32_t r = 0;
+    for (int i = 0; i < 32; ++i) {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+}  // namespace
+
+void Pio::load_program(const PioProgram& program, uint32_t offset) {
+    for (size_t i = 0; i < program.instructions.size(); ++i) {
+        uint16_t instr = program.instructions[i];
+        // Relocate jmp targets, as pio_add_program does
+        if ((instr >> 13) == 0) instr = (instr & ~0x1f) | ((instr + offset) & 0x1f);
+        instr_mem[(offset + i) & 31] = instr;
+    }
+}
+
+void Pio::sm_init(uint32_t sm_index, uint32_t initial_pc, const PioSmConfig& cfg) {
+    PioSm& s = sm[sm_index];
+    s.enabled = false;
+    s.cfg = cfg;
+    sm_clear_fifos(sm_index);
+    sm_restart(sm_index);
+    s.pc = initial_pc;
+}
+
+void Pio::sm_clear_fifos(uint32_t sm_index) {
+    sm[sm_index].tx_fifo.clear();
+    sm[sm_index].rx_fifo.clear();
+}
+
+void Pio::sm_restart(uint32_t sm_index) {
+    PioSm& s = sm[sm_index];
+    s.isr = 0;
+    s.isr_count = 0;
+    s.osr_count = 32;
+    s.delay = 0;
+    s.exec_pending = false;
+}
+
+void Pio::sm_exec(uint32_t sm_index, uint16_t instr) {
+    PioSm& s = sm[sm_index];
+    bool jumped = false;
+    if (!execute(s, instr, jumped)) {
+        s.exec_pending = true;
+        s.exec_instr = instr;
+    }
+}
+
+uint32_t Pio::read_pins(const PioSm& s) const {
+    uint32_t v = gpio_.synced();
+    uint32_t b = s.cfg.in_base & 31;
+    return b ? ((v >> b) | (v << (32 - b))) : v;
+}
+
+bool Pio::execute(PioSm& s, uint16_t instr, bool& jumped) {
+    const uint32_t op = instr >> 13;
+    const uint32_t a = (instr >> 5) & 7;
+    const uint32_t b = instr & 0x1f;
+    jumped = false;
+
+    auto write_pins = [&](uint32_t base, uint32_t count, uint32_t data, uint32_t& target) {
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t pin = (base + i) & 31;
+            if ((data >> i) & 1) target |= 1u << pin;
+            else target &= ~(1u << pin);
+        }
+    };
+
+    switch (op) {
+    case 0: {  // JMP
+        bool take;
+        switch (a) {
+        case 0: take = true; break;
+        case 1: take = s.x == 0; break;
+        case 2: take = s.x != 0; --s.x; break;
+        case 3: take = s.y == 0; break;
+        case 4: take = s.y != 0; --s.y; break;
+        case 5: take = s.x != s.y; break;
+        case 6: take = gpio_.synced_pin(s.cfg.jmp_pin); break;
+        default: take = s.osr_count < s.cfg.pull_thresh; break;
+        }
+        if (take) {
+            s.pc = b;
+            jumped = true;
+        }
+        return true;
+    }
+    case 1: {  // WAIT
+        uint32_t pol = (instr >> 7) & 1;
+        uint32_t level;
+        if ((a & 3) == 0) level = gpio_.synced_pin(b);
+        else if ((a & 3) == 1) level = (read_pins(s) >> b) & 1;
+        else level = 1;  // IRQ waits are not used by the SRAM programs
+        return level == pol;
+    }
+    case 2: {  // IN
+        uint32_t n = b ? b : 32;
+        uint32_t data;
+        switch (a) {
+        case 0: data = read_pins(s); break;
+        case 1: data = s.x; break;
+        case 2: data = s.y; break;
+        case 6: data = s.isr; break;
+        case 7: data = s.osr; break;
+        default: data = 0; break;
+        }
+        data &= mask_bits(n);
+        uint32_t isr;
+        if (s.cfg.in_shift_right) isr = (n == 32) ? data : ((s.isr >> n) | (data << (32 - n)));
+        else isr = (n == 32) ? data : ((s.isr << n) | data);
+        uint32_t count = s.isr_count + n;
+        if (count > 32) count = 32;
+        if (s.cfg.autopush && count >= s.cfg.push_thresh) {
+            if (s.rx_fifo.size() >= s.rx_depth()) return false;
+            s.rx_fifo.push_back(isr);
+            s.isr = 0;
+            s.isr_count = 0;
+        }
+        else {
+            s.isr = isr;
+            s.isr_count = count;
+        }
+        return true;
+    }
+    case 3: {  // OUT
+        uint32_t n = b ? b : 32;
+        if (s.cfg.autopull && s.osr_count >= s.cfg.pull_thresh) {
+            if (s.tx_fifo.empty()) return false;
+            s.osr = s.tx_fifo.front();
+            s.tx_fifo.pop_front();
+            s.osr_count = 0;
+        }
+        uint32_t data;
+        if (s.cfg.out_shift_right) {
+            data = s.osr & mask_bits(n);
+            s.osr = (n == 32) ? 0 : (s.osr >> n);
+        }
+        else {
+            data = (n == 32) ? s.osr : (s.osr >> (32 - n));
+            s.osr = (n == 32) ? 0 : (s.osr << n);
+        }
+        s.osr_count += n;
+        if (s.osr_count > 32) s.osr_count = 32;
+        switch (a) {
+        case 0: write_pins(s.cfg.out_base, s.cfg.out_count, data, pin_values); break;
+        case 1: s.x = data; break;
+        case 2: s.y = data; break;
+        case 4: write_pins(s.cfg.out_base, s.cfg.out_count, data, pin_dirs); break;
+        case 5: s.pc = data & 31; jumped = true; break;
+        case 6: s.isr = data; s.isr_count = n; break;
+        default: break;
+        }
+        return true;
+    }
+    case 4: {
+        bool if_flag = (instr >> 6) & 1;
+        bool block = (instr >> 5) & 1;
+        if (instr & 0x80) {  // PULL
+            if (if_flag && s.osr_count < s.cfg.pull_thresh) return true;
+            if (s.tx_fifo.empty()) {
+                if (block) return false;
+                s.osr = s.x;
+            }
+            else {
+                s.osr = s.tx_fifo.front();
+                s.tx_fifo.pop_front();
+            }
+            s.osr_count = 0;
+        }
+        else {  // PUSH
+            if (if_flag && s.isr_count < s.cfg.push_thresh) return true;
+            if (s.rx_fifo.size() >= s.rx_depth()) {
+                if (block) return false;
+            }
+            else {
+                s.rx_fifo.push_back(s.isr);
+            }
+            s.isr = 0;
+            s.isr_count = 0;
+        }
+        return true;
+    }
+    case 5: {  // MOV
+        uint32_t data;
+        switch (instr & 7) {
+        case 0: data = read_pins(s); break;
+        case 1: data = s.x; break;
+        case 2: data = s.y; break;
+        case 6: data = s.isr; break;
+        case 7: data = s.osr; break;
+        default: data = 0; break;
+        }
+        uint32_t mov_op = (instr >> 3) & 3;
+        if (mov_op == 1) data = ~data;
+        else if (mov_op == 2) data = bit_reverse(data);
+        switch (a) {
+        case 0: write_pins(s.cfg.out_base, s.cfg.out_count, data, pin_values); break;
+        case 1: s.x = data; break;
+        case 2: s.y = data; break;
+        case 5: s.pc = data & 31; jumped = true; break;
+        case 6: s.isr = data; s.isr_count = 0; break;
+        case 7: s.osr = data; s.osr_count = 0; break;
+        default: break;
+        }
+        return true;
+    }
+    case 6:  // IRQ - not used by the SRAM programs
+        return true;
+    default: {  // SET
+        switch (a) {
+        case 0: write_pins(s.cfg.set_base, s.cfg.set_count, b, pin_values); break;
+        case 1: s.x = b; break;
+        case 2: s.y = b; break;
+        case 4: write_pins(s.cfg.set_base, s.cfg.set_count, b, pin_dirs); break;
+        default: break;
+        }
+        return true;
+    }
+    }
+}
+
+void Pio::step() {
+    for (PioSm& s : sm) {
+        if (!s.enabled) continue;
+        if (s.delay) {
+            --s.delay;
+            continue;
+        }
+
+        bool from_exec = s.exec_pending;
+        uint16_t instr = from_exec ? s.exec_instr : instr_mem[s.pc];
+        bool jumped;
+        if (!execute(s, instr, jumped)) continue;
+
+        if (from_exec) s.exec_pending = false;
+        else if (!jumped) s.pc = (s.pc == s.cfg.wrap) ? s.cfg.wrap_target : ((s.pc + 1) & 31);
+        s.delay = (instr >> 8) & 0x1f;
+    }
+}
@@ -0,0 +1,88 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <deque>
+
+#include "pio_asm.h"
+
+class Gpio;
+
+// Mirrors the fields of the SDK's pio_sm_config that the SRAM programs use.
+struct PioSmConfig {
+    uint32_t wrap_target = 0;
+    uint32_t wrap = 31;
+    uint32_t in_base = 0;
+    uint32_t out_base = 0;
+    uint32_t out_count = 0;
+    uint32_t set_base = 0;
+    uint32_t set_count = 0;
+    uint32_t jmp_pin = 0;
+    bool in_shift_right = true;
+    bool autopush = false;
+    uint32_t push_thresh = 32;
+    bool out_shift_right = true;
+    bool autopull = false;
+    uint32_t pull_thresh = 32;
+    bool join_tx = false;
+    bool join_rx = false;
+};
+
+struct PioSm {
+    PioSmConfig cfg;
+    bool enabled = false;
+    uint32_t pc = 0;
+    uint32_t x = 0, y = 0;
+    uint32_t isr = 0, isr_count = 0;
+    uint32_t osr = 0, osr_count = 32;
+    uint32_t delay = 0;
+    bool exec_pending = false;
+    uint16_t exec_instr = 0;
+    std::deque<uint32_t> tx_fifo;
+    std::deque<uint32_t> rx_fifo;
+
+    uint32_t tx_depth() const { return cfg.join_tx ? 8 : (cfg.join_rx ? 0 : 4); }
+    uint32_t rx_depth() const { return cfg.join_rx ? 8 : (cfg.join_tx ? 0 : 4); }
+    bool tx_full() const { return tx_fifo.size() >= tx_depth(); }
+    bool rx_empty() const { return rx_fifo.empty(); }
+};
+
+// Cycle level model of one PIO block, clocked at the system clock
+// (all SMs are run with a clock divider of 1).
+class Pio {
+public:
+    Pio(int index, Gpio& gpio) : index_(index), gpio_(gpio) {}
+
+    int index() const { return index_; }
+
+    uint16_t instr_mem[32] = {};
+    PioSm sm[4];
+
+    // Load a program at the given offset, relocating jmp targets like
+    // pio_add_program_at_offset.
+    void load_program(const PioProgram& program, uint32_t offset);
+
+    // Equivalents of the SDK calls made from sram.c
+    void sm_init(uint32_t sm_index, uint32_t initial_pc, const PioSmConfig& cfg);
+    void sm_set_enabled(uint32_t sm_index, bool enabled) { sm[sm_index].enabled = enabled; }
+    void sm_clear_fifos(uint32_t sm_index);
+    void sm_restart(uint32_t sm_index);
+    void sm_exec(uint32_t sm_index, uint16_t instr);
+    void sm_put(uint32_t sm_index, uint32_t data) { sm[sm_index].tx_fifo.push_back(data); }
+
+    // Advance one system clock.
+    void step();
+
+    // Output levels and enables driven by this PIO.
+    uint32_t pin_values = 0;
+    uint32_t pin_dirs = 0;
+
+private:
+    // Returns false if the instruction stalled.
+    bool execute(PioSm& s, uint16_t instr, bool& jumped);
+    uint32_t read_pins(const PioSm& s) const;
+
+    int index_;
+    Gpio& gpio_;
+};
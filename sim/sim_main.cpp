@@ -0,0 +1,1118 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+//
+// Host simulator for the SPI RAM emulation.
+//
+// Runs the PIO programs from sram.pio, the DMA channels and a cycle cost
+// model of core1_main against an SPI master, sweeping the SCK period to find
+// the fastest SCK each command works at for each start address alignment.
+// With --cs-high-sweep it instead finds the shortest time CS must be high
+// between transactions for each command.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "firmware_config.h"
+#include "pio_asm.h"
+#include "sram_sim.h"
+
+namespace {
+
+enum class Mode { Spi, Sdi, Sqi, Spi24, Flash, Record, Crc, Bulk, Page, Psram, Multi, Doorbell, Snapshot, Banks, Banks24 };
+enum class Command { Read, FastRead, Write, Mixed, ContinuousRead, Abort, Crc, Bulk, ModeRegister, ReadId };
+
+struct CommandInfo {
+    Mode mode;
+    Command command;
+    const char* name;
+    // SCK period, in SYS clocks, for commands that only work at a slower SCK:
+    // the sweep starts no faster than this, and --cs-high-sweep uses it.
+    uint32_t slowest = 0;
+};
+
+const CommandInfo commands[] = {
+    {Mode::Spi, Command::Read, "READ"},
+    {Mode::Spi, Command::FastRead, "FAST READ"},
+    {Mode::Spi, Command::Write, "WRITE"},
+    {Mode::Spi, Command::Mixed, "Mixed"},
+    {Mode::Spi, Command::ContinuousRead, "CONT READ"},
+    {Mode::Spi, Command::Abort, "ABORT"},
+    {Mode::Spi24, Command::Read, "READ 24"},
+    {Mode::Spi24, Command::FastRead, "FAST READ 24"},
+    {Mode::Spi24, Command::Write, "WRITE 24"},
+    {Mode::Spi24, Command::Mixed, "Mixed 24"},
+    {Mode::Spi24, Command::Abort, "ABORT 24"},
+    {Mode::Flash, Command::Read, "FLASH READ", 40},
+    {Mode::Flash, Command::FastRead, "FLASH FAST READ", 16},
+    {Mode::Flash, Command::Write, "FLASH WRITE"},
+    {Mode::Flash, Command::Mixed, "FLASH Mixed", 16},
+    {Mode::Flash, Command::Crc, "FLASH CRC", 10},
+    {Mode::Record, Command::Write, "RECORD WRITE"},
+    {Mode::Record, Command::Mixed, "RECORD Mixed"},
+    {Mode::Crc, Command::Crc, "CRC"},
+    {Mode::Crc, Command::Mixed, "CRC Mixed"},
+    {Mode::Bulk, Command::Bulk, "FILL / COPY"},
+    {Mode::Page, Command::Read, "PAGE READ"},
+    {Mode::Page, Command::FastRead, "PAGE FAST READ"},
+    {Mode::Page, Command::Write, "PAGE WRITE"},
+    {Mode::Page, Command::Mixed, "PAGE Mixed"},
+    {Mode::Page, Command::ModeRegister, "RDMR", 50},
+    {Mode::Page, Command::Abort, "PAGE ABORT"},
+    {Mode::Psram, Command::Read, "PSRAM READ"},
+    {Mode::Psram, Command::FastRead, "PSRAM FAST READ"},
+    {Mode::Psram, Command::Write, "PSRAM WRITE"},
+    {Mode::Psram, Command::Mixed, "PSRAM Mixed"},
+    {Mode::Psram, Command::ReadId, "READ ID"},
+    {Mode::Psram, Command::Abort, "PSRAM ABORT"},
+    {Mode::Multi, Command::Read, "MULTI READ"},
+    {Mode::Multi, Command::FastRead, "MULTI FAST READ"},
+    {Mode::Multi, Command::Write, "MULTI WRITE"},
+    {Mode::Multi, Command::Mixed, "MULTI Mixed"},
+    {Mode::Multi, Command::Abort, "MULTI ABORT"},
+    {Mode::Doorbell, Command::Write, "DOORBELL WRITE"},
+    {Mode::Doorbell, Command::Mixed, "DOORBELL Mixed"},
+    {Mode::Snapshot, Command::Write, "SNAPSHOT WRITE"},
+    {Mode::Snapshot, Command::Mixed, "SNAPSHOT Mixed"},
+    {Mode::Banks, Command::Read, "BANKS READ"},
+    {Mode::Banks, Command::FastRead, "BANKS FAST READ"},
+    {Mode::Banks, Command::Write, "BANKS WRITE"},
+    {Mode::Banks24, Command::Mixed, "BANKS Mixed 24"},
+    {Mode::Sdi, Command::Read, "SDI READ"},
+    {Mode::Sdi, Command::FastRead, "SDI FAST READ"},
+    {Mode::Sdi, Command::Write, "SDI WRITE"},
+    {Mode::Sdi, Command::Mixed, "SDI Mixed"},
+    {Mode::Sdi, Command::Abort, "SDI ABORT"},
+    {Mode::Sqi, Command::Read, "SQI READ"},
+    {Mode::Sqi, Command::FastRead, "SQI FAST READ"},
+    {Mode::Sqi, Command::Write, "SQI WRITE"},
+    {Mode::Sqi, Command::Mixed, "SQI Mixed"},
+    {Mode::Sqi, Command::Abort, "SQI ABORT"},
+};
+
+// SPI mode with 16 or 24-bit addresses.  In Flash mode the addresses are in
+// the flash region, and the XIP cache is emptied before each transaction.
+// Record mode persists the RAM, queues write events and counts statistics,
+// and checks what is recorded for each WRITE.  Crc mode has the CRC
+// commands, and a CRC of the whole RAM runs during its Mixed commands.
+// Bulk mode has the FILL and COPY commands, and write events.  Page mode
+// has the mode register set to page mode, with write events and statistics,
+// and transactions long enough to wrap within the page.  Psram mode has the
+// PSRAM personality, with write events and statistics, and transactions
+// that often wrap within 1kB, or 32 bytes after a wrap boundary toggle.
+// Multi mode has 3 devices, with write events and statistics, and each
+// transaction selects one at random.  Doorbell mode has the doorbell and
+// status windows, with write events and statistics, and half the
+// transactions end in the windows, while core0 publishes status words.
+// Snapshot mode has the snapshot generation count, with write events and
+// statistics, and checks a WRITE is never part way through while the count is
+// even.
+// Banks mode has the RAM in the non-striped bank aliases, with 16 or 24-bit
+// addresses.
+bool is_spi(Mode mode) {
+    return mode == Mode::Spi || mode == Mode::Spi24 || mode == Mode::Flash || mode == Mode::Record ||
+           mode == Mode::Crc || mode == Mode::Bulk || mode == Mode::Page || mode == Mode::Psram ||
+           mode == Mode::Multi || mode == Mode::Doorbell || mode == Mode::Snapshot || mode == Mode::Banks || mode == Mode::Banks24;
+}
+
+// The offset in the RAM of data byte i of a transaction from addr, wrapping
+// within blocks of wrap bytes unless wrap is 0.
+uint32_t data_addr(uint32_t wrap, uint32_t addr, uint32_t i) {
+    if (!wrap) return addr + i;
+    return (addr & ~(wrap - 1)) | ((addr + i) & (wrap - 1));
+}
+
+// Bits transferred per clock
+uint32_t mode_width(Mode mode) {
+    return is_spi(mode) ? 1 : (mode == Mode::Sdi ? 2 : 4);
+}
+
+// SCK period used to enter and leave SDI and SQI mode, and check SPI mode works afterwards.
+constexpr uint32_t MODE_SWITCH_PERIOD = 16;
+
+// CS high time after EDIO, EQIO and RSTIO, to allow for the mode switch.
+constexpr uint32_t MODE_SWITCH_CS_HIGH = 2000;
+
+// The maximum SCK rate, as a SYS clock divisor, published in the README.
+// --check fails if the simulation is slower than any of these.
+const std::vector<std::pair<std::string, uint32_t>> published_limits = {
+    {"READ", 8},
+    {"FAST READ", 8},
+    {"WRITE", 6},
+    {"CONT READ", 8},
+    {"ABORT", 8},
+    {"READ 24", 8},
+    {"FAST READ 24", 8},
+    {"WRITE 24", 6},
+    {"ABORT 24", 8},
+    {"RECORD WRITE", 6},
+    {"CRC", 8},
+    {"FILL / COPY", 8},
+    {"PAGE READ", 8},
+    {"PAGE FAST READ", 8},
+    {"PAGE WRITE", 6},
+    {"RDMR", 50},
+    {"PAGE ABORT", 8},
+    {"PSRAM READ", 8},
+    {"PSRAM FAST READ", 8},
+    {"PSRAM WRITE", 6},
+    {"READ ID", 8},
+    {"PSRAM ABORT", 8},
+    {"MULTI READ", 8},
+    {"MULTI FAST READ", 8},
+    {"MULTI WRITE", 6},
+    {"MULTI ABORT", 8},
+    {"DOORBELL WRITE", 6},
+    {"SNAPSHOT WRITE", 6},
+    {"BANKS READ", 8},
+    {"BANKS FAST READ", 8},
+    {"BANKS WRITE", 6},
+    {"FLASH READ", 32},
+    {"FLASH FAST READ", 12},
+    {"FLASH WRITE", 4},
+    {"FLASH CRC", 10},
+    {"SDI READ", 6},
+    {"SDI WRITE", 6},
+    {"SDI ABORT", 6},
+    {"SQI READ", 8},
+    {"SQI WRITE", 6},
+    {"SQI ABORT", 8},
+};
+
+// The Tasks of the core1 model that have no function of the same name in
+// sram.c, which are the SDK functions core1 calls.
+const std::set<std::string> model_only_tasks = {
+    "pio_sm_get_blocking",
+    "dma_channel_abort",
+};
+
+static std::string read_file(const char* path) {
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error(std::string("can't open ") + path);
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+// The model is a hand written copy of core1_main, so check it hasn't drifted
+// from sram.c: each Task in the model must be a static function in sram.c, and
+// each function sram.c puts in scratch X for core1 must be a Task in the model.
+static bool check_model_matches_firmware() {
+    const std::string model = read_file(CORE1_MODEL_FILE);
+    const std::string firmware = read_file(SRAM_C_FILE);
+
+    std::set<std::string> tasks;
+    // The members of Core1Model, not those of Task::promise_type
+    const std::regex task_re(R"(^    Task (\w+)\()", std::regex::multiline);
+    for (auto it = std::sregex_iterator(model.begin(), model.end(), task_re); it != std::sregex_iterator(); ++it) {
+        tasks.insert((*it)[1]);
+    }
+
+    std::set<std::string> functions;
+    const std::regex function_re(R"(^static[^=;\n]*\b(\w+)\()", std::regex::multiline);
+    for (auto it = std::sregex_iterator(firmware.begin(), firmware.end(), function_re); it != std::sregex_iterator(); ++it) {
+        functions.insert((*it)[1]);
+    }
+
+    bool ok = true;
+    for (const auto& task : tasks) {
+        if (!functions.count(task) && !model_only_tasks.count(task)) {
+            printf("  DRIFT: %s in the core1 model has no function in sram.c\n", task.c_str());
+            ok = false;
+        }
+    }
+
+    const std::regex scratch_re(R"re(__scratch_x\("(\w+)"\))re");
+    for (auto it = std::sregex_iterator(firmware.begin(), firmware.end(), scratch_re); it != std::sregex_iterator(); ++it) {
+        if (!tasks.count((*it)[1])) {
+            printf("  DRIFT: %s in sram.c has no Task in the core1 model\n", std::string((*it)[1]).c_str());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+struct Options {
+    std::string pio_file = SRAM_PIO_FILE;
+    uint32_t min_period = 2;
+    uint32_t max_period = 16;
+    uint32_t step = 2;
+    uint32_t trials = 64;
+    uint32_t cs_high = 200;
+    uint32_t max_len = 24;
+    uint32_t seed = 1;
+    double sys_mhz = 125.0;
+    bool cs_high_sweep = false;
+    uint32_t sweep_period = 8;
+    bool check = false;
+    bool verbose = false;
+    std::string capture_file;
+};
+
+void usage(const char* argv0) {
+    printf("Usage: %s [options]\n"
+           "  --pio FILE          PIO source to simulate (default %s)\n"
+           "  --min-period N      Fastest SCK period to try, in SYS clocks (default 2)\n"
+           "  --max-period N      Slowest SCK period to try, in SYS clocks (default 16)\n"
+           "  --step N            SCK period step (default 2, as the PIO SPI master can only do even periods)\n"
+           "  --trials N          Transactions per command, alignment and period (default 64)\n"
+           "  --cs-high N         SYS clocks CS is held high between transactions (default 200)\n"
+           "  --max-len N         Maximum data bytes per transaction (default 24)\n"
+           "  --seed N            Random seed (default 1)\n"
+           "  --sys-mhz F         SYS clock for the MHz column of the report (default 125)\n"
+           "  --cs-high-sweep     Report the minimum CS high time between transactions for each command,\n"
+           "                      up to --cs-high, instead of the maximum SCK\n"
+           "  --period N          SCK period for --cs-high-sweep, in SYS clocks (default 8)\n"
+           "  --check             Exit with failure if any command is slower than the published limits\n"
+           "  --verbose           Report each failing transaction\n"
+           "  --capture FILE      Write the pins during --trials Mixed transactions at --period to FILE, as\n"
+           "                      the logic analyser in logic.c captures them, for spi-trace\n",
+           argv0, SRAM_PIO_FILE);
+}
+
+bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + a);
+            return argv[++i];
+        };
+        if (a == "--pio") opt.pio_file = next();
+        else if (a == "--min-period") opt.min_period = atoi(next());
+        else if (a == "--max-period") opt.max_period = atoi(next());
+        else if (a == "--step") opt.step = atoi(next());
+        else if (a == "--trials") opt.trials = atoi(next());
+        else if (a == "--cs-high") opt.cs_high = atoi(next());
+        else if (a == "--max-len") opt.max_len = atoi(next());
+        else if (a == "--seed") opt.seed = atoi(next());
+        else if (a == "--sys-mhz") opt.sys_mhz = atof(next());
+        else if (a == "--cs-high-sweep") opt.cs_high_sweep = true;
+        else if (a == "--period") opt.sweep_period = atoi(next());
+        else if (a == "--check") opt.check = true;
+        else if (a == "--verbose") opt.verbose = true;
+        else if (a == "--capture") opt.capture_file = next();
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (opt.step == 0 || opt.min_period < 2 || opt.max_period < opt.min_period || opt.sweep_period < 2) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+const char* command_name(Mode mode, Command c) {
+    for (const auto& info : commands) {
+        if (info.mode == mode && info.command == c) return info.name;
+    }
+    return "?";
+}
+
+// The expected state of the emulator
+struct Shadow {
+    std::vector<uint8_t> ram;
+    // Core1 records WRITEs after CS goes high, so these are only checked at
+    // the end of a run.
+    std::vector<uint32_t> sector_writes;
+    std::vector<Core1Model::WriteEvent> write_events;
+    std::vector<Core1Model::Doorbell> doorbells;
+    // The snapshot generation count and the range of the last WRITE, as offsets in the RAM
+    uint32_t snapshot_gen = 0, snapshot_start = 0, snapshot_end = 0;
+    // Transactions and data bytes of each command, indexed by SIM_SRAM_STATS_*
+    uint32_t count[SIM_SRAM_STATS_NUM_COMMANDS] = {};
+    uint32_t bytes[SIM_SRAM_STATS_NUM_COMMANDS] = {};
+    // The block reads and writes wrap within, 0 if they don't wrap
+    uint32_t wrap = 0;
+    // The portable command set in sram_protocol.c, run on the same bytes with
+    // its own copy of the RAM, in the modes it covers
+    std::vector<uint8_t> protocol_ram;
+    sim_sram_protocol_t protocol = {};
+};
+
+// The statistics a transaction is counted under
+uint32_t stats_command(Mode mode, Command cmd) {
+    switch (cmd) {
+    case Command::Read: return SIM_SRAM_STATS_READ;
+    case Command::FastRead: return SIM_SRAM_STATS_FAST_READ;
+    case Command::Write: return mode == Mode::Flash ? SIM_SRAM_STATS_OTHER : SIM_SRAM_STATS_WRITE;
+    case Command::ContinuousRead: return SIM_SRAM_STATS_CONT_READ;
+    default: return SIM_SRAM_STATS_UNKNOWN;
+    }
+}
+
+// Check the statistics counted match the transactions run.  The DMA
+// transfers exactly the bytes written, but can prefetch more for reads.
+bool stats_match(const SramSim& sim, const Shadow& shadow) {
+    for (uint32_t c = 0; c < SIM_SRAM_STATS_NUM_COMMANDS; ++c) {
+        const sim_sram_command_stats_t& s = sim.stats(c);
+        uint32_t histogram = 0;
+        for (uint32_t b = 0; b < SIM_SRAM_STATS_BUCKETS; ++b) histogram += s.cs_low[b];
+        if (s.count != shadow.count[c] || histogram != s.count) return false;
+        if (c == SIM_SRAM_STATS_WRITE ? s.bytes != shadow.bytes[c] : s.bytes < shadow.bytes[c]) return false;
+    }
+    return true;
+}
+
+// The CRC32 used by zlib
+uint32_t crc32(const uint8_t* data, uint32_t len) {
+    uint32_t crc = 0xffffffff;
+    for (uint32_t i = 0; i < len; ++i) {
+        crc ^= data[i];
+        for (int b = 0; b < 8; ++b) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+    }
+    return ~crc;
+}
+
+// Start a CRC, then poll the status until it is done and check the CRC
+// returned.  With the flash region, half the CRCs are of the flash, within
+// the part the simulator has.  Returns true if it passed.
+bool run_crc(SramSim& sim, Shadow& shadow, uint32_t alignment, uint32_t period, const Options& opt,
+             std::mt19937& rng) {
+    const bool flash = sim.flash_enabled() && rng() % 2;
+    const uint32_t len = 1 + rng() % 4096;
+    const uint32_t size = flash ? sim.flash_region_size() - len : sim.emu_ram_size();
+    const uint8_t* data = flash ? sim.flash_region() : shadow.ram.data();
+    const uint32_t addr = rng() % size;
+    std::vector<uint8_t> out = {(uint8_t)fw::crc_cmd};
+    if (sim.addr_bits() == 24) out.push_back((flash ? 0x80 : 0) | (addr >> 16));
+    out.insert(out.end(), {(uint8_t)(addr >> 8), (uint8_t)addr,
+                           (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len});
+    sim.transfer(out, period, opt.cs_high);
+    ++shadow.count[SIM_SRAM_STATS_OTHER];
+
+    // Read the status block from the alignment until it is not busy
+    const size_t status_offset = 1 + sim.addr_bits() / 8 + 1;
+    std::vector<uint8_t> in;
+    for (uint32_t poll = 0; poll < 64; ++poll) {
+        out = {(uint8_t)fw::crc_read_cmd};
+        if (sim.addr_bits() == 24) out.push_back(0);
+        out.insert(out.end(), {0, (uint8_t)alignment, 0});
+        out.resize(out.size() + 8 - alignment);
+        in = sim.transfer(out, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+        if (in[status_offset] == 0) break;
+    }
+
+    const uint32_t crc = crc32(&data[addr], flash ? len : std::min(len, size - addr));
+    const uint8_t expected[8] = {0, 0, 0, 0, (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8),
+                                 (uint8_t)crc};
+    const bool ok = memcmp(&in[status_offset], &expected[alignment], 8 - alignment) == 0;
+    if (!ok && opt.verbose) {
+        printf("  CRC %saddr %04x len %u at SYS/%u:\n    got     ", flash ? "flash " : "", addr, len, period);
+        for (uint32_t i = 0; i < 8 - alignment; ++i) printf("%02x ", in[status_offset + i]);
+        printf("\n    expected ");
+        for (uint32_t i = alignment; i < 8; ++i) printf("%02x ", expected[i]);
+        printf("\n");
+    }
+    return ok;
+}
+
+// Start a FILL or COPY to the alignment, then poll the status until it is
+// done and check the RAM.  Returns true if it passed.
+bool run_bulk(SramSim& sim, Shadow& shadow, uint32_t alignment, uint32_t period, const Options& opt,
+              std::mt19937& rng) {
+    const uint32_t size = sim.emu_ram_size();
+    const bool copy = rng() % 2;
+    uint32_t dst = ((rng() % size) & ~3u) | alignment;
+    uint32_t src = rng() % size;
+    uint32_t len = 1 + rng() % 4096;
+    // A COPY to higher addresses within the source isn't supported
+    if (copy && src < dst && src + len > dst) std::swap(src, dst);
+
+    std::vector<uint8_t> out = {(uint8_t)(copy ? fw::copy_cmd : fw::fill_cmd)};
+    const uint32_t addr = copy ? src : dst;
+    out.push_back(addr >> 8);
+    out.push_back(addr);
+    if (copy) {
+        out.push_back(dst >> 8);
+        out.push_back(dst);
+    }
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(len >> shift);
+    const uint8_t value = rng();
+    if (!copy) out.push_back(value);
+    sim.transfer(out, period, opt.cs_high);
+    ++shadow.count[SIM_SRAM_STATS_OTHER];
+
+    len = std::min(len, size - (copy ? std::max(src, dst) : dst));
+    if (copy) memmove(&shadow.ram[dst], &shadow.ram[src], len);
+    else memset(&shadow.ram[dst], value, len);
+    shadow.write_events.push_back({dst, len, (uint32_t)shadow.write_events.size()});
+
+    // Read the status block from the alignment until it is not busy
+    std::vector<uint8_t> in;
+    for (uint32_t poll = 0; poll < 64; ++poll) {
+        std::vector<uint8_t> status = {(uint8_t)fw::bulk_status_cmd, 0, (uint8_t)alignment, 0};
+        status.resize(status.size() + 8 - alignment);
+        in = sim.transfer(status, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+        if (in[4] == 0) break;
+    }
+
+    bool ok = std::all_of(in.begin() + 4, in.end(), [](uint8_t b) { return b == 0; });
+    if (!ok && opt.verbose) {
+        printf("  %s %04x len %u at SYS/%u: still busy\n", copy ? "COPY" : "FILL", dst, len, period);
+    }
+    if (memcmp(sim.emu_ram(), shadow.ram.data(), size) != 0) {
+        if (opt.verbose) {
+            printf("  %s %04x len %u at SYS/%u: emu_ram differs from expected\n", copy ? "COPY" : "FILL", dst, len,
+                   period);
+        }
+        memcpy(shadow.ram.data(), sim.emu_ram(), size);
+        ok = false;
+    }
+    return ok;
+}
+
+// Set the mode register to a random mode with WRMR, then check RDMR returns
+// it.  Returns true if it passed.
+bool run_mode_register(SramSim& sim, Shadow& shadow, uint32_t period, const Options& opt, std::mt19937& rng) {
+    static const uint8_t modes[] = {SIM_SRAM_MODE_BYTE, SIM_SRAM_MODE_PAGE, SIM_SRAM_MODE_SEQUENTIAL};
+    const uint8_t mode = modes[rng() % 3];
+    sim.transfer({(uint8_t)fw::wrmr_cmd, mode}, period, opt.cs_high);
+    // How soon core1 sees the RDMR depends on where in its poll of the FIFO
+    // the command arrives, so vary the CS high time over a poll
+    std::vector<uint8_t> in = sim.transfer({(uint8_t)fw::rdmr_cmd, 0}, period, opt.cs_high + rng() % 8);
+    shadow.count[SIM_SRAM_STATS_OTHER] += 2;
+    // Byte mode is ignored
+    const uint8_t expected = mode != SIM_SRAM_MODE_BYTE ? mode : shadow.wrap ? SIM_SRAM_MODE_PAGE : SIM_SRAM_MODE_SEQUENTIAL;
+    shadow.wrap = expected == SIM_SRAM_MODE_SEQUENTIAL ? 0 : fw::page_size;
+
+    const bool ok = in[1] == expected;
+    if (!ok && opt.verbose) printf("  RDMR at SYS/%u: got %02x expected %02x\n", period, in[1], expected);
+    return ok;
+}
+
+// Read ID with don't care address bytes, whose bottom 2 bits are the
+// alignment, and check the whole ID is returned.  Returns true if it passed.
+bool run_read_id(SramSim& sim, Shadow& shadow, uint32_t alignment, uint32_t period, const Options& opt,
+                 std::mt19937& rng) {
+    std::vector<uint8_t> out = {(uint8_t)fw::read_id_cmd, (uint8_t)rng(), (uint8_t)rng(),
+                                (uint8_t)((rng() & ~3u) | alignment)};
+    out.resize(out.size() + sizeof(fw::psram_id));
+    std::vector<uint8_t> in = sim.transfer(out, period, opt.cs_high);
+    ++shadow.count[SIM_SRAM_STATS_OTHER];
+
+    const bool ok = memcmp(&in[4], fw::psram_id, sizeof(fw::psram_id)) == 0;
+    if (!ok && opt.verbose) {
+        printf("  READ ID at SYS/%u:\n    got     ", period);
+        for (uint32_t i = 4; i < in.size(); ++i) printf("%02x ", in[i]);
+        printf("\n    expected ");
+        for (uint32_t i = 0; i < sizeof(fw::psram_id); ++i) printf("%02x ", fw::psram_id[i]);
+        printf("\n");
+    }
+    return ok;
+}
+
+// Switch the PSRAM wrap boundary with a wrap boundary toggle or reset.
+void set_psram_wrap(SramSim& sim, Shadow& shadow, uint32_t cmd, uint32_t period, const Options& opt) {
+    sim.transfer({(uint8_t)cmd}, period, opt.cs_high);
+    ++shadow.count[SIM_SRAM_STATS_OTHER];
+    shadow.wrap = cmd == fw::wrap_toggle_cmd && shadow.wrap != 32 ? 32 : 1024;
+}
+
+// Run one transaction and check the result.  Returns true if it passed.
+bool run_transaction(SramSim& sim, Shadow& shadow, Mode mode, Command cmd, uint32_t alignment,
+                     uint32_t period, const Options& opt, std::mt19937& rng) {
+    const bool flash = mode == Mode::Flash;
+    // The device selected, and the offset of its RAM
+    const uint32_t device = sim.num_devices() > 1 ? rng() % sim.num_devices() : 0;
+    const uint32_t base = device * sim.device_ram_size();
+    uint8_t* ram = flash ? sim.flash_region() : sim.emu_ram() + base;
+    const uint32_t size = flash ? sim.flash_region_size() : sim.device_ram_size();
+    // Long enough to wrap within a small block, and often near the end of a large one
+    const uint32_t max_len = shadow.wrap ? std::max(opt.max_len, 64u) : opt.max_len;
+    const uint32_t len = 1 + rng() % max_len;
+    uint32_t addr = ((rng() % (size - max_len - 4)) & ~3u) | alignment;
+    if (shadow.wrap > max_len && rng() % 2) addr = (((addr | (shadow.wrap - 1)) - rng() % max_len) & ~3u) | alignment;
+    // End in the doorbell or status window
+    if (sim.doorbell_enabled() && rng() % 2) {
+        const uint32_t last = fw::doorbell_addr + rng() % (fw::doorbell_size + fw::status_size);
+        addr = ((last - (len - 1)) & ~3u) | alignment;
+    }
+    // Often run a sequential transaction past the end of the RAM, where a
+    // WRITE's data beyond the end is discarded, and a READ returns whatever
+    // follows the RAM
+    const bool past_end = !flash && !shadow.wrap && !sim.doorbell_enabled() && rng() % 8 == 0;
+    if (past_end) addr = ((size - 1 - rng() % len) & ~3u) | alignment;
+    const uint32_t in_ram = past_end ? std::min(len, size - addr) : len;
+    const uint32_t written = cmd == Command::Write ? in_ram : len;
+
+    std::vector<uint8_t> out = {0};
+    if (flash) {
+        sim.soc().xip_flush();
+        out.push_back(0x80 | (addr >> 16));
+    }
+    else if (sim.addr_bits() == 24) {
+        // Cross the 64kB boundary often, with the ignored top address bits set.
+        // The top bit selects the flash region if it is enabled.
+        if (rng() % 4 == 0 && !past_end) addr = 0xfff0 | alignment;
+        out.push_back((sim.flash_enabled() ? 0x7e : 0xfe) | (addr >> 16));
+    }
+    out.push_back(addr >> 8);
+    out.push_back(addr);
+    size_t data_offset = out.size();
+    switch (cmd) {
+    case Command::Read:
+        out[0] = SIM_SRAM_READ_CMD;
+        // In SDI and SQI modes READ has the same dummy byte as FAST READ
+        if (!is_spi(mode)) out.push_back(0);
+        data_offset = out.size();
+        out.resize(data_offset + len);
+        break;
+    case Command::FastRead:
+        out[0] = SIM_SRAM_FAST_READ_CMD;
+        out.push_back(0);
+        data_offset = out.size();
+        out.resize(data_offset + len);
+        break;
+    case Command::Write:
+        out[0] = SIM_SRAM_WRITE_CMD;
+        for (uint32_t i = 0; i < len; ++i) out.push_back(rng());
+        break;
+    case Command::ContinuousRead:
+        // A FAST READ without the command, staying in continuous read mode
+        out.erase(out.begin());
+        out.push_back(fw::continuous_read_mode);
+        data_offset = out.size();
+        out.resize(data_offset + len);
+        break;
+    default:
+        return false;
+    }
+
+    const bool write = cmd == Command::Write;
+    const uint32_t stats = stats_command(mode, cmd);
+    ++shadow.count[stats];
+    if (stats != SIM_SRAM_STATS_OTHER) shadow.bytes[stats] += written;
+
+    // While the generation count is even the range written holds either the
+    // old data or the new, as read_simulated_sram_snapshot() relies on
+    bool torn = false;
+    if (write && sim.snapshot_enabled()) {
+        std::vector<uint8_t> before(written), after(written);
+        for (uint32_t i = 0; i < written; ++i) {
+            before[i] = ram[data_addr(shadow.wrap, addr, i)];
+            after[i] = out[data_offset + i];
+        }
+        // The count before this WRITE starts, the last WRITE may not have finished
+        const uint32_t gen = (sim.snapshot().gen + 1) & ~1u;
+        sim.on_step = [&sim, &shadow, &torn, ram, addr, before, after, gen] {
+            const uint32_t g = sim.snapshot().gen;
+            if (g & 1) return;
+            const std::vector<uint8_t>& expected = g == gen ? before : after;
+            for (size_t i = 0; i < expected.size(); ++i) {
+                if (ram[data_addr(shadow.wrap, addr, i)] != expected[i]) torn = true;
+            }
+        };
+    }
+
+    // What follows the RAM, which a WRITE past the end must not change
+    uint8_t* const after_ram = sim.emu_ram_base() < SRAM_NON_STRIPED_BASE ? sim.emu_ram() + sim.emu_ram_size() : nullptr;
+    std::vector<uint8_t> after_before;
+    if (write && past_end && after_ram) after_before.assign(after_ram, after_ram + 16);
+
+    std::vector<uint8_t> in;
+    if (is_spi(mode)) in = sim.transfer(out, period, opt.cs_high, device);
+    else in = sim.transfer_wide(out, write ? out.size() : 3, mode_width(mode), period, opt.cs_high);
+    sim.on_step = nullptr;
+
+    std::vector<uint8_t> protocol_in;
+    if (!shadow.protocol_ram.empty()) {
+        protocol_in.resize(out.size());
+        sim_sram_protocol_transfer(&shadow.protocol, out.data(), protocol_in.data(), out.size());
+    }
+
+    bool ok = true;
+    bool protocol_ok = true;
+    if (write) {
+        // Writes to the flash region are ignored
+        if (!flash) {
+            for (uint32_t i = 0; i < written; ++i) shadow.ram[base + data_addr(shadow.wrap, addr, i)] = out[data_offset + i];
+        }
+        if (past_end && after_ram && !std::equal(after_before.begin(), after_before.end(), after_ram)) {
+            if (opt.verbose) {
+                printf("  %s addr %04x len %u at SYS/%u: wrote past the end of the RAM\n", command_name(mode, cmd), addr,
+                       len, period);
+            }
+            ok = false;
+        }
+        if (!protocol_in.empty()) protocol_ok = shadow.protocol_ram == shadow.ram;
+        const bool ram_ok = memcmp(sim.emu_ram(), shadow.ram.data(), shadow.ram.size()) == 0;
+        if (!ram_ok && opt.verbose) {
+            printf("  %s addr %04x len %u at SYS/%u: emu_ram differs from expected\n", command_name(mode, cmd), addr, len,
+                   period);
+        }
+        // Resynchronise so later failures are reported independently
+        if (!ram_ok) {
+            memcpy(shadow.ram.data(), sim.emu_ram(), shadow.ram.size());
+            ok = false;
+        }
+        if (!protocol_in.empty()) shadow.protocol_ram = shadow.ram;
+        if (torn) {
+            if (opt.verbose) {
+                printf("  %s addr %04x len %u at SYS/%u: WRITE seen part way through with an even generation\n",
+                       command_name(mode, cmd), addr, len, period);
+            }
+            ok = false;
+        }
+        if (sim.snapshot_enabled() && !flash) {
+            shadow.snapshot_gen += 2;
+            shadow.snapshot_start = base + addr;
+            shadow.snapshot_end = base + addr + written;
+        }
+
+        if (sim.persist_enabled()) {
+            for (uint32_t s = addr / 4096; s <= (addr + written - 1) / 4096; ++s) ++shadow.sector_writes[s];
+        }
+        if (sim.write_events_enabled() && !flash) {
+            // A WRITE that wraps is recorded as the whole block it wraps within
+            if (shadow.wrap && len > shadow.wrap - addr % shadow.wrap) {
+                shadow.write_events.push_back({addr & ~(shadow.wrap - 1), shadow.wrap,
+                                               (uint32_t)shadow.write_events.size()});
+            }
+            else {
+                shadow.write_events.push_back({base + addr, written, (uint32_t)shadow.write_events.size()});
+            }
+        }
+        const uint32_t last = data_addr(shadow.wrap, addr, written - 1);
+        if (sim.doorbell_enabled() && last - fw::doorbell_addr < fw::doorbell_size) {
+            uint32_t value;
+            memcpy(&value, &shadow.ram[base + (last & ~3u)], 4);
+            shadow.doorbells.push_back({base + (last & ~3u), value, (uint32_t)shadow.doorbells.size()});
+        }
+    }
+    else {
+        // The data past the end of the RAM is whatever follows it, so only
+        // sram_protocol.c's idle bytes are checked there
+        for (uint32_t i = 0; i < in_ram; ++i) {
+            if (in[data_offset + i] != ram[data_addr(shadow.wrap, addr, i)]) ok = false;
+        }
+        if (!ok && opt.verbose) {
+            printf("  %s addr %04x len %u at SYS/%u:\n    got     ", command_name(mode, cmd), addr, len, period);
+            for (uint32_t i = 0; i < in_ram; ++i) printf("%02x ", in[data_offset + i]);
+            printf("\n    expected ");
+            for (uint32_t i = 0; i < in_ram; ++i) printf("%02x ", ram[data_addr(shadow.wrap, addr, i)]);
+            printf("\n");
+        }
+        if (!protocol_in.empty()) {
+            protocol_ok = memcmp(&protocol_in[data_offset], &shadow.ram[base + addr], in_ram) == 0;
+            for (uint32_t i = in_ram; i < len; ++i) {
+                if (protocol_in[data_offset + i] != SIM_SRAM_PROTOCOL_IDLE_BYTE) protocol_ok = false;
+            }
+        }
+    }
+
+    // This is a difference in behaviour rather than timing, so always reported
+    if (!protocol_ok) {
+        printf("  %s addr %04x len %u: sram_protocol.c differs from the emulator\n", command_name(mode, cmd), addr,
+               len);
+        ok = false;
+    }
+    return ok;
+}
+
+// Start a READ, FAST READ or WRITE and raise CS before the address, or
+// during the dummy byte of the FAST READ, then run a Mixed transaction with
+// the default CS high time to check the emulator recovered.  With the PSRAM
+// personality the wrap boundary toggle and reset are also cut short, and in
+// page mode a WRMR in its mode byte, neither of which may change the mode.
+// In SDI and SQI mode the READ also has a dummy byte, and with several devices
+// each abort selects one at random.  --cs-high-sweep measures how soon after
+// the abort the next transaction can start.  Returns true if it passed.
+bool run_abort(SramSim& sim, Shadow& shadow, Mode mode, uint32_t alignment, uint32_t period, const Options& opt,
+               std::mt19937& rng) {
+    std::vector<uint8_t> cmds = {SIM_SRAM_READ_CMD, SIM_SRAM_FAST_READ_CMD, SIM_SRAM_WRITE_CMD};
+    if (mode == Mode::Psram) {
+        cmds.push_back(fw::wrap_toggle_cmd);
+        cmds.push_back(fw::reset_cmd);
+    }
+    if (mode == Mode::Page) cmds.push_back(fw::wrmr_cmd);
+    const uint8_t cmd = cmds[rng() % cmds.size()];
+    std::vector<uint8_t> out = {cmd};
+    if (cmd == fw::wrmr_cmd) out.push_back(rng());
+    else if (cmd != fw::wrap_toggle_cmd && cmd != fw::reset_cmd) {
+        for (uint32_t i = 0; i < sim.addr_bits() / 8; ++i) out.push_back(rng());
+    }
+    const size_t addr_bits = (1 + sim.addr_bits() / 8) * 8;
+    const bool wide = !is_spi(mode);
+    if (cmd == SIM_SRAM_FAST_READ_CMD || (wide && cmd == SIM_SRAM_READ_CMD)) out.push_back(0);
+
+    // Bits sent before CS goes high, a whole number of clocks
+    const uint32_t width = mode_width(mode);
+    const size_t bits = rng() % (out.size() * 8 / width) * width;
+    if (wide) sim.abort_wide(out, bits / width, width, period, opt.cs_high);
+    else sim.abort(out, bits, period, opt.cs_high, mode == Mode::Multi ? rng() % sim.num_devices() : 0);
+
+    // Only a FAST READ, or in SDI and SQI mode a READ, with its address is
+    // counted, the rest are aborted
+    uint32_t stats = SIM_SRAM_STATS_ABORTED;
+    if (bits >= addr_bits && cmd == SIM_SRAM_FAST_READ_CMD) stats = SIM_SRAM_STATS_FAST_READ;
+    if (bits >= addr_bits && cmd == SIM_SRAM_READ_CMD) stats = SIM_SRAM_STATS_READ;
+    ++shadow.count[stats];
+    if (!shadow.protocol_ram.empty()) {
+        sim_sram_protocol_begin(&shadow.protocol);
+        sim_sram_protocol_exchange(&shadow.protocol, out.data(), nullptr, bits / 8);
+        sim_sram_protocol_end(&shadow.protocol);
+    }
+
+    bool ok = memcmp(sim.emu_ram(), shadow.ram.data(), shadow.ram.size()) == 0;
+    if (!ok) memcpy(shadow.ram.data(), sim.emu_ram(), shadow.ram.size());
+    Options settled = opt;
+    settled.cs_high = Options().cs_high;
+    if (!run_transaction(sim, shadow, mode, (Command)(rng() % 3), alignment, period, settled, rng)) ok = false;
+    if (!ok && opt.verbose) printf("  After %02x aborted after %zu bits at SYS/%u\n", cmd, bits, period);
+    return ok;
+}
+
+// Check whether a command works at a given SCK period.  Each call uses a
+// fresh emulator so that failures don't carry over between periods.
+bool passes(const std::vector<PioProgram>& programs, Mode mode, Command cmd, uint32_t alignment, uint32_t period,
+            const Options& opt) {
+    std::mt19937 rng(opt.seed + period * 16 + alignment);
+    FirmwareConfig cfg;
+    if (mode == Mode::Spi24) cfg = FirmwareConfig::addr_24();
+    else if (mode == Mode::Flash) cfg = FirmwareConfig::flash();
+    else if (mode == Mode::Record) cfg = FirmwareConfig::record_writes();
+    else if (mode == Mode::Crc) cfg = FirmwareConfig::crc();
+    else if (mode == Mode::Bulk) cfg = FirmwareConfig::bulk();
+    else if (mode == Mode::Page) cfg = FirmwareConfig::mode_register();
+    else if (mode == Mode::Psram) cfg = FirmwareConfig::psram();
+    else if (mode == Mode::Multi) cfg = FirmwareConfig::multi_device();
+    else if (mode == Mode::Doorbell) cfg = FirmwareConfig::doorbell();
+    else if (mode == Mode::Snapshot) cfg = FirmwareConfig::snapshot();
+    else if (mode == Mode::Banks) cfg = FirmwareConfig::non_striped_banks(16);
+    else if (mode == Mode::Banks24) cfg = FirmwareConfig::non_striped_banks(24);
+    else if (!is_spi(mode)) cfg = FirmwareConfig::multi_io();
+    if (cmd == Command::ContinuousRead) {
+        // Also check the statistics are counted in continuous read mode
+        cfg.enable_continuous_read = true;
+        cfg.enable_stats = true;
+    }
+    // Check the aborted transactions are counted
+    if (cmd == Command::Abort) cfg.enable_stats = true;
+    if (cmd == Command::Crc) cfg.enable_crc = true;
+    SramSim sim(programs, cfg);
+    uint8_t* ram = sim.emu_ram();
+    for (uint32_t i = 0; i < sim.emu_ram_size(); ++i) ram[i] = rng();
+    if (mode == Mode::Flash) {
+        for (uint32_t i = 0; i < sim.flash_region_size(); ++i) sim.flash_region()[i] = rng();
+    }
+    Shadow shadow{std::vector<uint8_t>(ram, ram + sim.emu_ram_size()), sim.sector_writes(), {}};
+    // The PSRAM wraps within 1kB from power up
+    if (mode == Mode::Psram) shadow.wrap = 1024;
+    if ((mode == Mode::Spi || mode == Mode::Spi24 || mode == Mode::Banks || mode == Mode::Banks24) &&
+        cmd != Command::ContinuousRead) {
+        shadow.protocol_ram = shadow.ram;
+        sim_sram_protocol_init(&shadow.protocol, shadow.protocol_ram.data(), sim.emu_ram_size(), sim.addr_bits());
+    }
+
+    // EDIO or EQIO
+    if (!is_spi(mode)) {
+        sim.transfer({(uint8_t)(mode == Mode::Sdi ? 0x3B : 0x38)}, MODE_SWITCH_PERIOD, MODE_SWITCH_CS_HIGH);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+    }
+
+    // A FAST READ with the mode byte in place of the dummy byte
+    if (cmd == Command::ContinuousRead) {
+        sim.transfer({SIM_SRAM_FAST_READ_CMD, 0, 0, fw::continuous_read_mode, 0}, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_FAST_READ];
+    }
+
+    // Enter page mode
+    if (mode == Mode::Page && cmd != Command::ModeRegister) {
+        sim.transfer({(uint8_t)fw::wrmr_cmd, (uint8_t)fw::mode_page}, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+        shadow.wrap = fw::page_size;
+    }
+
+    // CRC the whole RAM while the Mixed commands run
+    if (mode == Mode::Crc && cmd == Command::Mixed) {
+        sim.transfer({(uint8_t)fw::crc_cmd, 0, 0, 0, 1, 0, 0}, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+    }
+
+    bool ok = true;
+    for (uint32_t t = 0; t < opt.trials; ++t) {
+        Command c = cmd;
+        Mode m = mode;
+        if (c == Command::Mixed) {
+            c = (Command)(rng() % 3);
+            // Mix RAM commands with FAST READs and WRITEs of the flash region
+            if (mode == Mode::Flash && (c == Command::Read || rng() % 2)) m = Mode::Spi24;
+            // Mix PSRAM commands with read IDs, wrap boundary toggles and resets
+            if (mode == Mode::Psram && rng() % 4 == 0) {
+                const uint32_t r = rng() % 4;
+                if (r == 0) c = Command::ReadId;
+                else set_psram_wrap(sim, shadow, r == 1 ? fw::reset_cmd : fw::wrap_toggle_cmd, period, opt);
+            }
+            // Core0 publishes a status word, as set_simulated_sram_status() does
+            if (mode == Mode::Doorbell && rng() % 4 == 0) {
+                const uint32_t offset = fw::status_addr + (rng() % fw::status_size & ~3u);
+                const uint32_t value = rng();
+                memcpy(sim.emu_ram() + offset, &value, 4);
+                memcpy(&shadow.ram[offset], &value, 4);
+            }
+        }
+        bool passed;
+        if (c == Command::Crc) passed = run_crc(sim, shadow, alignment, period, opt, rng);
+        else if (c == Command::Bulk) passed = run_bulk(sim, shadow, alignment, period, opt, rng);
+        else if (c == Command::ModeRegister) passed = run_mode_register(sim, shadow, period, opt, rng);
+        else if (c == Command::ReadId) passed = run_read_id(sim, shadow, alignment, period, opt, rng);
+        else if (c == Command::Abort) passed = run_abort(sim, shadow, m, alignment, period, opt, rng);
+        else passed = run_transaction(sim, shadow, m, c, alignment, period, opt, rng);
+        if (!passed) {
+            ok = false;
+            if (!opt.verbose) break;
+        }
+    }
+
+    if (cmd == Command::ContinuousRead && ok) {
+        // Leave continuous read mode with a mode byte of 0xFF, then check commands work again
+        sim.transfer({0xFF, 0xFF, 0xFF}, period, opt.cs_high);
+        ++shadow.count[SIM_SRAM_STATS_CONT_READ];
+        if (!run_transaction(sim, shadow, Mode::Spi, Command::FastRead, alignment, period, opt, rng)) {
+            if (opt.verbose) printf("  Continuous read mode not left\n");
+            ok = false;
+        }
+    }
+
+    if (!is_spi(mode) && ok) {
+        // RSTIO, then check SPI mode is back
+        sim.transfer_wide({0xFF}, 1, mode_width(mode), period, MODE_SWITCH_CS_HIGH);
+        ++shadow.count[SIM_SRAM_STATS_OTHER];
+        Options slow = opt;
+        slow.max_len = 4;
+        if (!run_transaction(sim, shadow, Mode::Spi, Command::FastRead, alignment, MODE_SWITCH_PERIOD, slow, rng)) {
+            if (opt.verbose) printf("  SPI mode not restored by RSTIO\n");
+            ok = false;
+        }
+    }
+
+    if (sim.persist_enabled() || sim.write_events_enabled() || sim.stats_enabled()) {
+        // Long enough for core1 to finish with the last WRITE
+        sim.idle(1000);
+        if (sim.sector_writes() != shadow.sector_writes) {
+            if (opt.verbose) printf("  %s at SYS/%u: wrong sectors recorded\n", command_name(mode, cmd), period);
+            ok = false;
+        }
+        if (sim.write_events() != shadow.write_events) {
+            if (opt.verbose) printf("  %s at SYS/%u: wrong write events\n", command_name(mode, cmd), period);
+            ok = false;
+        }
+        if (sim.doorbells() != shadow.doorbells) {
+            if (opt.verbose) printf("  %s at SYS/%u: wrong doorbells\n", command_name(mode, cmd), period);
+            ok = false;
+        }
+        if (sim.snapshot_enabled()) {
+            const Core1Model::Snapshot& s = sim.snapshot();
+            if (s.gen != shadow.snapshot_gen || s.last_start != sim.emu_ram_base() + shadow.snapshot_start ||
+                s.last_end != sim.emu_ram_base() + shadow.snapshot_end) {
+                if (opt.verbose) printf("  %s at SYS/%u: wrong snapshot state\n", command_name(mode, cmd), period);
+                ok = false;
+            }
+        }
+        if (sim.stats_enabled() && !stats_match(sim, shadow)) {
+            if (opt.verbose) printf("  %s at SYS/%u: wrong statistics\n", command_name(mode, cmd), period);
+            ok = false;
+        }
+    }
+
+    if (sim.contention()) {
+        if (opt.verbose) {
+            printf("  %s at SYS/%u: %u cycles of bus contention\n", command_name(mode, cmd), period, sim.contention());
+        }
+        ok = false;
+    }
+    return ok;
+}
+
+// Sweep from the slowest period down, as the divider sweep in main.cpp does.
+// Returns the fastest passing period, or 0 if none passed.
+uint32_t find_min_period(const std::vector<PioProgram>& programs, Mode mode, Command cmd, uint32_t alignment,
+                         const Options& opt) {
+    uint32_t best = 0;
+    for (uint32_t period = opt.max_period; period >= opt.min_period; period -= opt.step) {
+        if (!passes(programs, mode, cmd, alignment, period, opt)) break;
+        best = period;
+        if (period < opt.min_period + opt.step) break;
+    }
+    return best;
+}
+
+// The options for a command, slowed down if it can't run at full speed.
+Options command_options(const CommandInfo& info, const Options& opt) {
+    Options o = opt;
+    o.max_period = std::max(o.max_period, info.slowest);
+    o.sweep_period = std::max(o.sweep_period, info.slowest);
+    return o;
+}
+
+std::string format_limit(uint32_t period) {
+    return period ? "SYS/" + std::to_string(period) : "FAIL";
+}
+
+// Binary search for the shortest CS high time that passes, assuming that
+// anything longer than a passing time also passes.  Returns 0 if the
+// command fails even with opt.cs_high.
+uint32_t find_min_cs_high(const std::vector<PioProgram>& programs, Mode mode, Command cmd, uint32_t alignment,
+                          const Options& opt) {
+    Options o = opt;
+    if (!passes(programs, mode, cmd, alignment, opt.sweep_period, o)) return 0;
+    uint32_t fail = 0, pass = opt.cs_high;
+    while (pass - fail > 1) {
+        o.cs_high = (fail + pass) / 2;
+        if (passes(programs, mode, cmd, alignment, opt.sweep_period, o)) pass = o.cs_high;
+        else fail = o.cs_high;
+    }
+    return pass;
+}
+
+// The master lowers CS a period before the first SCK cycle, so the first rising edge
+// is this long after CS falls.
+uint32_t cs_setup(uint32_t period) {
+    return period + period / 2;
+}
+
+int cs_high_sweep(const std::vector<PioProgram>& programs, const Options& opt) {
+    printf("Min CS high between transactions at SYS/%u, in SYS clocks (addr %% 4).\n", opt.sweep_period);
+    printf("The first SCK rising edge is %u SYS clocks after CS falls, the Gap column is CS rising to that edge:\n\n",
+           cs_setup(opt.sweep_period));
+    printf("| Command         | 0    | 1    | 2    | 3    | Gap  | Gap at %3.0fMHz |\n", opt.sys_mhz);
+    printf("| --------------- | ---- | ---- | ---- | ---- | ---- | ------------- |\n");
+
+    bool ok = true;
+    std::string slowed;
+    for (const auto& info : commands) {
+        const Options o = command_options(info, opt);
+        const uint32_t setup = cs_setup(o.sweep_period);
+        if (o.sweep_period != opt.sweep_period) {
+            slowed += std::string("\n") + info.name + " is run at SYS/" + std::to_string(o.sweep_period) + ".";
+        }
+        uint32_t worst = 0;
+        bool failed = false;
+        printf("| %-15s |", info.name);
+        for (uint32_t alignment = 0; alignment < 4; ++alignment) {
+            uint32_t cs_high = find_min_cs_high(programs, info.mode, info.command, alignment, o);
+            if (cs_high) printf(" %-4u |", cs_high);
+            else printf(" FAIL |");
+            fflush(stdout);
+            if (cs_high == 0) failed = true;
+            else worst = std::max(worst, cs_high);
+        }
+        if (failed) {
+            printf(" -    | -             |\n");
+            ok = false;
+        }
+        else {
+            char ns[16];
+            snprintf(ns, sizeof(ns), "%.0f ns", (worst + setup) * 1000.0 / opt.sys_mhz);
+            printf(" %-4u | %-13s |\n", worst + setup, ns);
+        }
+    }
+    if (!slowed.empty()) printf("%s\n", slowed.c_str());
+    return ok ? 0 : 1;
+}
+
+// Capture the pins from MOSI, as main.cpp sets up the logic analyser, during
+// Mixed transactions with the default configuration.
+int write_capture(const std::vector<PioProgram>& programs, const Options& opt) {
+    std::mt19937 rng(opt.seed);
+    SramSim sim(programs, FirmwareConfig());
+    uint8_t* ram = sim.emu_ram();
+    for (uint32_t i = 0; i < sim.emu_ram_size(); ++i) ram[i] = rng();
+    Shadow shadow{std::vector<uint8_t>(ram, ram + sim.emu_ram_size()), sim.sector_writes(), {}};
+
+    sim.start_capture(fw::mosi);
+    bool ok = true;
+    for (uint32_t t = 0; t < opt.trials; ++t) {
+        const Command c = (Command)(rng() % 3);
+        if (!run_transaction(sim, shadow, Mode::Spi, c, rng() % 4, opt.sweep_period, opt, rng)) ok = false;
+    }
+    sim.idle(opt.cs_high);
+
+    FILE* f = fopen(opt.capture_file.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "can't write %s\n", opt.capture_file.c_str());
+        return 2;
+    }
+    for (uint32_t word : sim.capture()) {
+        const uint8_t bytes[4] = {(uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16), (uint8_t)(word >> 24)};
+        fwrite(bytes, 1, 4, f);
+    }
+    fclose(f);
+    printf("%u transactions at SYS/%u, %zu words written to %s%s\n", opt.trials, opt.sweep_period,
+           sim.capture().size(), opt.capture_file.c_str(), ok ? "" : ", some transactions FAILED");
+    return ok ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    std::vector<PioProgram> programs;
+    try {
+        if (!parse_options(argc, argv, opt)) return 2;
+        programs = pio_assemble_file(opt.pio_file);
+        // The _Static_assert in sram.c
+        if (fw::pio_write_offset + pio_find_program(programs, "sram_write").instructions.size() > 32) {
+            throw std::runtime_error("the write program doesn't fit at SIM_SRAM_pio_write_offset");
+        }
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    if (opt.cs_high_sweep) return cs_high_sweep(programs, opt);
+    if (!opt.capture_file.empty()) return write_capture(programs, opt);
+
+    printf("Max SCK by command and start address alignment (addr %% 4):\n\n");
+    printf("| Command         | 0        | 1        | 2        | 3        |\n");
+    printf("| --------------- | -------- | -------- | -------- | -------- |\n");
+
+    std::map<std::string, uint32_t> measured;
+    for (const auto& info : commands) {
+        uint32_t worst = 0;
+        bool failed = false;
+        printf("| %-15s |", info.name);
+        for (uint32_t alignment = 0; alignment < 4; ++alignment) {
+            uint32_t period = find_min_period(programs, info.mode, info.command, alignment, command_options(info, opt));
+            printf(" %-8s |", format_limit(period).c_str());
+            fflush(stdout);
+            if (period == 0) failed = true;
+            else worst = std::max(worst, period);
+        }
+        printf("\n");
+        measured[info.name] = failed ? 0 : worst;
+    }
+
+    printf("\n| Operation | Max speed | Max speed at %.0fMHz SYS clock |\n", opt.sys_mhz);
+    printf("| --------- | --------- | ----------------------------- |\n");
+    bool ok = !opt.check || check_model_matches_firmware();
+    for (const auto& [name, limit] : published_limits) {
+        uint32_t period = measured[name];
+        if (period) printf("| %s | SYS clock / %u | %.1f MHz |\n", name.c_str(), period, opt.sys_mhz / period);
+        else printf("| %s | FAIL | - |\n", name.c_str());
+
+        if (opt.check) {
+            if (period == 0 || period > limit) {
+                printf("  REGRESSION: %s needs SYS/%u, published limit is SYS/%u\n", name.c_str(), period, limit);
+                ok = false;
+            }
+            else if (period < limit) {
+                printf("  %s is faster than the published SYS/%u - update the README and published_limits\n",
+                       name.c_str(), limit);
+            }
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "soc.h"
+
+#include <cstring>
+
+uint32_t Soc::bus_read(uint32_t addr, uint32_t size) {
+    if (addr >= SRAM_BASE && addr + size <= SRAM_BASE + SRAM_SIZE) {
+        uint32_t data = 0;
+        memcpy(&data, &sram[addr - SRAM_BASE], size);
+        return data;
+    }
+    if (addr >= SRAM_NON_STRIPED_BASE && addr + size <= SRAM_NON_STRIPED_BASE + SRAM_NON_STRIPED_SIZE) {
+        uint32_t data = 0;
+        memcpy(&data, &sram_non_striped[addr - SRAM_NON_STRIPED_BASE], size);
+        return data;
+    }
+    if (addr >= XIP_BASE && addr + size <= XIP_BASE + FLASH_SIZE) {
+        uint32_t data = 0;
+        memcpy(&data, &flash[addr - XIP_BASE], size);
+        return data;
+    }
+    for (uint32_t p = 0; p < 2; ++p) {
+        for (uint32_t s = 0; s < 4; ++s) {
+            if ((addr & ~3u) == pio_rxf(p, s)) {
+                PioSm& sm = pio[p].sm[s];
+                if (sm.rx_fifo.empty()) return 0;
+                uint32_t data = sm.rx_fifo.front();
+                sm.rx_fifo.pop_front();
+                // Narrow reads pick the addressed byte lane
+                return data >> (8 * (addr & 3));
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t Soc::bus_read_stall(uint32_t addr) {
+    if (addr < XIP_BASE || addr >= XIP_BASE + FLASH_SIZE) return 0;
+    return xip_lines_.insert(addr / XIP_LINE_SIZE).second ? XIP_MISS_LATENCY : 0;
+}
+
+void Soc::bus_write(uint32_t addr, uint32_t size, uint32_t data) {
+    if (addr >= SRAM_BASE && addr + size <= SRAM_BASE + SRAM_SIZE) {
+        memcpy(&sram[addr - SRAM_BASE], &data, size);
+        return;
+    }
+    if (addr >= SRAM_NON_STRIPED_BASE && addr + size <= SRAM_NON_STRIPED_BASE + SRAM_NON_STRIPED_SIZE) {
+        memcpy(&sram_non_striped[addr - SRAM_NON_STRIPED_BASE], &data, size);
+        return;
+    }
+    if (dma.write_register(addr, data)) return;
+    for (uint32_t p = 0; p < 2; ++p) {
+        for (uint32_t s = 0; s < 4; ++s) {
+            if ((addr & ~3u) == pio_txf(p, s)) {
+                // Narrow writes are replicated across the bus
+                if (size == 1) data = (data & 0xff) * 0x01010101u;
+                else if (size == 2) data = (data & 0xffff) * 0x00010001u;
+                PioSm& sm = pio[p].sm[s];
+                if (sm.tx_fifo.size() < sm.tx_depth()) sm.tx_fifo.push_back(data);
+                return;
+            }
+        }
+    }
+}
+
+void Soc::step(uint32_t external_levels, uint32_t external_mask) {
+    uint32_t levels = external_levels & external_mask;
+    for (const Pio& p : pio) levels = (levels & ~p.pin_dirs) | (p.pin_values & p.pin_dirs);
+    gpio.record(cycle_, levels);
+
+    pio[0].step();
+    pio[1].step();
+    dma.step(cycle_);
+    if (core1) core1();
+
+    ++cycle_;
+}
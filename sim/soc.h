@@ -0,0 +1,91 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+#include "dma_sim.h"
+#include "gpio_sim.h"
+#include "pio_sim.h"
+
+constexpr uint32_t SRAM_BASE = 0x20000000;
+constexpr uint32_t SRAM_SIZE = 264 * 1024;
+constexpr uint32_t SRAM_NON_STRIPED_BASE = 0x21000000;
+constexpr uint32_t SRAM_NON_STRIPED_SIZE = 256 * 1024;
+constexpr uint32_t XIP_BASE = 0x10000000;
+constexpr uint32_t FLASH_SIZE = 2 * 1024 * 1024;
+constexpr uint32_t DMA_BASE = 0x50000000;
+constexpr uint32_t DMA_CH_STRIDE = 0x40;
+constexpr uint32_t PIO0_BASE = 0x50200000;
+constexpr uint32_t PIO1_BASE = 0x50300000;
+constexpr uint32_t PIO_TXF0_OFFSET = 0x10;
+constexpr uint32_t PIO_RXF0_OFFSET = 0x20;
+
+// Address of the DMA channel registers used in sram.c
+constexpr uint32_t dma_al1_transfer_count_trig(uint32_t ch) { return DMA_BASE + ch * DMA_CH_STRIDE + 0x1c; }
+constexpr uint32_t dma_al2_write_addr_trig(uint32_t ch) { return DMA_BASE + ch * DMA_CH_STRIDE + 0x2c; }
+constexpr uint32_t dma_al3_read_addr_trig(uint32_t ch) { return DMA_BASE + ch * DMA_CH_STRIDE + 0x3c; }
+constexpr uint32_t pio_txf(uint32_t pio, uint32_t sm) { return (pio ? PIO1_BASE : PIO0_BASE) + PIO_TXF0_OFFSET + sm * 4; }
+constexpr uint32_t pio_rxf(uint32_t pio, uint32_t sm) { return (pio ? PIO1_BASE : PIO0_BASE) + PIO_RXF0_OFFSET + sm * 4; }
+
+// The parts of the RP2040 involved in the SRAM emulation: GPIO, both PIOs,
+// the DMA, the SRAM and the flash behind the XIP cache.  Core1 is modelled
+// separately, see core1_model.h
+class Soc {
+public:
+    // Cycles a read that misses the XIP cache stalls for.  Refilling an 8 byte
+    // line takes 28 flash clocks at SYS/2 with the continuous quad read boot2
+    // sets up, plus the XIP and SSI overhead.
+    static constexpr uint32_t XIP_MISS_LATENCY = 64;
+    static constexpr uint32_t XIP_LINE_SIZE = 8;
+
+    Soc()
+        : pio{Pio(0, gpio), Pio(1, gpio)}, dma(*this), sram(SRAM_SIZE), sram_non_striped(SRAM_NON_STRIPED_SIZE),
+          flash(FLASH_SIZE) {}
+
+    Gpio gpio;
+    Pio pio[2];
+    Dma dma;
+    std::vector<uint8_t> sram;
+    // The non-striped aliases of SRAM0-3.  They are modelled as separate
+    // memory, as nothing uses the striped view of the RAM's banks when the RAM
+    // is placed in them.
+    std::vector<uint8_t> sram_non_striped;
+    std::vector<uint8_t> flash;
+
+    // Called every cycle after the PIOs and DMA have been stepped, to run core1.
+    std::function<void()> core1;
+
+    uint64_t cycle() const { return cycle_; }
+
+    // Bus accesses by the DMA
+    uint32_t bus_read(uint32_t addr, uint32_t size);
+    void bus_write(uint32_t addr, uint32_t size, uint32_t data);
+
+    // Cycles a bus read of addr stalls for, filling the XIP cache on a miss.
+    uint32_t bus_read_stall(uint32_t addr);
+
+    // Empty the XIP cache.  The cache is large enough that it is modelled as
+    // never evicting.
+    void xip_flush() { xip_lines_.clear(); }
+
+    uint8_t* sram_ptr(uint32_t addr) {
+        if (addr >= SRAM_NON_STRIPED_BASE) return &sram_non_striped.at(addr - SRAM_NON_STRIPED_BASE);
+        return &sram.at(addr - SRAM_BASE);
+    }
+    uint8_t* flash_ptr(uint32_t addr) { return &flash.at(addr - XIP_BASE); }
+
+    // Advance one cycle with the external pins driven to the given levels.
+    // Pins driven by a PIO override the external levels.
+    void step(uint32_t external_levels, uint32_t external_mask);
+
+    // Level of all pins in the current cycle
+    uint32_t levels() const { return gpio.at(0); }
+
+private:
+    uint64_t cycle_ = 0;
+    std::unordered_set<uint32_t> xip_lines_;
+};
@@ -0,0 +1,305 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include "sram_sim.h"
+
+SramSim::SramSim(const std::vector<PioProgram>& programs, const FirmwareConfig& cfg) {
+    setup_.cfg = cfg;
+    setup_.read_program = &pio_find_program(programs, cfg.addr_bits == 24 ? "sram_read_24" : "sram_read");
+    setup_.write_program = &pio_find_program(programs, "sram_write");
+    setup_.dual_read_program = &pio_find_program(programs, "sram_dual_read");
+    setup_.dual_write_program = &pio_find_program(programs, "sram_dual_write");
+    setup_.quad_read_program = &pio_find_program(programs, "sram_quad_read");
+    setup_.quad_write_program = &pio_find_program(programs, "sram_quad_write");
+    const PioProgram& read_program = *setup_.read_program;
+    const PioProgram& write_program = *setup_.write_program;
+
+    // setup_sram_pio(): pio_add_program allocates from the top of instruction memory
+    const uint32_t pio_read_offset = 32 - (uint32_t)read_program.instructions.size();
+    setup_.pio_read_offset = pio_read_offset;
+    Pio& rp = soc_.pio[fw::pio_read];
+    Pio& wp = soc_.pio[fw::pio_write];
+    rp.load_program(read_program, pio_read_offset);
+    wp.load_program(write_program, fw::pio_write_offset);
+    wp.instr_mem[fw::pio_write_offset + write_program.offset_of("cmd_addr_count")] = pio_encode::set_x(cfg.cmd_addr_clocks() - 1);
+    if (cfg.num_devices > 1) {
+        // Each read SM loops on its CS, and the write SM serves every device
+        rp.instr_mem[pio_read_offset] = pio_encode::jmp_pin(pio_read_offset);
+        wp.instr_mem[fw::pio_write_offset] = pio_encode::wait_pin(false, 1);
+    }
+
+    // sram_read_program_get_config()
+    PioSmConfig& c = setup_.spi_read_config;
+    c.wrap_target = pio_read_offset + read_program.wrap_target;
+    c.wrap = pio_read_offset + read_program.wrap;
+    c.in_base = cfg.mosi;
+    c.in_shift_right = false;
+    c.autopush = true;
+    c.push_thresh = 32;
+
+    // sram_write_program_get_config()
+    PioSmConfig& w = setup_.spi_write_config;
+    w.wrap_target = fw::pio_write_offset + write_program.wrap_target;
+    w.wrap = fw::pio_write_offset + write_program.wrap;
+    w.in_base = cfg.mosi;
+    w.out_base = cfg.miso;
+    w.out_count = 1;
+    w.out_shift_right = false;
+    w.autopull = true;
+    w.pull_thresh = 32;
+    w.join_tx = true;
+    w.jmp_pin = cfg.mosi;
+
+    // sram_dual_read_program_get_config()
+    PioSmConfig& dc = setup_.dual_read_config;
+    dc.wrap_target = pio_read_offset + setup_.dual_read_program->wrap_target;
+    dc.wrap = pio_read_offset + setup_.dual_read_program->wrap;
+    dc.in_base = cfg.miso;
+    dc.in_shift_right = true;
+    dc.autopush = false;
+
+    // sram_dual_write_program_get_config()
+    PioSmConfig& dw = setup_.dual_write_config;
+    dw.wrap_target = fw::pio_write_offset + setup_.dual_write_program->wrap_target;
+    dw.wrap = fw::pio_write_offset + setup_.dual_write_program->wrap;
+    dw.in_base = cfg.miso;
+    dw.out_base = cfg.miso;
+    dw.out_count = 2;
+    dw.set_base = cfg.miso;
+    dw.set_count = 2;
+    dw.out_shift_right = true;
+    dw.autopull = false;
+    dw.join_tx = true;
+
+    // sram_quad_read_program_get_config()
+    PioSmConfig& qc = setup_.quad_read_config;
+    qc.wrap_target = pio_read_offset + setup_.quad_read_program->wrap_target;
+    qc.wrap = pio_read_offset + setup_.quad_read_program->wrap;
+    qc.in_base = cfg.sio3();
+    qc.in_shift_right = true;
+    qc.autopush = false;
+
+    // sram_quad_write_program_get_config()
+    PioSmConfig& qw = setup_.quad_write_config;
+    qw.wrap_target = fw::pio_write_offset + setup_.quad_write_program->wrap_target;
+    qw.wrap = fw::pio_write_offset + setup_.quad_write_program->wrap;
+    qw.in_base = cfg.sio3();
+    qw.out_base = cfg.sio3();
+    qw.out_count = 4;
+    qw.set_base = cfg.sio3();
+    qw.set_count = 4;
+    qw.out_shift_right = true;
+    qw.autopull = false;
+    qw.join_tx = true;
+
+    // sram_read_program_init(), or sram_read_device_program_init() for each device
+    for (uint32_t device = 0; device < cfg.num_devices; ++device) {
+        PioSmConfig dc = setup_.spi_read_config;
+        if (cfg.num_devices > 1) dc.jmp_pin = cfg.device_cs(device);
+        const uint32_t sm = cfg.device_sm(device);
+        rp.sm_init(sm, pio_read_offset, dc);
+        rp.sm[sm].y = cfg.addr_prefix() + device;
+        rp.sm_set_enabled(sm, true);
+    }
+
+    // sram_write_program_init()
+    wp.pin_dirs |= 1u << cfg.miso;
+    wp.sm_init(fw::pio_write_sm, fw::pio_write_offset, setup_.spi_write_config);
+    wp.sm_set_enabled(fw::pio_write_sm, true);
+
+    // setup_rx_channel()
+    DmaChannel& rx = soc_.dma.ch[fw::rx_channel];
+    rx.data_size = 1;
+    rx.incr_read = false;
+    rx.incr_write = true;
+    rx.treq = dma_dreq_pio(fw::pio_read, fw::pio_read_sm, false);
+    rx.read_addr = pio_rxf(fw::pio_read, fw::pio_read_sm);
+    rx.trans_count_reload = 65536;
+    rx.ring_write = cfg.wraps();
+
+    // setup_tx_channel()
+    DmaChannel& tx = soc_.dma.ch[fw::tx_channel];
+    tx.data_size = 4;
+    tx.incr_read = true;
+    tx.incr_write = false;
+    tx.bswap = true;
+    tx.treq = dma_dreq_pio(fw::pio_write, fw::pio_write_sm, true);
+    tx.write_addr = pio_txf(fw::pio_write, fw::pio_write_sm);
+    tx.trans_count_reload = 65536;
+    rx.high_priority = true;
+    tx.high_priority = true;
+
+    DmaChannel& tx2 = soc_.dma.ch[fw::tx_channel2];
+    tx2.data_size = 4;
+    tx2.incr_read = false;
+    tx2.incr_write = false;
+    tx2.treq = dma_dreq_pio(fw::pio_read, fw::pio_read_sm, false);
+    tx2.write_addr = dma_al3_read_addr_trig(fw::tx_channel);
+    tx2.read_addr = pio_rxf(fw::pio_read, fw::pio_read_sm);
+    tx2.trans_count_reload = 1;
+    tx2.high_priority = true;
+
+    // setup_crc_channel()
+    if (cfg.enable_crc) {
+        DmaChannel& crc = soc_.dma.ch[fw::crc_channel];
+        crc.data_size = 1;
+        crc.incr_read = true;
+        crc.incr_write = false;
+        crc.sniff = true;
+        crc.write_addr = cfg.crc_sink_addr();
+    }
+
+    // setup_bulk_channel(), the rest is set by start_bulk()
+    if (cfg.enable_bulk) {
+        DmaChannel& bulk = soc_.dma.ch[fw::bulk_channel];
+        bulk.incr_write = true;
+    }
+
+    // The APS6404 wraps within 1kB from power up, and psram_id is initialised data
+    if (cfg.enable_psram_spi) {
+        rx.ring_size = 10;
+        tx.ring_size = 10;
+        for (uint32_t i = 0; i < sizeof(fw::psram_id); ++i) soc_.bus_write(cfg.psram_id_addr() + i, 1, fw::psram_id[i]);
+    }
+
+    core1_ = std::make_unique<Core1Model>(soc_, setup_);
+    soc_.core1 = [this] { core1_->tick(); };
+    core1_->launch();
+
+    idle(100);
+}
+
+uint8_t* SramSim::emu_ram() {
+    return soc_.sram_ptr(setup_.cfg.emu_ram_base());
+}
+
+void SramSim::step(bool cs, bool sck, uint32_t data, uint32_t data_mask) {
+    const FirmwareConfig& c = setup_.cfg;
+    // The CS of the devices not selected are held high
+    uint32_t levels = (sck << c.sck) | (data & data_mask);
+    uint32_t mask = (1u << c.sck) | data_mask;
+    for (uint32_t device = 0; device < c.num_devices; ++device) {
+        levels |= (device == device_ ? cs : true) << c.device_cs(device);
+        mask |= 1u << c.device_cs(device);
+    }
+    if (mask & (soc_.pio[0].pin_dirs | soc_.pio[1].pin_dirs)) ++contention_;
+    soc_.step(levels, mask);
+    if (on_step) on_step();
+
+    if (capturing_) {
+        // The first sample ends up in the bottom bits, as the logic analyser shifts right
+        capture_word_ = (capture_word_ >> 4) | (((soc_.levels() >> capture_base_) & 0xf) << 28);
+        if (++capture_samples_ % 8 == 0) capture_.push_back(capture_word_);
+    }
+}
+
+void SramSim::start_capture(uint32_t pin_base) {
+    capturing_ = true;
+    capture_base_ = pin_base;
+    capture_samples_ = 0;
+    capture_.clear();
+}
+
+void SramSim::idle(uint32_t cycles) {
+    for (uint32_t i = 0; i < cycles; ++i) step(true, false, 0, 0);
+}
+
+std::vector<uint8_t> SramSim::transfer(const std::vector<uint8_t>& mosi, uint32_t sck_period, uint32_t cs_high_cycles,
+                                       uint32_t device) {
+    device_ = device;
+    return clock_bits(mosi, mosi.size() * 8, sck_period, cs_high_cycles);
+}
+
+void SramSim::abort(const std::vector<uint8_t>& mosi, size_t bits, uint32_t sck_period, uint32_t cs_high_cycles,
+                    uint32_t device) {
+    device_ = device;
+    clock_bits(mosi, bits, sck_period, cs_high_cycles);
+}
+
+std::vector<uint8_t> SramSim::clock_bits(const std::vector<uint8_t>& mosi, size_t bits, uint32_t sck_period,
+                                         uint32_t cs_high_cycles) {
+    const uint32_t low_cycles = sck_period / 2;
+    const uint32_t high_cycles = sck_period - low_cycles;
+    const uint32_t mosi_pin = setup_.cfg.mosi;
+    const uint32_t mosi_mask = 1u << mosi_pin;
+    std::vector<uint8_t> miso(mosi.size());
+
+    // CS falls a period before the first SCK cycle starts
+    const uint32_t first = mosi.empty() ? 0 : (mosi[0] >> 7) & 1;
+    for (uint32_t i = 0; i < sck_period; ++i) step(false, false, first << mosi_pin, mosi_mask);
+
+    for (size_t byte = 0; byte * 8 < bits; ++byte) {
+        uint8_t in = 0;
+        for (int bit = 7; bit >= 0 && byte * 8 + 7 - bit < bits; --bit) {
+            const uint32_t out = ((mosi[byte] >> bit) & 1) << mosi_pin;
+            for (uint32_t i = 0; i < low_cycles; ++i) step(false, false, out, mosi_mask);
+            for (uint32_t i = 0; i < high_cycles; ++i) {
+                step(false, true, out, mosi_mask);
+                if (i == 0) in = (in << 1) | ((soc_.gpio.at(MISO_SAMPLE_DELAY) >> setup_.cfg.miso) & 1);
+            }
+        }
+        miso[byte] = in;
+    }
+
+    // Return SCK low and hold CS for half a period before raising it
+    for (uint32_t i = 0; i < low_cycles; ++i) step(false, false, 0, mosi_mask);
+    idle(cs_high_cycles);
+    return miso;
+}
+
+namespace {
+
+// SIOn is bit n of each symbol, and is on pin MOSI - n.
+uint32_t symbol_to_pins(uint32_t symbol, uint32_t width, uint32_t mosi) {
+    uint32_t pins = 0;
+    for (uint32_t i = 0; i < width; ++i) pins |= ((symbol >> i) & 1) << (mosi - i);
+    return pins;
+}
+
+uint32_t pins_to_symbol(uint32_t pins, uint32_t width, uint32_t mosi) {
+    uint32_t symbol = 0;
+    for (uint32_t i = 0; i < width; ++i) symbol |= ((pins >> (mosi - i)) & 1) << i;
+    return symbol;
+}
+
+}  // namespace
+
+std::vector<uint8_t> SramSim::transfer_wide(const std::vector<uint8_t>& out, size_t drive_bytes, uint32_t width,
+                                            uint32_t sck_period, uint32_t cs_high_cycles) {
+    return clock_symbols(out, drive_bytes, out.size() * 8 / width, width, sck_period, cs_high_cycles);
+}
+
+void SramSim::abort_wide(const std::vector<uint8_t>& out, size_t clocks, uint32_t width, uint32_t sck_period,
+                         uint32_t cs_high_cycles) {
+    clock_symbols(out, out.size(), clocks, width, sck_period, cs_high_cycles);
+}
+
+std::vector<uint8_t> SramSim::clock_symbols(const std::vector<uint8_t>& out, size_t drive_bytes, size_t clocks,
+                                            uint32_t width, uint32_t sck_period, uint32_t cs_high_cycles) {
+    const uint32_t low_cycles = sck_period / 2;
+    const uint32_t high_cycles = sck_period - low_cycles;
+    const uint32_t mosi = setup_.cfg.mosi;
+    const uint32_t data_mask = symbol_to_pins((1u << width) - 1, width, mosi);
+    std::vector<uint8_t> in(out.size());
+
+    const uint32_t first = out.empty() ? 0 : symbol_to_pins(out[0] >> (8 - width), width, mosi);
+    for (uint32_t i = 0; i < sck_period; ++i) step(false, false, first, data_mask);
+
+    const uint32_t per_byte = 8 / width;
+    for (size_t byte = 0; byte * per_byte < clocks; ++byte) {
+        const uint32_t mask = byte < drive_bytes ? data_mask : 0;
+        uint8_t value = 0;
+        for (int shift = 8 - width; shift >= 0 && byte * per_byte + (8 - width - shift) / width < clocks; shift -= width) {
+            const uint32_t pins = symbol_to_pins(out[byte] >> shift, width, mosi);
+            for (uint32_t i = 0; i < low_cycles; ++i) step(false, false, pins, mask);
+            for (uint32_t i = 0; i < high_cycles; ++i) {
+                step(false, true, pins, mask);
+                if (i == 0) value = (value << width) | pins_to_symbol(soc_.gpio.at(MISO_SAMPLE_DELAY), width, mosi);
+            }
+        }
+        in[byte] = value;
+    }
+
+    for (uint32_t i = 0; i < low_cycles; ++i) step(false, false, 0, 0);
+    idle(cs_high_cycles);
+    return in;
+}
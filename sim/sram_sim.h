@@ -0,0 +1,114 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core1_model.h"
+#include "firmware_config.h"
+#include "pio_asm.h"
+#include "soc.h"
+
+// The emulated SRAM as set up by setup_simulated_sram(), with an SPI master
+// attached to the pins.
+class SramSim {
+public:
+    // Cycles between the master driving SCK high and sampling MISO, as seen
+    // by the PIO output register.  Covers the output register, the pad and
+    // the master's input path.
+    static constexpr uint32_t MISO_SAMPLE_DELAY = 2;
+
+    explicit SramSim(const std::vector<PioProgram>& programs, const FirmwareConfig& cfg = FirmwareConfig());
+
+    // Run one SPI mode 0 transaction with the given SCK period in SYS clocks,
+    // selecting the device with its CS.  CS is held high for cs_high_cycles
+    // afterwards.  Returns the bytes sampled from MISO.
+    std::vector<uint8_t> transfer(const std::vector<uint8_t>& mosi, uint32_t sck_period, uint32_t cs_high_cycles,
+                                  uint32_t device = 0);
+
+    // As transfer(), but the master raises CS after the first bits of mosi,
+    // which may be 0.
+    void abort(const std::vector<uint8_t>& mosi, size_t bits, uint32_t sck_period, uint32_t cs_high_cycles,
+               uint32_t device = 0);
+
+    // Run one SDI (width 2) or SQI (width 4) transaction.  The master drives
+    // the first drive_bytes of out on the data pins, and leaves them
+    // floating for the rest.  Returns the bytes sampled from the data pins.
+    std::vector<uint8_t> transfer_wide(const std::vector<uint8_t>& out, size_t drive_bytes, uint32_t width,
+                                       uint32_t sck_period, uint32_t cs_high_cycles);
+
+    // As transfer_wide(), driving all of out, but the master raises CS after
+    // the first clocks, which may be 0.
+    void abort_wide(const std::vector<uint8_t>& out, size_t clocks, uint32_t width, uint32_t sck_period,
+                    uint32_t cs_high_cycles);
+
+    // Run with CS high for a number of cycles.
+    void idle(uint32_t cycles);
+
+    // The RAM of all the devices, each has device_ram_size() bytes
+    uint8_t* emu_ram();
+    uint32_t emu_ram_size() const { return setup_.cfg.num_devices * setup_.cfg.emu_ram_size(); }
+    uint32_t device_ram_size() const { return setup_.cfg.emu_ram_size(); }
+    uint32_t num_devices() const { return setup_.cfg.num_devices; }
+    uint32_t addr_bits() const { return setup_.cfg.addr_bits; }
+
+    // The flash region, read at 0x800000 and up
+    bool flash_enabled() const { return setup_.cfg.enable_flash; }
+
+    // The writes core1 has recorded to each sector, when persisting the RAM
+    bool persist_enabled() const { return setup_.cfg.enable_persist; }
+    const std::vector<uint32_t>& sector_writes() const { return core1_->sector_writes; }
+
+    // The write events core1 has queued, if enabled
+    bool write_events_enabled() const { return setup_.cfg.enable_write_events; }
+    const std::vector<Core1Model::WriteEvent>& write_events() const { return core1_->write_events; }
+    bool doorbell_enabled() const { return setup_.cfg.enable_doorbell; }
+    const std::vector<Core1Model::Doorbell>& doorbells() const { return core1_->doorbells; }
+
+    // The snapshot state core1 keeps, if enabled, and the address of emu_ram
+    bool snapshot_enabled() const { return setup_.cfg.enable_snapshot; }
+    const Core1Model::Snapshot& snapshot() const { return core1_->snapshot; }
+    uint32_t emu_ram_base() const { return setup_.cfg.emu_ram_base(); }
+
+    // The statistics core1 has counted, if enabled
+    bool stats_enabled() const { return setup_.cfg.enable_stats; }
+    const sim_sram_command_stats_t& stats(uint32_t command) const { return core1_->stats[command]; }
+    uint8_t* flash_region() { return soc_.flash_ptr(setup_.cfg.flash_base); }
+    uint32_t flash_region_size() const { return XIP_BASE + FLASH_SIZE - setup_.cfg.flash_base; }
+
+    Soc& soc() { return soc_; }
+
+    // Record the 4 pins from pin_base every cycle, packed as the logic
+    // analyser in logic.c packs them
+    void start_capture(uint32_t pin_base);
+    const std::vector<uint32_t>& capture() const { return capture_; }
+
+    // Called after every cycle, if set
+    std::function<void()> on_step;
+
+    // Cycles where the master and the emulator drove the same pin.
+    uint32_t contention() const { return contention_; }
+
+private:
+    void step(bool cs, bool sck, uint32_t data, uint32_t data_mask);
+    std::vector<uint8_t> clock_bits(const std::vector<uint8_t>& mosi, size_t bits, uint32_t sck_period,
+                                    uint32_t cs_high_cycles);
+    std::vector<uint8_t> clock_symbols(const std::vector<uint8_t>& out, size_t drive_bytes, size_t clocks,
+                                       uint32_t width, uint32_t sck_period, uint32_t cs_high_cycles);
+
+    Soc soc_;
+    SramSetup setup_;
+    std::unique_ptr<Core1Model> core1_;
+    uint32_t contention_ = 0;
+    uint32_t device_ = 0;  // The device selected by transfer()
+
+    bool capturing_ = false;
+    uint32_t capture_base_ = 0;
+    uint32_t capture_word_ = 0;
+    uint32_t capture_samples_ = 0;
+    std::vector<uint32_t> capture_;
+};
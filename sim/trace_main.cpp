@@ -0,0 +1,391 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+
+// Decoder for captures from the logic analyser in logic.c.  The capture
+// words are unpacked as logic_analyser_init() packs them, decoded as SPI
+// mode 0 transactions, checked for timing problems, and can be written out
+// as a VCD for a waveform viewer.
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "sram_protocol.h"
+}
+
+namespace {
+
+struct Options {
+    std::string input;
+    bool hex = false;
+    uint32_t pins = 4;
+    // The bit of each signal in a sample, pin - pin_base
+    uint32_t mosi = 0, sck = 1, cs = 2, miso = 3;
+    uint32_t div = 1;
+    double sys_mhz = 125.0;
+    uint32_t addr_bits = 16;
+    uint32_t rearm = 32;
+    uint32_t setup = 1;
+    std::string vcd;
+    bool quiet = false;
+    bool check = false;
+};
+
+void usage(const char* argv0) {
+    printf("Usage: %s [options] CAPTURE\n"
+           "  --hex               CAPTURE is text, as printed by print_capture_words() in logic.c, instead of\n"
+           "                      little endian 32-bit words.  Each \"Words:\" line starts a new capture\n"
+           "  --pins N            Pins per sample, as passed to logic_analyser_init() (default 4)\n"
+           "  --mosi N, --sck N, --cs N, --miso N\n"
+           "                      Bit of each signal in a sample, pin - pin_base (default 0, 1, 2, 3)\n"
+           "  --div N             SYS clocks per sample (default 1)\n"
+           "  --sys-mhz F         SYS clock, for the times in the VCD (default 125)\n"
+           "  --addr-bits N       Address bits of READ, FAST READ and WRITE (default 16)\n"
+           "  --rearm N           Shortest time from CS rising to the first SCK rising edge of the next\n"
+           "                      transaction, in SYS clocks, see the CS high table in the README (default 32)\n"
+           "  --setup N           Shortest time from MISO changing to SCK rising, in samples (default 1)\n"
+           "  --vcd FILE          Write the capture as a VCD\n"
+           "  --quiet             Only print the problems found and the summary\n"
+           "  --check             Exit with failure if any problems are found\n",
+           argv0);
+}
+
+bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + a);
+            return argv[++i];
+        };
+        if (a == "--hex") opt.hex = true;
+        else if (a == "--pins") opt.pins = atoi(next());
+        else if (a == "--mosi") opt.mosi = atoi(next());
+        else if (a == "--sck") opt.sck = atoi(next());
+        else if (a == "--cs") opt.cs = atoi(next());
+        else if (a == "--miso") opt.miso = atoi(next());
+        else if (a == "--div") opt.div = atoi(next());
+        else if (a == "--sys-mhz") opt.sys_mhz = atof(next());
+        else if (a == "--addr-bits") opt.addr_bits = atoi(next());
+        else if (a == "--rearm") opt.rearm = atoi(next());
+        else if (a == "--setup") opt.setup = atoi(next());
+        else if (a == "--vcd") opt.vcd = next();
+        else if (a == "--quiet") opt.quiet = true;
+        else if (a == "--check") opt.check = true;
+        else if (a[0] != '-' && opt.input.empty()) opt.input = a;
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    const uint32_t max_bit = std::max(std::max(opt.mosi, opt.sck), std::max(opt.cs, opt.miso));
+    if (opt.input.empty() || opt.pins == 0 || opt.pins > 32 || max_bit >= opt.pins || opt.div == 0 ||
+        (opt.addr_bits != 16 && opt.addr_bits != 24)) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+// The capture words of each capture in the file
+std::vector<std::vector<uint32_t>> read_captures(const Options& opt) {
+    FILE* f = fopen(opt.input.c_str(), "rb");
+    if (!f) throw std::runtime_error("can't open " + opt.input);
+    std::vector<std::vector<uint32_t>> captures(1);
+    if (!opt.hex) {
+        uint8_t buf[65536];
+        size_t n, have = 0;
+        while ((n = fread(buf + have, 1, sizeof(buf) - have, f)) > 0) {
+            n += have;
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                captures[0].push_back(buf[i] | (buf[i + 1] << 8) | (buf[i + 2] << 16) | ((uint32_t)buf[i + 3] << 24));
+            }
+            have = n - i;
+            memmove(buf, buf + i, have);
+        }
+    }
+    else {
+        // Any token of 8 hex digits is a word, so the pin diagrams
+        // print_capture_buf() prints alongside are skipped
+        char line[1024];
+        while (fgets(line, sizeof(line), f)) {
+            if (strstr(line, "Words:") && !captures.back().empty()) captures.emplace_back();
+            for (char* tok = strtok(line, " \t\r\n"); tok; tok = strtok(nullptr, " \t\r\n")) {
+                size_t len = strlen(tok);
+                bool word = len == 8;
+                for (size_t i = 0; word && i < len; ++i) word = isxdigit((unsigned char)tok[i]);
+                if (word) captures.back().push_back(strtoul(tok, nullptr, 16));
+            }
+        }
+    }
+    fclose(f);
+    return captures;
+}
+
+// A change of the pins, at a sample index
+struct Change {
+    uint64_t time;
+    uint32_t sample;
+};
+
+// Unpack the samples as print_capture_buf() does, keeping only the changes.
+// The first sample is always kept.
+std::vector<Change> unpack(const std::vector<uint32_t>& words, const Options& opt, uint64_t start) {
+    const uint32_t bits_per_word = 32 - 32 % opt.pins;
+    const uint32_t per_word = bits_per_word / opt.pins;
+    const uint32_t mask = opt.pins == 32 ? ~0u : (1u << opt.pins) - 1;
+    std::vector<Change> changes;
+    uint32_t prev = ~0u;
+    uint64_t time = start;
+    for (uint32_t word : words) {
+        word >>= 32 - bits_per_word;
+        for (uint32_t i = 0; i < per_word; ++i, ++time) {
+            const uint32_t sample = (word >> (i * opt.pins)) & mask;
+            if (sample != prev) changes.push_back({time, sample});
+            prev = sample;
+        }
+    }
+    return changes;
+}
+
+struct Transaction {
+    uint64_t start;
+    uint64_t first_sck = 0;
+    uint64_t end = 0;
+    uint32_t bits = 0;
+    std::vector<uint8_t> mosi, miso;
+};
+
+class Decoder {
+public:
+    Decoder(const Options& opt) : opt_(opt) {}
+
+    // Decode one capture, starting with the pins in the first change.  A
+    // capture that starts with CS low is taken to start as CS fell, as the
+    // logic analyser is triggered on CS falling.
+    void decode(const std::vector<Change>& changes) {
+        if (changes.empty()) return;
+        prev_ = changes[0].sample;
+        cs_rise_valid_ = false;
+        selected_ = !bit(prev_, opt_.cs);
+        if (selected_) begin(changes[0].time);
+        for (size_t i = 1; i < changes.size(); ++i) step(changes[i]);
+        if (selected_ && !opt_.quiet) {
+            printf("%llu: capture ends with CS low\n", (unsigned long long)t_.start);
+        }
+    }
+
+    uint32_t transactions = 0;
+    uint32_t problems = 0;
+
+private:
+    static bool bit(uint32_t sample, uint32_t b) { return (sample >> b) & 1; }
+
+    void problem(uint64_t time, const char* what) {
+        ++problems;
+        printf("%llu: %s\n", (unsigned long long)time, what);
+    }
+
+    void begin(uint64_t time) {
+        t_ = Transaction{time};
+        last_sck_ = time;
+    }
+
+    void step(const Change& c) {
+        const uint32_t changed = c.sample ^ prev_;
+        const uint32_t old = prev_;
+        prev_ = c.sample;
+
+        if (changed & (1u << opt_.cs)) {
+            if (!bit(c.sample, opt_.cs)) {
+                selected_ = true;
+                begin(c.time);
+            }
+            else {
+                if (selected_) end(c.time);
+                selected_ = false;
+                cs_rise_ = c.time;
+                cs_rise_valid_ = true;
+            }
+            return;
+        }
+        if (!selected_) return;
+
+        // Both data lines are sampled on the rising edge of SCK, so must only
+        // change while it is low, or as it falls
+        const bool sck_high = bit(old, opt_.sck) && bit(c.sample, opt_.sck);
+        const uint32_t last_bit = t_.bits ? t_.bits - 1 : 0;
+        if (sck_high && (changed & (1u << opt_.miso))) {
+            problem(c.time, bit_name("MISO changed while SCK was high", last_bit).c_str());
+        }
+        if (sck_high && (changed & (1u << opt_.mosi))) {
+            problem(c.time, bit_name("MOSI changed while SCK was high", last_bit).c_str());
+        }
+        if (changed & (1u << opt_.miso)) last_miso_ = c.time;
+
+        if ((changed & c.sample) & (1u << opt_.sck)) rising_edge(c);
+    }
+
+    void rising_edge(const Change& c) {
+        if (t_.bits == 0) {
+            t_.first_sck = c.time;
+            // The emulator needs time after CS rises to re-arm for the next command
+            if (cs_rise_valid_ && (c.time - cs_rise_) * opt_.div < opt_.rearm) {
+                char what[128];
+                snprintf(what, sizeof(what), "CS high only %llu SYS clocks before the first SCK edge, %u needed",
+                         (unsigned long long)((c.time - cs_rise_) * opt_.div), opt_.rearm);
+                problem(c.time, what);
+            }
+        }
+        // MISO must be stable for the setup time before the edge.  Data that
+        // isn't ready for the first data bit of a read is the usual failure at speed.
+        if (t_.bits > 0 && last_miso_ > last_sck_ && c.time - last_miso_ < opt_.setup) {
+            const bool first_data = is_read() && t_.bits == data_start() * 8;
+            problem(c.time, first_data ? "Data late after the address, MISO changed just before the first data bit"
+                                       : bit_name("MISO changed just before SCK rose", t_.bits).c_str());
+        }
+        last_sck_ = c.time;
+
+        const uint32_t byte = t_.bits / 8;
+        if (byte == t_.mosi.size()) {
+            t_.mosi.push_back(0);
+            t_.miso.push_back(0);
+        }
+        t_.mosi[byte] = (t_.mosi[byte] << 1) | bit(c.sample, opt_.mosi);
+        t_.miso[byte] = (t_.miso[byte] << 1) | bit(c.sample, opt_.miso);
+        ++t_.bits;
+    }
+
+    bool is_read() const {
+        return !t_.mosi.empty() && (t_.mosi[0] == SIM_SRAM_READ_CMD || t_.mosi[0] == SIM_SRAM_FAST_READ_CMD);
+    }
+
+    // The first data byte of READ, FAST READ and WRITE
+    uint32_t data_start() const {
+        return 1 + opt_.addr_bits / 8 + (t_.mosi.size() && t_.mosi[0] == SIM_SRAM_FAST_READ_CMD);
+    }
+
+    std::string bit_name(const char* what, uint32_t bit) const {
+        return std::string(what) + " in byte " + std::to_string(bit / 8) + " bit " + std::to_string(7 - bit % 8);
+    }
+
+    void end(uint64_t time) {
+        ++transactions;
+        t_.end = time;
+        if (opt_.quiet) return;
+
+        // The same layout as print_spi_transaction() in logic.c
+        printf("%llu low %llu first %llu:", (unsigned long long)t_.start, (unsigned long long)(time - t_.start),
+               (unsigned long long)(t_.bits ? t_.first_sck - t_.start : 0));
+        const uint32_t bytes = t_.bits / 8;
+        if (bytes == 0) printf(" no command");
+        else {
+            const uint8_t cmd = t_.mosi[0];
+            printf(" %02x", cmd);
+            uint32_t data = 1;
+            const bool addressed = cmd == SIM_SRAM_READ_CMD || cmd == SIM_SRAM_FAST_READ_CMD || cmd == SIM_SRAM_WRITE_CMD;
+            if (addressed && bytes > opt_.addr_bits / 8) {
+                printf(" ");
+                for (uint32_t i = 1; i <= opt_.addr_bits / 8; ++i) printf("%02x", t_.mosi[i]);
+                data = data_start();
+            }
+            const std::vector<uint8_t>& buf = is_read() ? t_.miso : t_.mosi;
+            if (data < bytes) printf(is_read() ? " <-" : " ->");
+            for (uint32_t i = data; i < bytes; ++i) printf(" %02x", buf[i]);
+        }
+        if (t_.bits % 8) printf(" +%u bits", t_.bits % 8);
+        printf("\n");
+    }
+
+    const Options& opt_;
+    uint32_t prev_ = 0;
+    bool selected_ = false;
+    uint64_t cs_rise_ = 0;
+    bool cs_rise_valid_ = false;
+    uint64_t last_sck_ = 0;
+    uint64_t last_miso_ = 0;
+    Transaction t_{0};
+};
+
+// Writes the signals to a VCD, with times in ps.
+class VcdWriter {
+public:
+    VcdWriter(const std::string& file, const Options& opt) : opt_(opt) {
+        f_ = fopen(file.c_str(), "w");
+        if (!f_) throw std::runtime_error("can't write " + file);
+        ps_per_sample_ = (uint64_t)(opt.div * 1e6 / opt.sys_mhz + 0.5);
+        fprintf(f_, "$timescale 1ps $end\n$scope module spi $end\n");
+        for (const Signal& s : signals()) fprintf(f_, "$var wire 1 %c %s $end\n", s.id, s.name);
+        fprintf(f_, "$upscope $end\n$enddefinitions $end\n");
+    }
+    ~VcdWriter() { fclose(f_); }
+
+    void write(const std::vector<Change>& changes) {
+        for (const Change& c : changes) {
+            fprintf(f_, "#%llu\n", (unsigned long long)(c.time * ps_per_sample_));
+            for (const Signal& s : signals()) {
+                const bool level = (c.sample >> s.bit) & 1;
+                if (first_ || level != (((prev_ >> s.bit) & 1) != 0)) fprintf(f_, "%d%c\n", level, s.id);
+            }
+            prev_ = c.sample;
+            first_ = false;
+        }
+    }
+
+private:
+    struct Signal {
+        char id;
+        const char* name;
+        uint32_t bit;
+    };
+    std::vector<Signal> signals() const {
+        return {{'!', "cs", opt_.cs}, {'"', "sck", opt_.sck}, {'#', "mosi", opt_.mosi}, {'$', "miso", opt_.miso}};
+    }
+
+    const Options& opt_;
+    FILE* f_;
+    uint64_t ps_per_sample_;
+    uint32_t prev_ = 0;
+    bool first_ = true;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    try {
+        if (!parse_options(argc, argv, opt)) return 2;
+        const std::vector<std::vector<uint32_t>> captures = read_captures(opt);
+
+        Decoder decoder(opt);
+        std::unique_ptr<VcdWriter> vcd;
+        if (!opt.vcd.empty()) vcd = std::make_unique<VcdWriter>(opt.vcd, opt);
+
+        // Captures follow each other in the VCD
+        uint64_t time = 0;
+        uint64_t samples = 0;
+        for (const auto& words : captures) {
+            const std::vector<Change> changes = unpack(words, opt, time);
+            decoder.decode(changes);
+            if (vcd) vcd->write(changes);
+            const uint64_t n = words.size() * ((32 - 32 % opt.pins) / opt.pins);
+            time += n;
+            samples += n;
+        }
+
+        printf("%llu samples, %u transactions, %u problems\n", (unsigned long long)samples, decoder.transactions,
+               decoder.problems);
+        return opt.check && decoder.problems ? 1 : 0;
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+}
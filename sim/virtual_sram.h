@@ -0,0 +1,44 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include "sram_protocol.h"
+}
+
+// The RAM's command set in process, for testing SPI master software without
+// a board.  Link with the sram-protocol library.
+class VirtualSram {
+public:
+    explicit VirtualSram(int addr_bits = 16)
+        : ram_(addr_bits == 24 ? 131072 : 65536) {
+        sim_sram_protocol_init(&p_, ram_.data(), ram_.size(), addr_bits);
+    }
+
+    VirtualSram(const VirtualSram&) = delete;
+    VirtualSram& operator=(const VirtualSram&) = delete;
+
+    uint8_t* ram() { return ram_.data(); }
+    uint32_t size() const { return ram_.size(); }
+
+    // One transaction, CS low for all of out.  in may be null.
+    void transfer(const uint8_t* out, uint8_t* in, size_t len) { sim_sram_protocol_transfer(&p_, out, in, len); }
+
+    std::vector<uint8_t> transfer(const std::vector<uint8_t>& out) {
+        std::vector<uint8_t> in(out.size());
+        transfer(out.data(), in.data(), out.size());
+        return in;
+    }
+
+    // A transaction split over several exchanges
+    void begin() { sim_sram_protocol_begin(&p_); }
+    void exchange(const uint8_t* out, uint8_t* in, size_t len) { sim_sram_protocol_exchange(&p_, out, in, len); }
+    void end() { sim_sram_protocol_end(&p_); }
+
+private:
+    std::vector<uint8_t> ram_;
+    sim_sram_protocol_t p_;
+};
@@ -0,0 +1,387 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+//
+// A virtual SPI RAM for testing SPI master software on Linux, without a board.
+//
+// Serves the command set in sram_protocol.c, a reference model of the
+// firmware's that the timing simulator cross-checks against it, over a Unix
+// socket, a pseudo terminal or stdin and stdout.  Each request is a 4
+// byte little endian header, the number of bytes sent with CS low in the low
+// 31 bits and the top bit set to keep CS low after them, then those bytes of
+// MOSI.  The reply is the same number of bytes of MISO.  Requests may be sent
+// ahead of their replies.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "firmware_config.h"
+#include "virtual_sram.h"
+
+namespace {
+
+constexpr uint32_t HOLD_CS = 0x80000000;
+constexpr size_t BUF_SIZE = 256 * 1024;
+
+struct Options {
+    std::string socket_path;
+    bool pty = false;
+    bool stdio = false;
+    int addr_bits = fw::addr_bits;
+    uint32_t bench = 0;
+    bool check = false;
+    uint32_t seed = 1;
+};
+
+void usage(const char* argv0) {
+    printf("Usage: %s [options]\n"
+           "  --socket PATH       Serve on a Unix socket, one connection at a time\n"
+           "  --pty               Serve on a pseudo terminal, whose path is printed\n"
+           "  --stdio             Serve on stdin and stdout\n"
+           "  --addr-bits N       16 or 24 bit addresses (default %d, from sram.h)\n"
+           "  --bench N           Time N transactions in process and over a socket\n"
+           "  --check             Check random transactions over a socket match those in process\n"
+           "  --seed N            Random seed for --check (default 1)\n"
+           "Requests are a 4 byte little endian header, the byte count in the low 31 bits and\n"
+           "the top bit set to keep CS low afterwards, then the MOSI bytes.  The reply is the MISO bytes.\n",
+           argv0, (int)fw::addr_bits);
+}
+
+bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + a);
+            return argv[++i];
+        };
+        if (a == "--socket") opt.socket_path = next();
+        else if (a == "--pty") opt.pty = true;
+        else if (a == "--stdio") opt.stdio = true;
+        else if (a == "--addr-bits") opt.addr_bits = atoi(next());
+        else if (a == "--bench") opt.bench = atoi(next());
+        else if (a == "--check") opt.check = true;
+        else if (a == "--seed") opt.seed = atoi(next());
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    const int modes = !opt.socket_path.empty() + opt.pty + opt.stdio + (opt.bench != 0) + opt.check;
+    if (modes != 1 || (opt.addr_bits != 16 && opt.addr_bits != 24)) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+bool write_all(int fd, const uint8_t* data, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Serve requests from in_fd until it closes, replying on out_fd.  Returns
+// the number of transactions.
+uint64_t serve(VirtualSram& ram, int in_fd, int out_fd) {
+    std::vector<uint8_t> in(BUF_SIZE), out;
+    out.reserve(2 * BUF_SIZE);
+    size_t have = 0, pos = 0;
+    uint8_t header[4];
+    uint32_t header_len = 0, remaining = 0;
+    bool hold = false, cs_low = false;
+    uint64_t transactions = 0;
+
+    while (true) {
+        if (pos == have) {
+            // Reply to everything received before waiting for more
+            if (!write_all(out_fd, out.data(), out.size())) break;
+            out.clear();
+            ssize_t n = read(in_fd, in.data(), in.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            have = n;
+            pos = 0;
+        }
+        if (header_len < 4) {
+            header[header_len++] = in[pos++];
+            if (header_len < 4) continue;
+            const uint32_t h = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t)header[3] << 24;
+            remaining = h & ~HOLD_CS;
+            hold = h & HOLD_CS;
+            if (!cs_low) ram.begin();
+            cs_low = true;
+        }
+        else {
+            const size_t n = std::min<size_t>(remaining, have - pos);
+            const size_t start = out.size();
+            out.resize(start + n);
+            ram.exchange(&in[pos], &out[start], n);
+            pos += n;
+            remaining -= n;
+            if (out.size() >= BUF_SIZE) {
+                if (!write_all(out_fd, out.data(), out.size())) break;
+                out.clear();
+            }
+        }
+        if (header_len == 4 && remaining == 0) {
+            header_len = 0;
+            if (!hold) {
+                ram.end();
+                cs_low = false;
+                ++transactions;
+            }
+        }
+    }
+    if (cs_low) ram.end();
+    return transactions;
+}
+
+int serve_socket(VirtualSram& ram, const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Can't create socket %s\n", path.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        fprintf(stderr, "Can't listen on %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+    printf("Serving on %s\n", path.c_str());
+    fflush(stdout);
+    while (true) {
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            return 1;
+        }
+        serve(ram, conn, conn);
+        close(conn);
+    }
+}
+
+int serve_pty(VirtualSram& ram) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        fprintf(stderr, "Can't create a pseudo terminal: %s\n", strerror(errno));
+        return 1;
+    }
+    const char* name = ptsname(fd);
+
+    // Keep the other end open and raw, so bytes pass unchanged and a client
+    // closing it doesn't end the session
+    int client = open(name, O_RDWR | O_NOCTTY);
+    termios t;
+    if (client < 0 || tcgetattr(client, &t) != 0) {
+        fprintf(stderr, "Can't open %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    cfmakeraw(&t);
+    tcsetattr(client, TCSANOW, &t);
+
+    printf("Serving on %s\n", name);
+    fflush(stdout);
+    serve(ram, fd, fd);
+    return 0;
+}
+
+// A stream of requests, and the transactions they make up
+struct Requests {
+    std::vector<uint8_t> stream;
+    uint64_t miso_bytes = 0;
+    uint64_t transactions = 0;
+};
+
+void add_request(Requests& r, const uint8_t* mosi, uint32_t len, bool hold) {
+    const uint32_t h = len | (hold ? HOLD_CS : 0);
+    for (int i = 0; i < 4; ++i) r.stream.push_back(h >> (8 * i));
+    r.stream.insert(r.stream.end(), mosi, mosi + len);
+    r.miso_bytes += len;
+    if (!hold) ++r.transactions;
+}
+
+// Random transactions: mostly READ, FAST READ and WRITE, some with unknown
+// commands, some long enough to wrap at the end of the RAM, and some split
+// over several requests.
+Requests random_requests(uint32_t count, int addr_bits, uint32_t ram_size, std::mt19937& rng) {
+    Requests r;
+    const uint8_t cmds[3] = {SIM_SRAM_READ_CMD, SIM_SRAM_FAST_READ_CMD, SIM_SRAM_WRITE_CMD};
+    std::vector<uint8_t> mosi;
+    for (uint32_t t = 0; t < count; ++t) {
+        mosi.clear();
+        mosi.push_back(rng() % 10 == 0 ? rng() : cmds[rng() % 3]);
+        const uint32_t addr = rng() % 8 == 0 ? ram_size - 1 - rng() % 64 : rng();
+        for (int b = addr_bits - 8; b >= 0; b -= 8) mosi.push_back(addr >> b);
+        const uint32_t len = rng() % 16 == 0 ? rng() % 512 : rng() % 32;
+        for (uint32_t i = 0; i < len; ++i) mosi.push_back(rng());
+
+        const uint32_t parts = rng() % 4 == 0 ? 1 + rng() % 3 : 1;
+        uint32_t sent = 0;
+        for (uint32_t p = 1; p <= parts; ++p) {
+            const uint32_t end = p == parts ? mosi.size() : sent + rng() % (mosi.size() - sent + 1);
+            add_request(r, &mosi[sent], end - sent, p != parts);
+            sent = end;
+        }
+    }
+    return r;
+}
+
+// Run the requests in process, as a client calling VirtualSram directly would
+std::vector<uint8_t> run_in_process(VirtualSram& ram, const Requests& r) {
+    std::vector<uint8_t> miso(r.miso_bytes);
+    size_t pos = 0, out = 0;
+    bool cs_low = false;
+    while (pos < r.stream.size()) {
+        const uint8_t* s = &r.stream[pos];
+        const uint32_t h = s[0] | s[1] << 8 | s[2] << 16 | (uint32_t)s[3] << 24;
+        const uint32_t len = h & ~HOLD_CS;
+        if (!cs_low) ram.begin();
+        ram.exchange(s + 4, &miso[out], len);
+        cs_low = h & HOLD_CS;
+        if (!cs_low) ram.end();
+        pos += 4 + len;
+        out += len;
+    }
+    return miso;
+}
+
+// Run the requests through serve() over a socket pair, with the requests
+// written ahead of the replies as a pipelining client would
+std::vector<uint8_t> run_over_socket(VirtualSram& ram, const Requests& r) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) throw std::runtime_error("socketpair failed");
+    std::thread server([&] {
+        serve(ram, sv[1], sv[1]);
+        close(sv[1]);
+    });
+    std::thread writer([&] {
+        write_all(sv[0], r.stream.data(), r.stream.size());
+        shutdown(sv[0], SHUT_WR);
+    });
+    std::vector<uint8_t> miso(r.miso_bytes);
+    size_t have = 0;
+    while (have < miso.size()) {
+        ssize_t n = read(sv[0], &miso[have], miso.size() - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+    }
+    writer.join();
+    server.join();
+    close(sv[0]);
+    miso.resize(have);
+    return miso;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int run_check(const Options& opt) {
+    std::mt19937 rng(opt.seed);
+    VirtualSram direct(opt.addr_bits), served(opt.addr_bits);
+    for (uint32_t i = 0; i < direct.size(); ++i) direct.ram()[i] = served.ram()[i] = rng();
+
+    const Requests r = random_requests(200000, opt.addr_bits, direct.size(), rng);
+    const std::vector<uint8_t> expected = run_in_process(direct, r);
+    const std::vector<uint8_t> got = run_over_socket(served, r);
+
+    bool ok = true;
+    if (got != expected) {
+        printf("MISO over the socket differs from in process\n");
+        ok = false;
+    }
+    if (memcmp(direct.ram(), served.ram(), direct.size()) != 0) {
+        printf("RAM served over the socket differs from in process\n");
+        ok = false;
+    }
+
+    // And a WRITE reads back
+    const int addr_bytes = opt.addr_bits / 8;
+    std::vector<uint8_t> write(1 + addr_bytes), read(2 + addr_bytes + 3), in(read.size());
+    write[0] = SIM_SRAM_WRITE_CMD;
+    write.insert(write.end(), {0x12, 0x34, 0x56});
+    read[0] = SIM_SRAM_FAST_READ_CMD;
+    direct.transfer(write.data(), nullptr, write.size());
+    direct.transfer(read.data(), in.data(), read.size());
+    if (memcmp(&in[2 + addr_bytes], &write[1 + addr_bytes], 3) != 0) {
+        printf("A FAST READ doesn't return the bytes written\n");
+        ok = false;
+    }
+
+    printf("%llu transactions, %s\n", (unsigned long long)r.transactions, ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// READs and WRITEs of 8 bytes, as a driver's throughput test might send
+int run_bench(const Options& opt) {
+    std::mt19937 rng(opt.seed);
+    VirtualSram ram(opt.addr_bits);
+    Requests r;
+    const int addr_bytes = opt.addr_bits / 8;
+    std::vector<uint8_t> mosi(1 + addr_bytes + 8);
+    for (uint32_t t = 0; t < opt.bench; ++t) {
+        mosi[0] = rng() % 2 ? SIM_SRAM_READ_CMD : SIM_SRAM_WRITE_CMD;
+        for (int b = 1; b <= addr_bytes; ++b) mosi[b] = rng();
+        add_request(r, mosi.data(), mosi.size(), false);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    run_in_process(ram, r);
+    const double in_process = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    run_over_socket(ram, r);
+    const double socket = seconds_since(start);
+
+    printf("%u transactions of 8 bytes\n", opt.bench);
+    printf("In process  %8.2f M transactions/s\n", opt.bench / in_process / 1e6);
+    printf("Socket      %8.2f M transactions/s\n", opt.bench / socket / 1e6);
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    try {
+        if (!parse_options(argc, argv, opt)) return 1;
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    if (opt.check) return run_check(opt);
+    if (opt.bench) return run_bench(opt);
+
+    VirtualSram ram(opt.addr_bits);
+    if (opt.pty) return serve_pty(ram);
+    if (opt.stdio) {
+        serve(ram, STDIN_FILENO, STDOUT_FILENO);
+        return 0;
+    }
+    return serve_socket(ram, opt.socket_path);
+}
@@ -3,6 +3,9 @@
 #include <hardware/pio.h>
 #include <hardware/dma.h>
 #include <pico/multicore.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "hardware/sync.h"
 #include "hardware/structs/bus_ctrl.h"
 
 #include "sram.pio.h"
@@ -11,21 +14,502 @@
 
 // We define the SMs and DMA channels to avoid memory accesses
 // looking them up which saves precious cycles processing the SPI commands.
-#define pio_write_offset 0  // This must be 0
+#define pio_write_offset SIM_SRAM_pio_write_offset
 
 static int pio_read_offset;
+static uint16_t pio_read_jmp;  // jmp to the start of the read program, for reset_pios()
 
-uint8_t __attribute__((section(".spi_ram.emu_ram"))) emu_ram[65536];
+// read_cmd, and the patch skipping the command in continuous read mode.
+// sram_read_24 pushes the top 7 bits of the address with the command.
+#if SIM_SRAM_ADDR_BITS == 24
+#define sram_read_prog sram_read_24_program
+#define sram_read_prog_init sram_read_24_program_init
+#define sram_read_prog_offset_read_cmd sram_read_24_offset_read_cmd
+#define read_cmd_instr pio_encode_set(pio_x, 14)
+#define read_cmd_continuous_instr pio_encode_set(pio_x, 6)
+#else
+#define sram_read_prog sram_read_program
+#define sram_read_prog_init sram_read_program_init
+#define sram_read_prog_offset_read_cmd sram_read_offset_read_cmd
+#define read_cmd_instr pio_encode_set(pio_x, 7)
+#define read_cmd_continuous_instr pio_encode_jmp(pio_read_offset + sram_read_offset_read_cmd_end)
+#endif
+
+// Clocks the write SM counts before branching on the last 2 bits of the
+// address: the command and all but the last address bit.
+#define cmd_addr_clocks (8 + SIM_SRAM_ADDR_BITS - 1)
+
+#define SIM_SRAM_MULTI_IO (SIM_SRAM_ENABLE_SDI || SIM_SRAM_ENABLE_SQI)
+
+#if SIM_SRAM_ENABLE_FLASH
+// Address bit 23, in the top 7 bits pushed with the command
+#define is_flash_addr(addr_top) ((addr_top) & 0x40)
+
+// The read SM prefixes the low 17 bits of the address for the RAM, so
+// replace the prefix with the rest of the address and the flash base.
+static __always_inline uint32_t flash_addr(uint32_t addr_top, uint32_t addr) {
+    return SIM_SRAM_FLASH_BASE + ((addr_top & 0x3f) << 17) + (addr & 0x1ffff);
+}
+
+// The end of the flash region, the top half of the 24-bit address space
+#define flash_region_end (SIM_SRAM_FLASH_BASE + 0x800000)
+#endif
+
+// The read program is placed by pio_add_program(), the write program at
+// SIM_SRAM_pio_write_offset, and every patch to it is relative to that.
+_Static_assert(pio_write_offset + count_of(sram_write_program_instructions) <= PIO_INSTRUCTION_COUNT, "The write program doesn't fit at SIM_SRAM_pio_write_offset");
+
+#if SIM_SRAM_MULTI_IO
+// The SDI and SQI programs are loaded over the SPI programs when switching mode
+_Static_assert(count_of(sram_dual_read_program_instructions) <= count_of(sram_read_program_instructions), "SDI read program too large");
+_Static_assert(count_of(sram_dual_write_program_instructions) <= count_of(sram_write_program_instructions), "SDI write program too large");
+_Static_assert(count_of(sram_quad_read_program_instructions) <= count_of(sram_read_program_instructions), "SQI read program too large");
+_Static_assert(count_of(sram_quad_write_program_instructions) <= count_of(sram_write_program_instructions), "SQI write program too large");
+
+#if SIM_SRAM_ENABLE_SQI
+#define data_pins_mask (0xfu << SIM_SRAM_SPI_SIO3)
+#else
+#define data_pins_mask (3u << SIM_SRAM_SPI_MISO)
+#endif
+
+static pio_sm_config spi_read_config, spi_write_config;
+#endif
+#if SIM_SRAM_ENABLE_SDI
+static pio_sm_config dual_read_config, dual_write_config;
+#endif
+#if SIM_SRAM_ENABLE_SQI
+static pio_sm_config quad_read_config, quad_write_config;
+#endif
+
+uint8_t __attribute__((section(".spi_ram.emu_ram"))) emu_ram[SIM_SRAM_SIZE * SIM_SRAM_NUM_DEVICES];
+
+// The read SM prepends the top bits of the address of the RAM, from Y, to
+// the received address.  The SDI and SQI programs read Y bit reversed.
+#if SIM_SRAM_ADDR_BITS == 24
+#define ram_addr_prefix (SIM_SRAM_RAM_BASE >> 17)
+#else
+#define ram_addr_prefix (SIM_SRAM_RAM_BASE >> 16)
+#endif
+// SDI and SQI only work with 16-bit addresses, so the prefix is 16 bits
+#define bit_reverse_2(x) ((((x) & 0x5555) << 1) | (((x) >> 1) & 0x5555))
+#define bit_reverse_4(x) ((((x) & 0x3333) << 2) | (((x) >> 2) & 0x3333))
+#define bit_reverse_8(x) ((((x) & 0x0f0f) << 4) | (((x) >> 4) & 0x0f0f))
+#define bit_reverse_16(x) ((((x) & 0x00ff) << 8) | (((x) >> 8) & 0x00ff))
+#define ram_addr_prefix_reversed bit_reverse_16(bit_reverse_8(bit_reverse_4(bit_reverse_2(SIM_SRAM_RAM_BASE >> 16))))
+
+#if SIM_SRAM_NUM_DEVICES > 1
+// Each device's read SM has the address of its RAM in Y
+#define device_addr_prefix(device) (ram_addr_prefix + (device))
+
+// The RX FIFO empty flags in FSTAT of a device's read SM, and of all of them
+#define device_rx_empty(sm) (1u << (PIO_FSTAT_RXEMPTY_LSB + (sm)))
+#define devices_rx_empty (((1u << SIM_SRAM_NUM_DEVICES) - 1) << (PIO_FSTAT_RXEMPTY_LSB + SIM_SRAM_pio_read_sm))
+
+// The CS of each device, and the CTRL of the receive and address channels
+// reading its read SM.  Not const, so that they are in RAM rather than behind
+// the XIP cache.
+static uint32_t device_cs[3] = {SIM_SRAM_SPI_CS, SIM_SRAM_SPI_CS1, SIM_SRAM_SPI_CS2};
+static uint32_t device_rx_ctrl[SIM_SRAM_NUM_DEVICES];
+static uint32_t device_tx2_ctrl[SIM_SRAM_NUM_DEVICES];
+#endif
+
+#if SIM_SRAM_ENABLE_PERSIST
+#define num_sectors (SIM_SRAM_SIZE / FLASH_SECTOR_SIZE)
+
+// The number of WRITEs to each sector.  Only core1 writes sector_writes, and
+// only core0 writes sector_writes_persisted, so no lock is needed: a sector is
+// dirty while the two differ.
+static volatile uint32_t sector_writes[num_sectors];
+static uint32_t sector_writes_persisted[num_sectors];
+static uint8_t persist_buf[FLASH_SECTOR_SIZE];
+
+static __always_inline void mark_sectors_written(uint32_t start, uint32_t end) {
+    uint32_t last = (end - 1 - (uint32_t)emu_ram) / FLASH_SECTOR_SIZE;
+    for (uint32_t s = (start - (uint32_t)emu_ram) / FLASH_SECTOR_SIZE; s <= last; ++s) {
+        ++sector_writes[s];
+    }
+}
+#endif
+
+#if SIM_SRAM_ENABLE_WRITE_EVENTS
+_Static_assert((SIM_SRAM_WRITE_EVENT_QUEUE_LEN & (SIM_SRAM_WRITE_EVENT_QUEUE_LEN - 1)) == 0, "Write event queue length must be a power of 2");
+
+// Only core1 writes write_event_head and only core0 writes write_event_tail.
+// When the queue is full core1 drops the event, rather than waiting.
+static sim_sram_write_event_t write_events[SIM_SRAM_WRITE_EVENT_QUEUE_LEN];
+static volatile uint32_t write_event_head, write_event_tail;
+static uint32_t write_event_seq;
+
+static __always_inline void push_write_event(uint32_t start, uint32_t end) {
+    uint32_t seq = write_event_seq++;
+    uint32_t head = write_event_head;
+    if (head - write_event_tail == SIM_SRAM_WRITE_EVENT_QUEUE_LEN) return;
+
+    sim_sram_write_event_t* event = &write_events[head & (SIM_SRAM_WRITE_EVENT_QUEUE_LEN - 1)];
+    event->addr = start - (uint32_t)emu_ram;
+    event->len = end - start;
+    event->seq = seq;
+
+    // The M0+ doesn't reorder stores, so the event is complete before core0 can see the head move
+    __compiler_memory_barrier();
+    write_event_head = head + 1;
+}
+#endif
+
+#if SIM_SRAM_ENABLE_PERSIST || SIM_SRAM_ENABLE_WRITE_EVENTS
+#define SIM_SRAM_RECORD_WRITES 1
+
+// Record a WRITE from start up to, but not including, end.  This is done
+// after the PIOs are re-armed, as the next command has time for it before
+// core1 needs its command byte.
+static __always_inline void record_write(uint32_t start, uint32_t end) {
+    if (end == start) return;
+#if SIM_SRAM_ENABLE_PERSIST
+    mark_sectors_written(start, end);
+#endif
+#if SIM_SRAM_ENABLE_WRITE_EVENTS
+    push_write_event(start, end);
+#endif
+}
+#else
+#define SIM_SRAM_RECORD_WRITES 0
+#endif
+
+#if SIM_SRAM_ENABLE_STATS
+// Only core1 writes the statistics
+static sim_sram_stats_t stats;
+
+// Count a transaction.  Like record_write() this is done after the PIOs
+// are re-armed, as the next command has time for it.
+static __always_inline void update_stats(uint32_t command, uint32_t polls, uint32_t bytes) {
+    sim_sram_command_stats_t* s = &stats.command[command];
+    ++s->count;
+    s->bytes += bytes;
+
+    uint32_t bucket = 0;
+    while (bucket < SIM_SRAM_STATS_BUCKETS - 1 && polls >= (16u << bucket)) ++bucket;
+    ++s->cs_low[bucket];
+}
+#else
+#define update_stats(command, polls, bytes) ((void)(command), (void)(polls), (void)(bytes))
+#endif
+
+#if SIM_SRAM_ENABLE_CRC
+// Sent by the CRC read command, with the transmit DMA channel set up as for
+// FAST READ: 4 bytes of 1 while the CRC is running, otherwise 0, then the CRC
+// most significant byte first.
+static uint32_t __attribute__((aligned(8))) crc_status[2];
+static uint8_t crc_sink;
+
+static __always_inline void update_crc_status() {
+    // Busy is read first, so the CRC is final if it is clear
+    uint32_t busy = (dma_hw->ch[SIM_SRAM_crc_channel].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS) ? 0x01010101 : 0;
+    crc_status[1] = __builtin_bswap32(dma_hw->sniff_data);
+    crc_status[0] = busy;
+}
+
+// Start a CRC of len bytes from addr, stopping one already running.  The
+// range is clipped to end, the end of the RAM or of the flash region.
+static __always_inline void start_crc(uint32_t addr, uint32_t end, uint32_t len) {
+    uint32_t max_len = end - addr;
+    if (len > max_len) len = max_len;
+
+    dma_channel_abort(SIM_SRAM_crc_channel);
+    dma_hw->sniff_data = 0xffffffff;
+    dma_hw->ch[SIM_SRAM_crc_channel].read_addr = addr;
+    dma_hw->ch[SIM_SRAM_crc_channel].al1_transfer_count_trig = len;
+}
+#endif
+
+#define SIM_SRAM_STATUS_READS (SIM_SRAM_ENABLE_CRC || SIM_SRAM_ENABLE_BULK)
+#define is_status_read(cmd) ((SIM_SRAM_ENABLE_CRC && (cmd) == SIM_SRAM_CRC_READ_CMD) || \
+                             (SIM_SRAM_ENABLE_BULK && (cmd) == SIM_SRAM_BULK_STATUS_CMD))
+
+#if SIM_SRAM_ENABLE_BULK
+// Sent by the bulk status command, as crc_status: 4 bytes of 1 while a
+// FILL or COPY is running, otherwise 0, then the bytes remaining.
+static uint32_t __attribute__((aligned(8))) bulk_status[2];
+static uint32_t fill_value;
+static uint32_t bulk_ctrl;  // The bulk channel's CTRL, without the size or read increment
+
+static __always_inline void update_bulk_status() {
+    uint32_t ctrl = dma_hw->ch[SIM_SRAM_bulk_channel].ctrl_trig;
+    uint32_t size_shift = (ctrl & DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS) >> DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB;
+    bulk_status[1] = __builtin_bswap32(dma_hw->ch[SIM_SRAM_bulk_channel].transfer_count << size_shift);
+    bulk_status[0] = (ctrl & DMA_CH0_CTRL_TRIG_BUSY_BITS) ? 0x01010101 : 0;
+}
+
+// Start the bulk channel, which must be stopped, copying len bytes from src
+// to dst, or filling them from the word at src if not copy.  The range is
+// clipped to the end of the RAM, and the largest transfer size the addresses
+// and length allow is used.  Returns the clipped length.
+static __always_inline uint32_t start_bulk(uint32_t dst, uint32_t src, uint32_t len, bool copy) {
+    uint32_t last = (copy && src > dst) ? src : dst;
+    uint32_t max_len = (uint32_t)emu_ram + SIM_SRAM_SIZE - last;
+    if (len > max_len) len = max_len;
+
+    uint32_t align = dst | len | (copy ? src : 0);
+    uint32_t size_shift = (align & 1) ? 0 : ((align & 2) ? 1 : 2);
+    dma_hw->ch[SIM_SRAM_bulk_channel].read_addr = src;
+    dma_hw->ch[SIM_SRAM_bulk_channel].write_addr = dst;
+    dma_hw->ch[SIM_SRAM_bulk_channel].transfer_count = len >> size_shift;
+    dma_hw->ch[SIM_SRAM_bulk_channel].ctrl_trig = bulk_ctrl | (size_shift << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB) |
+                                                  (copy ? DMA_CH0_CTRL_TRIG_INCR_READ_BITS : 0);
+    return len;
+}
+
+// Reads up to n bytes sent after the address, most significant first,
+// stopping early if CS goes high.  Returns the number of bytes read.
+static __always_inline uint32_t get_bulk_args(uint32_t* value, uint32_t n) {
+    uint32_t count = 0;
+    *value = 0;
+    while (count < n) {
+        // Any byte pushed before CS went high is in the FIFO by now
+        bool cs_high = gpio_get(SIM_SRAM_SPI_CS);
+        while (count < n && !pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm)) {
+            *value = (*value << 8) | (SIM_SRAM_pio_read->rxf[SIM_SRAM_pio_read_sm] & 0xff);
+            ++count;
+        }
+        if (cs_high) break;
+    }
+    return count;
+}
+#endif
+
+#if SIM_SRAM_STATUS_READS
+// Update the status block for a status read, before its address arrives.
+// Returns NULL for a FAST READ.
+static __always_inline uint32_t* update_status_block(uint32_t cmd) {
+#if SIM_SRAM_ENABLE_CRC
+    if (cmd == SIM_SRAM_CRC_READ_CMD) {
+        update_crc_status();
+        return crc_status;
+    }
+#endif
+#if SIM_SRAM_ENABLE_BULK
+    if (cmd == SIM_SRAM_BULK_STATUS_CMD) {
+        update_bulk_status();
+        return bulk_status;
+    }
+#endif
+    return NULL;
+}
+#endif
+
+// Whether reads and writes can wrap within a block of the RAM
+#define SIM_SRAM_WRAP (SIM_SRAM_ENABLE_MODE_REGISTER || SIM_SRAM_ENABLE_PSRAM_SPI)
+
+#if SIM_SRAM_WRAP
+// The size of the block reads and writes wrap within, 0 if they don't wrap.
+// Only core1 uses it.
+static uint32_t wrap_size;
+
+// Wrap reads and writes within blocks of 1 << bits bytes, or not at all if
+// bits is 0.  The transmit channel wraps its reads, and the receive channel
+// its writes, with the DMA ring.  The channels must be stopped.
+static __always_inline void set_wrap(uint32_t bits) {
+    wrap_size = bits ? 1u << bits : 0;
+    hw_clear_bits(&dma_hw->ch[SIM_SRAM_rx_channel].al1_ctrl, DMA_CH0_CTRL_TRIG_RING_SIZE_BITS);
+    hw_clear_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, DMA_CH0_CTRL_TRIG_RING_SIZE_BITS);
+    hw_set_bits(&dma_hw->ch[SIM_SRAM_rx_channel].al1_ctrl, bits << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB);
+    hw_set_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, bits << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB);
+}
+#endif
+
+#if SIM_SRAM_ENABLE_MODE_REGISTER
+// The DMA ring size for a page, as a power of 2
+#define page_ring_bits 5
+_Static_assert(SIM_SRAM_PAGE_SIZE == 1 << page_ring_bits, "page_ring_bits must match the page size");
+
+// Only core1 uses the mode register
+static uint32_t mode_reg = SIM_SRAM_MODE_SEQUENTIAL;
+#define page_mode() (!(mode_reg & SIM_SRAM_MODE_SEQUENTIAL))
+
+// X in the read SM once it has read the 8 bits of the mode byte of a WRMR with
+// 16-bit addresses, as it counts down from 12 after the first.  It is less if
+// more bits were sent, and more if fewer were, which the low 4 bits of X are
+// enough to tell.
+#define wrmr_mode_x (12 - 7)
+
+// Set the mode register.  Outside sequential mode reads and writes wrap
+// within the page.  Byte mode can't be emulated, as the DMA ring is at least
+// 2 bytes, so it is ignored and the mode is unchanged.  The channels must be
+// stopped.
+static __always_inline void set_mode(uint32_t mode) {
+    if (!(mode & 0xc0)) return;
+    mode_reg = mode & 0xc0;
+    set_wrap(page_mode() ? page_ring_bits : 0);
+}
+#endif
+
+#if SIM_SRAM_ENABLE_PSRAM_SPI
+// The DMA ring sizes for the APS6404's 1kB and 32 byte wrap, as powers of 2
+#define psram_ring_bits_1k 10
+#define psram_ring_bits_32 5
+
+// Sent by read ID.  Not const, so that it is in RAM rather than behind the XIP cache.
+static uint8_t __attribute__((aligned(8))) psram_id[8] = SIM_SRAM_PSRAM_ID;
+#endif
+
+// Start the receive channel writing the data of a WRITE to addr.  Unless
+// the write wraps within a block, the count stops the channel at the end of
+// the RAM, so data past the end is discarded rather than overwriting core1's
+// code in scratch X, which follows the RAM.  Returns the count.
+static __always_inline uint32_t start_write(uint32_t addr) {
+    uint32_t count = SIM_SRAM_SIZE - (addr & (SIM_SRAM_SIZE - 1));
+#if SIM_SRAM_WRAP
+    if (wrap_size) count = SIM_SRAM_SIZE;
+#endif
+    dma_hw->ch[SIM_SRAM_rx_channel].transfer_count = count;
+    dma_hw->ch[SIM_SRAM_rx_channel].al2_write_addr_trig = addr;
+    return count;
+}
+
+// Wait for the receive channel to take the last of a WRITE's data from a
+// read SM's FIFO.  The channel stops with data left in the FIFO if it
+// reached the end of the RAM.
+static __always_inline void drain_write(uint sm) {
+    while (!pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, sm) && dma_channel_is_busy(SIM_SRAM_rx_channel));
+}
+
+#if SIM_SRAM_RECORD_WRITES
+// Record a WRITE of len bytes from addr.  A WRITE past the end of the block
+// it wraps within wraps to its start, so the whole block is recorded.
+static __always_inline void record_write_len(uint32_t addr, uint32_t len) {
+#if SIM_SRAM_WRAP
+    if (wrap_size && len > wrap_size - (addr & (wrap_size - 1))) {
+        addr &= ~(wrap_size - 1);
+        len = wrap_size;
+    }
+#endif
+    record_write(addr, addr + len);
+}
+#endif
+
+#if SIM_SRAM_ENABLE_DOORBELL
+_Static_assert((SIM_SRAM_DOORBELL_QUEUE_LEN & (SIM_SRAM_DOORBELL_QUEUE_LEN - 1)) == 0, "Doorbell queue length must be a power of 2");
+
+// Like the write events, only core1 writes doorbell_head and only core0
+// writes doorbell_tail, and core1 drops the doorbell when the queue is full.
+static sim_sram_doorbell_t doorbells[SIM_SRAM_DOORBELL_QUEUE_LEN];
+static volatile uint32_t doorbell_head, doorbell_tail;
+static uint32_t doorbell_seq;
+
+// Ring the doorbell if the last byte of a WRITE of len bytes from addr is
+// in a doorbell window.  This is done after the rx channel is aborted, so
+// the word is complete, and after the PIOs are re-armed, like record_write().
+static __always_inline void check_doorbell(uint32_t addr, uint32_t len) {
+    if (len == 0) return;
+    uint32_t last = addr + len - 1;
+#if SIM_SRAM_WRAP
+    if (wrap_size) last = (addr & ~(wrap_size - 1)) | (last & (wrap_size - 1));
+#endif
+    // Each device has its own window
+    uint32_t offset = last - (uint32_t)emu_ram;
+    if ((offset & (SIM_SRAM_SIZE - 1)) - SIM_SRAM_DOORBELL_ADDR >= SIM_SRAM_DOORBELL_SIZE) return;
+
+    uint32_t seq = doorbell_seq++;
+    uint32_t head = doorbell_head;
+    if (head - doorbell_tail == SIM_SRAM_DOORBELL_QUEUE_LEN) return;
+
+    sim_sram_doorbell_t* doorbell = &doorbells[head & (SIM_SRAM_DOORBELL_QUEUE_LEN - 1)];
+    doorbell->addr = offset & ~3;
+    doorbell->value = *(uint32_t*)(last & ~3);
+    doorbell->seq = seq;
+
+    __compiler_memory_barrier();
+    doorbell_head = head + 1;
+
+    // Wake core0 if it is waiting in __wfe()
+    __sev();
+}
+#endif
+
+#if SIM_SRAM_ENABLE_SNAPSHOT
+// Only core1 writes the snapshot state, and it is read by core0 without a
+// lock, like a seqlock.  The M0+ doesn't reorder stores, so each store is
+// seen by core0 in the order core1 makes it.
+static volatile struct {
+    uint32_t gen;         // Odd while a WRITE is in progress
+    uint32_t active_low;  // The lowest address the WRITE in progress can change, 0 until its address arrives
+    uint32_t last_start;  // The range the last WRITE, FILL or COPY changed
+    uint32_t last_end;
+} snapshot;
+
+// Called when the WRITE command arrives, while the address is received
+static __always_inline void begin_snapshot_write() {
+    snapshot.active_low = 0;
+    snapshot.gen = snapshot.gen + 1;
+}
+
+// Called once the receive channel is armed, before any data arrives
+static __always_inline void set_snapshot_write_addr(uint32_t addr) {
+#if SIM_SRAM_WRAP
+    if (wrap_size) addr &= ~(wrap_size - 1);
+#endif
+    snapshot.active_low = addr;
+}
+
+static __always_inline void end_snapshot_range(uint32_t start, uint32_t end) {
+    snapshot.last_start = start;
+    snapshot.last_end = end;
+    snapshot.gen = snapshot.gen + 1;
+}
+
+// Called after the PIOs are re-armed, with the range recorded as for
+// record_write_len()
+static __always_inline void end_snapshot_write(uint32_t addr, uint32_t len) {
+#if SIM_SRAM_WRAP
+    if (wrap_size && len > wrap_size - (addr & (wrap_size - 1))) {
+        addr &= ~(wrap_size - 1);
+        len = wrap_size;
+    }
+#endif
+    end_snapshot_range(addr, addr + len);
+}
+#endif
 
 static void setup_sram_pio()
 {
-    pio_read_offset = pio_add_program(SIM_SRAM_pio_read, &sram_read_program);
+    pio_read_offset = pio_add_program(SIM_SRAM_pio_read, &sram_read_prog);
+    pio_read_jmp = pio_encode_jmp(pio_read_offset);
     pio_sm_claim(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
     pio_add_program_at_offset(SIM_SRAM_pio_write, &sram_write_program, pio_write_offset);
     pio_sm_claim(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm);
 
-    sram_read_program_init(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_read_offset, SIM_SRAM_SPI_MOSI);
+    // The write program is assembled for 16-bit addresses
+    SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_cmd_addr_count] = pio_encode_set(pio_x, cmd_addr_clocks - 1);
+
+#if SIM_SRAM_NUM_DEVICES > 1
+    // Each read SM loops on its CS, the jmp pin, rather than waiting for CS pin 2
+    SIM_SRAM_pio_read->instr_mem[pio_read_offset] = pio_encode_jmp_pin(pio_read_offset);
+    for (uint device = 0; device < SIM_SRAM_NUM_DEVICES; ++device) {
+        if (device) pio_sm_claim(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm + device);
+        sram_read_device_program_init(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm + device, pio_read_offset,
+                                      SIM_SRAM_SPI_MOSI, device_cs[device], device_addr_prefix(device));
+    }
+
+    // The write SM serves every device, so starts counting clocks straight away
+    SIM_SRAM_pio_write->instr_mem[pio_write_offset] = pio_encode_wait_pin(false, 1);
+#else
+    sram_read_prog_init(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_read_offset, SIM_SRAM_SPI_MOSI, ram_addr_prefix);
+#endif
     sram_write_program_init(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, pio_write_offset, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MISO);
+
+#if SIM_SRAM_MULTI_IO
+    spi_read_config = sram_read_program_get_config(pio_read_offset, SIM_SRAM_SPI_MOSI);
+    spi_write_config = sram_write_program_get_config(pio_write_offset, SIM_SRAM_SPI_MOSI, SIM_SRAM_SPI_MISO);
+#endif
+#if SIM_SRAM_ENABLE_SDI
+    sram_data_pins_init(SIM_SRAM_pio_write, SIM_SRAM_SPI_MISO, 2);
+    dual_read_config = sram_dual_read_program_get_config(pio_read_offset, SIM_SRAM_SPI_MISO);
+    dual_write_config = sram_dual_write_program_get_config(pio_write_offset, SIM_SRAM_SPI_MISO);
+#endif
+#if SIM_SRAM_ENABLE_SQI
+    sram_data_pins_init(SIM_SRAM_pio_write, SIM_SRAM_SPI_SIO3, 4);
+    quad_read_config = sram_quad_read_program_get_config(pio_read_offset, SIM_SRAM_SPI_SIO3);
+    quad_write_config = sram_quad_write_program_get_config(pio_write_offset, SIM_SRAM_SPI_SIO3);
+#endif
 }
 
 static void setup_rx_channel()
@@ -37,13 +521,19 @@ static void setup_rx_channel()
     channel_config_set_read_increment(&c, false);
     channel_config_set_write_increment(&c, true);
     channel_config_set_dreq(&c, pio_get_dreq(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, false));
+    // So other DMA channels, like the CRC channel, never delay the SPI data
+    channel_config_set_high_priority(&c, true);
+#if SIM_SRAM_WRAP
+    // The ring wraps the write address, its size is set by set_wrap()
+    channel_config_set_ring(&c, true, 0);
+#endif
 
     dma_channel_configure(
         SIM_SRAM_rx_channel,          // Channel to be configured
         &c,            // The configuration we just created
         NULL,           // The initial write address
         &SIM_SRAM_pio_read->rxf[SIM_SRAM_pio_read_sm],           // The initial read address
-        65536, // Number of transfers; in this case each is 1 byte.
+        SIM_SRAM_SIZE, // Number of transfers; in this case each is 1 byte.
         false           // Start immediately.
     );
 }
@@ -59,13 +549,14 @@ static void setup_tx_channel()
     channel_config_set_write_increment(&c, false);
     channel_config_set_bswap(&c, true);
     channel_config_set_dreq(&c, pio_get_dreq(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, true));
+    channel_config_set_high_priority(&c, true);
 
     dma_channel_configure(
         SIM_SRAM_tx_channel,          // Channel to be configured
         &c,            // The configuration we just created
         &SIM_SRAM_pio_write->txf[SIM_SRAM_pio_write_sm],           // The initial write address
         NULL,           // The initial read address
-        65536, // Number of transfers; in this case each is 1 byte.
+        SIM_SRAM_SIZE, // Number of transfers; in this case each is 1 byte.
         false           // Start immediately.
     );
 
@@ -74,6 +565,7 @@ static void setup_tx_channel()
     channel_config_set_read_increment(&c, false);
     channel_config_set_write_increment(&c, false);
     channel_config_set_dreq(&c, pio_get_dreq(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, false));
+    channel_config_set_high_priority(&c, true);
 
     dma_channel_configure(
         SIM_SRAM_tx_channel2,          // Channel to be configured
@@ -85,89 +577,1062 @@ static void setup_tx_channel()
     );
 }
 
-static __always_inline void wait_for_cs_high() {
+#if SIM_SRAM_ENABLE_CRC
+static void setup_crc_channel()
+{
+    dma_channel_claim(SIM_SRAM_crc_channel);
+
+    dma_channel_config c = dma_channel_get_default_config(SIM_SRAM_crc_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+
+    dma_channel_configure(
+        SIM_SRAM_crc_channel,
+        &c,
+        &crc_sink,      // The data is only needed by the sniffer
+        emu_ram,
+        0,
+        false
+    );
+
+    // Bit reversed data, and a reversed and inverted result, is the CRC32 used by zlib
+    dma_sniffer_enable(SIM_SRAM_crc_channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, false);
+    hw_set_bits(&dma_hw->sniff_ctrl, DMA_SNIFF_CTRL_OUT_REV_BITS | DMA_SNIFF_CTRL_OUT_INV_BITS);
+}
+#endif
+
+#if SIM_SRAM_ENABLE_BULK
+static void setup_bulk_channel()
+{
+    dma_channel_claim(SIM_SRAM_bulk_channel);
+
+    dma_channel_config c = dma_channel_get_default_config(SIM_SRAM_bulk_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    bulk_ctrl = channel_config_get_ctrl_value(&c);
+}
+#endif
+
+// Returns the number of times CS was polled, if the statistics are enabled.
+static __always_inline uint32_t wait_for_device_cs_high(uint cs) {
+    uint32_t polls = 0;
     while (true) {
-        if (gpio_get(SIM_SRAM_SPI_CS)) {
-            if (gpio_get(SIM_SRAM_SPI_CS)) {
+        if (gpio_get(cs)) {
+            if (gpio_get(cs)) {
                 // Must be high for 2 cycles to count - avoids deselecting on a glitch.
                 break;
             }
         }
+#if SIM_SRAM_ENABLE_STATS
+        ++polls;
+#endif
+    }
+    return polls;
+}
+
+static __always_inline uint32_t wait_for_cs_high() {
+    return wait_for_device_cs_high(SIM_SRAM_SPI_CS);
+}
+
+// Wait for the command, or the word in its place in continuous read mode.
+// Returns false if the master aborted during the command: CS went high after
+// the read SM left its wait for CS, before the command was pushed.  The FIFO
+// is checked first, and the SM's address is only read while CS is high, so
+// the checks add little to the time to pick up a command.
+static __always_inline bool wait_for_cmd(uint32_t* cmd) {
+    while (pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm)) {
+        // Must be high for 2 reads to count, as in wait_for_cs_high(), so a
+        // transaction starting as the address is read isn't taken for an abort
+        if (gpio_get(SIM_SRAM_SPI_CS) &&
+            SIM_SRAM_pio_read->sm[SIM_SRAM_pio_read_sm].addr != (uint)pio_read_offset &&
+            gpio_get(SIM_SRAM_SPI_CS) &&
+            pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm)) {
+            return false;
+        }
     }
+    *cmd = SIM_SRAM_pio_read->rxf[SIM_SRAM_pio_read_sm];
+    return true;
+}
+
+#if SIM_SRAM_ENABLE_PSRAM_SPI
+// X in the read SM once it has read the 8 clocks of a short command, as it
+// counts down from 14 to the push of the command and the top of the address
+#define psram_short_cmd_x (14 - 8)
+
+// Wait for the command.  With 24-bit addresses the read SM pushes it after
+// 15 clocks, but the wrap boundary toggle and reset are only 8, so if CS goes
+// high first the bits read are pushed and returned as if they were the
+// command with an address of 0.  The read SM's X gives the number of bits,
+// so the low bits of X are shifted in below them to push both in one word,
+// and a command cut short before all 8 are read returns false as an abort.
+static __always_inline bool get_cmd(uint32_t* cmd) {
+    if (wait_for_cmd(cmd)) return true;
+
+    pio_sm_exec(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_encode_in(pio_x, 4));
+    pio_sm_exec(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_encode_push(false, false));
+    uint32_t bits = pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
+    *cmd = (bits >> 4) << 7;
+    return (bits & 0xf) == psram_short_cmd_x;
+}
+#endif
+
+// pio_sm_get_blocking() for the address and the other words before the data,
+// from the read SM of the device with the given CS.  Returns false if CS goes
+// high first, as the master aborted the transaction.  CS is read before the
+// FIFO is checked, so a word pushed just before CS went high is still returned.
+static __always_inline bool get_device_word(uint read_sm, uint cs, uint32_t* value) {
+    while (true) {
+        bool cs_high = gpio_get(cs);
+        if (!pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, read_sm)) {
+            *value = SIM_SRAM_pio_read->rxf[read_sm];
+            return true;
+        }
+        if (cs_high && gpio_get(cs)) return false;
+    }
+}
+
+static __always_inline bool get_word(uint32_t* value) {
+    return get_device_word(SIM_SRAM_pio_read_sm, SIM_SRAM_SPI_CS, value);
+}
+
+// The read SM pushes the address in two parts
+static __always_inline bool get_device_addr(uint read_sm, uint cs, uint32_t* addr) {
+    uint32_t addr_low;
+    if (!get_device_word(read_sm, cs, addr) || !get_device_word(read_sm, cs, &addr_low)) return false;
+    *addr |= addr_low;
+    return true;
+}
+
+static __always_inline bool get_addr(uint32_t* addr) {
+    return get_device_addr(SIM_SRAM_pio_read_sm, SIM_SRAM_SPI_CS, addr);
 }
 
+// Abort the transmit DMA channel.  Returns the bytes it read, if the
+// statistics are enabled: the abort clears the transfer count.
+static __always_inline uint32_t abort_tx_channel() {
+#if SIM_SRAM_ENABLE_STATS
+    uint32_t transferred = SIM_SRAM_SIZE - dma_hw->ch[SIM_SRAM_tx_channel].transfer_count;
+    dma_channel_abort(SIM_SRAM_tx_channel);
+    uint32_t size_shift = (dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl & DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS) >> DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB;
+    return transferred << size_shift;
+#else
+    dma_channel_abort(SIM_SRAM_tx_channel);
+    return 0;
+#endif
+}
+
+// Re-arm the write SM and a read SM for the next command.  Each step is a
+// single store of a constant, using the atomic set/clear/xor register aliases
+// rather than the read-modify-writes in the SDK calls, and the restart and
+// re-enable are done by the same write to CTRL.
+static __always_inline void reset_device_pios(uint read_sm) {
+    hw_clear_bits(&SIM_SRAM_pio_write->ctrl, 1u << SIM_SRAM_pio_write_sm);
+    hw_clear_bits(&SIM_SRAM_pio_read->ctrl, 1u << read_sm);
+
+    // Toggling the join clears the FIFOs, as pio_sm_clear_fifos does
+    hw_xor_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+    hw_xor_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+    hw_xor_bits(&SIM_SRAM_pio_read->sm[read_sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+    hw_xor_bits(&SIM_SRAM_pio_read->sm[read_sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+
+    SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].instr = pio_encode_jmp(pio_write_offset);
+    SIM_SRAM_pio_read->sm[read_sm].instr = pio_read_jmp;
+
+    hw_set_bits(&SIM_SRAM_pio_write->ctrl, (1u << (PIO_CTRL_SM_RESTART_LSB + SIM_SRAM_pio_write_sm)) | (1u << SIM_SRAM_pio_write_sm));
+    hw_set_bits(&SIM_SRAM_pio_read->ctrl, (1u << (PIO_CTRL_SM_RESTART_LSB + read_sm)) | (1u << read_sm));
+}
+
+static __always_inline void reset_pios() {
+    reset_device_pios(SIM_SRAM_pio_read_sm);
+}
+
+// Stop the receive channel and re-arm the PIOs at the end of a WRITE started
+// by start_write(), and return the bytes written.
+static __always_inline uint32_t write_len(uint32_t addr, uint32_t count) {
+#if SIM_SRAM_WRAP
+    // The write address may have wrapped, so the length is taken
+    // from the transfer count, before the abort clears it
+    uint32_t len = count - dma_hw->ch[SIM_SRAM_rx_channel].transfer_count;
+#else
+    (void)count;
+#endif
+    dma_channel_abort(SIM_SRAM_rx_channel);
+
+    // The DMA write address is now the end of the data
+    reset_pios();
+#if !SIM_SRAM_WRAP
+    uint32_t len = dma_hw->ch[SIM_SRAM_rx_channel].write_addr - addr;
+#endif
+    return len;
+}
+
+// The master raised CS before the command and address were complete.  CS is
+// already high, so the PIOs are re-armed straight away.
+static __always_inline void abort_device_transaction(uint read_sm) {
+    reset_device_pios(read_sm);
+    update_stats(SIM_SRAM_STATS_ABORTED, 0, 0);
+}
+
+static __always_inline void abort_transaction() {
+    abort_device_transaction(SIM_SRAM_pio_read_sm);
+}
+
+#if SIM_SRAM_ENABLE_CONTINUOUS_READ
+// The mode byte is sent in place of the dummy byte of a FAST READ, and is
+// pushed by the read SM after the address.  It is read while the data is
+// being sent, so the master must not raise CS before the data starts.
+//
+// In continuous read mode the read SM skips the command and pushes an empty
+// word in its place, or just the top 7 bits of a 24-bit address, and the
+// write SM counts 8 fewer clocks before the data.
+// Both SMs are past the patched instructions once the mode byte has arrived,
+// so the programs are patched for the next transaction straight away.
+static __always_inline void set_continuous_read(bool continuous) {
+    SIM_SRAM_pio_read->instr_mem[pio_read_offset + sram_read_prog_offset_read_cmd] =
+        continuous ? read_cmd_continuous_instr : read_cmd_instr;
+    SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_cmd_addr_count] = pio_encode_set(pio_x, continuous ? cmd_addr_clocks - 9 : cmd_addr_clocks - 1);
+}
+
+// A FAST READ aborted before its mode byte leaves the mode
+static __always_inline bool update_continuous_read() {
+    uint32_t mode;
+    bool continuous = get_word(&mode) && mode == SIM_SRAM_CONTINUOUS_READ_MODE;
+    set_continuous_read(continuous);
+    return continuous;
+}
+
+// Service FAST READs without the command byte until one doesn't request
+// continuous read mode.  Returns with CS high and the PIOs reset, but the
+// FAST READ patches and DMA setup still in place.  Takes the statistics of
+// the FAST READ that entered the mode.
+static void __scratch_x("core1_continuous_read_main") core1_continuous_read_main(uint32_t polls, uint32_t bytes)
+{
+    uint32_t command = SIM_SRAM_STATS_FAST_READ;
+    bool continuous;
+    do {
+        reset_pios();
+        update_stats(command, polls, bytes);
+        command = SIM_SRAM_STATS_CONT_READ;
+
+        // The word in place of the command, then the address.  If the master
+        // aborts first the mode is left, as if the mode byte had been sent.
+        uint32_t addr_top, addr;
+        if (!wait_for_cmd(&addr_top) || !get_addr(&addr)) {
+            set_continuous_read(false);
+            command = SIM_SRAM_STATS_ABORTED;
+            polls = bytes = 0;
+            break;
+        }
+#if SIM_SRAM_ENABLE_FLASH
+        if (is_flash_addr(addr_top)) addr = flash_addr(addr_top, addr);
+#endif
+        dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = addr;
+        continuous = update_continuous_read();
+
+        polls = wait_for_cs_high();
+        bytes = abort_tx_channel();
+    } while (continuous);
+    reset_pios();
+    update_stats(command, polls, bytes);
+}
+#endif
+
+#if SIM_SRAM_MULTI_IO
+// Like pio_add_program_at_offset, but over the program already at that offset.
+static void load_program(PIO pio, const pio_program_t* program, uint offset) {
+    for (uint i = 0; i < program->length; ++i) {
+        uint16_t instr = program->instructions[i];
+        pio->instr_mem[offset + i] = pio_instr_bits_jmp != _pio_major_instr_bits(instr) ? instr : instr + offset;
+    }
+}
+
+static void set_y(PIO pio, uint sm, uint32_t y) {
+    pio_sm_put(pio, sm, y);
+    pio_sm_exec(pio, sm, pio_encode_pull(false, true));
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_y, pio_osr));
+}
+
+static void load_programs(const pio_program_t* read_program, const pio_sm_config* read_config,
+                          const pio_program_t* write_program, const pio_sm_config* write_config) {
+    pio_sm_set_enabled(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, false);
+    pio_sm_set_enabled(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, false);
+    load_program(SIM_SRAM_pio_write, write_program, pio_write_offset);
+    load_program(SIM_SRAM_pio_read, read_program, pio_read_offset);
+    pio_sm_set_config(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, write_config);
+    pio_sm_set_config(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, read_config);
+}
+
+// The mode switches are made with CS high, and the PIOs are reset afterwards.
+static void enter_multi_io_mode(const pio_program_t* read_program, const pio_sm_config* read_config,
+                                const pio_program_t* write_program, const pio_sm_config* write_config) {
+    load_programs(read_program, read_config, write_program, write_config);
+
+    // Stop driving MISO, the data pins are only driven during reads
+    pio_sm_set_pindirs_with_mask(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, 0, data_pins_mask);
+
+    // The address prefix is read in bit reversed
+    set_y(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, ram_addr_prefix_reversed);
+
+    // Data is transmitted a byte at a time
+    hw_clear_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS);
+}
+
+static void exit_multi_io_mode() {
+    load_programs(&sram_read_program, &spi_read_config, &sram_write_program, &spi_write_config);
+
+    pio_sm_set_pindirs_with_mask(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, 1u << SIM_SRAM_SPI_MISO, data_pins_mask);
+    set_y(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, ram_addr_prefix);
+    hw_set_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, 2 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB);
+}
+
+// Service commands in SDI or SQI mode until RSTIO, then return with the SPI programs loaded.
+// The SDI and SQI programs push the same things, so only the programs differ between the modes.
+// Returns the polls of CS for the RSTIO, for the statistics.
+static uint32_t __scratch_x("core1_multi_io_main") core1_multi_io_main()
+{
+    reset_pios();
+    while (true) {
+        uint32_t cmd;
+        if (!wait_for_cmd(&cmd)) {
+            abort_transaction();
+            continue;
+        }
+        uint32_t command, polls, bytes = 0;
+        if (cmd == SIM_SRAM_READ_CMD || cmd == SIM_SRAM_FAST_READ_CMD) {
+            // Read and fast read both have 1 dummy byte in SDI and SQI mode, so there is
+            // time to transfer the complete address to the transmit DMA channel.
+            dma_channel_start(SIM_SRAM_tx_channel2);
+
+            polls = wait_for_cs_high();
+
+            // Release the data pins before anything else
+            pio_sm_exec(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, pio_encode_set(pio_pindirs, 0));
+            bytes = abort_tx_channel();
+            command = (cmd == SIM_SRAM_READ_CMD) ? SIM_SRAM_STATS_READ : SIM_SRAM_STATS_FAST_READ;
+            reset_pios();
+
+            // If the address never arrived the channel must not take the
+            // next command in its place, as in core1_main()
+            if (dma_channel_is_busy(SIM_SRAM_tx_channel2)) {
+                dma_channel_abort(SIM_SRAM_tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+                polls = bytes = 0;
+            }
+            update_stats(command, polls, bytes);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
+            // Write
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            begin_snapshot_write();
+#endif
+            uint32_t addr;
+            if (!get_word(&addr)) {
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                end_snapshot_range(0, 0);
+#endif
+                abort_transaction();
+                continue;
+            }
+            uint32_t count = start_write(addr);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            set_snapshot_write_addr(addr);
+#endif
+
+            polls = wait_for_cs_high();
+            drain_write(SIM_SRAM_pio_read_sm);
+            uint32_t len = write_len(addr, count);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            end_snapshot_write(addr, len);
+#endif
+#if SIM_SRAM_ENABLE_DOORBELL
+            check_doorbell(addr, len);
+#endif
+#if SIM_SRAM_ENABLE_WRITE_EVENTS
+            record_write_len(addr, len);
+#endif
+            update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+        else if (cmd == 0xFF) {
+            // RSTIO
+            polls = wait_for_cs_high();
+            exit_multi_io_mode();
+            return polls;
+        }
+        else {
+            // Ignore unknown command
+            polls = wait_for_cs_high();
+            command = SIM_SRAM_STATS_UNKNOWN;
+        }
+        reset_pios();
+        update_stats(command, polls, bytes);
+    }
+}
+#endif
+
+#if SIM_SRAM_NUM_DEVICES > 1
+// Wait for a command from any device, and set sm to the read SM that pushed
+// it.  Returns false if the master aborted during the command of the device
+// of sm, as in wait_for_cmd().  One device is checked for an abort each time
+// round, with its SM's address read first, as that is the check that fails
+// while the device isn't selected.
+static __always_inline bool get_device_cmd(uint* sm, uint32_t* cmd) {
+    uint device = 0;
+    uint32_t fstat;
+    while ((fstat = SIM_SRAM_pio_read->fstat & devices_rx_empty) == devices_rx_empty) {
+        uint check = SIM_SRAM_pio_read_sm + device;
+        if (SIM_SRAM_pio_read->sm[check].addr != (uint)pio_read_offset &&
+            gpio_get(device_cs[device]) &&
+            gpio_get(device_cs[device]) &&
+            pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, check)) {
+            *sm = check;
+            return false;
+        }
+        if (++device == SIM_SRAM_NUM_DEVICES) device = 0;
+    }
+
+    uint read_sm = SIM_SRAM_pio_read_sm;
+    while (fstat & device_rx_empty(read_sm)) ++read_sm;
+    *cmd = SIM_SRAM_pio_read->rxf[read_sm];
+    *sm = read_sm;
+    return true;
+}
+
+// Point the receive and address channels at the read SM of a device.  The
+// address isn't pushed until 16 clocks after the command, so there is time.
+static __always_inline void select_device(uint sm) {
+    uint device = sm - SIM_SRAM_pio_read_sm;
+    dma_hw->ch[SIM_SRAM_rx_channel].read_addr = (uint32_t)&SIM_SRAM_pio_read->rxf[sm];
+    dma_hw->ch[SIM_SRAM_rx_channel].al1_ctrl = device_rx_ctrl[device];
+    dma_hw->ch[SIM_SRAM_tx_channel2].read_addr = (uint32_t)&SIM_SRAM_pio_read->rxf[sm];
+    dma_hw->ch[SIM_SRAM_tx_channel2].al1_ctrl = device_tx2_ctrl[device];
+}
+
+// Service READ, FAST READ and WRITE for several devices, as core1_main does
+// for one.  Only the read SM of the device selected has to be reset after
+// each command, the others are still waiting for their CS.
+static void __scratch_x("core1_multi_device_main") core1_multi_device_main()
+{
+    while (true) {
+        uint32_t cmd;
+        uint sm;
+        if (!get_device_cmd(&sm, &cmd)) {
+            abort_device_transaction(sm);
+            continue;
+        }
+        select_device(sm);
+        uint cs = device_cs[sm - SIM_SRAM_pio_read_sm];
+
+        uint32_t command, polls, bytes = 0;
+        if (cmd == SIM_SRAM_READ_CMD) {
+            // Read
+            dma_channel_start(SIM_SRAM_tx_channel2);
+
+            polls = wait_for_device_cs_high(cs);
+            bytes = abort_tx_channel();
+
+            // An aborted READ is found as in core1_main
+            command = SIM_SRAM_STATS_READ;
+#if SIM_SRAM_ENABLE_STATS
+            if (pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, sm)) command = SIM_SRAM_STATS_ABORTED;
+#endif
+            reset_device_pios(sm);
+            if (dma_channel_is_busy(SIM_SRAM_tx_channel2)) {
+                dma_channel_abort(SIM_SRAM_tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+            }
+            if (command == SIM_SRAM_STATS_ABORTED) polls = bytes = 0;
+            update_stats(command, polls, bytes);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_FAST_READ_CMD) {
+            // Fast read, as in core1_main
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp(pio_write_offset + sram_write_offset_fast_read);
+            hw_clear_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS);
+            hw_set_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, 8 << PIO_SM0_SHIFTCTRL_PULL_THRESH_LSB);
+
+            uint32_t addr;
+            if (!get_device_addr(sm, cs, &addr)) abort_device_transaction(sm);
+            else {
+                dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = addr;
+
+                polls = wait_for_device_cs_high(cs);
+                bytes = abort_tx_channel();
+                reset_device_pios(sm);
+                update_stats(SIM_SRAM_STATS_FAST_READ, polls, bytes);
+            }
+
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp_pin(pio_write_offset + sram_write_offset_addr_two);
+            hw_set_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, 2 << DMA_CH10_CTRL_TRIG_DATA_SIZE_LSB);
+            hw_clear_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, PIO_SM0_SHIFTCTRL_PULL_THRESH_BITS);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
+            // Write
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            begin_snapshot_write();
+#endif
+            uint32_t addr;
+            if (!get_device_addr(sm, cs, &addr)) {
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                end_snapshot_range(0, 0);
+#endif
+                abort_device_transaction(sm);
+                continue;
+            }
+            start_write(addr);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            set_snapshot_write_addr(addr);
+#endif
+
+            polls = wait_for_device_cs_high(cs);
+            drain_write(sm);
+            dma_channel_abort(SIM_SRAM_rx_channel);
+
+            // The DMA write address is now the end of the data
+            reset_device_pios(sm);
+            uint32_t len = dma_hw->ch[SIM_SRAM_rx_channel].write_addr - addr;
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            end_snapshot_write(addr, len);
+#endif
+#if SIM_SRAM_ENABLE_DOORBELL
+            check_doorbell(addr, len);
+#endif
+#if SIM_SRAM_RECORD_WRITES
+            record_write(addr, addr + len);
+#endif
+            update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+        else {
+            // Ignore unknown command
+            polls = wait_for_device_cs_high(cs);
+            command = SIM_SRAM_STATS_UNKNOWN;
+        }
+        reset_device_pios(sm);
+        update_stats(command, polls, bytes);
+    }
+}
+#endif
+
 static void __scratch_x("core1_main") core1_main()
 {
     while (true) {
-        uint32_t cmd = pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-        if (cmd == 0x3) {
+        uint32_t cmd;
+#if SIM_SRAM_ENABLE_PSRAM_SPI
+        if (!get_cmd(&cmd)) {
+#else
+        if (!wait_for_cmd(&cmd)) {
+#endif
+            abort_transaction();
+            continue;
+        }
+#if SIM_SRAM_ADDR_BITS == 24
+        // The top 7 bits of the address are pushed with the command
+#if SIM_SRAM_ENABLE_FLASH || SIM_SRAM_ENABLE_MODE_REGISTER
+        const uint32_t addr_top = cmd & 0x7f;
+#endif
+        cmd >>= 7;
+#endif
+        // The commands are checked in order of how soon they must respond.
+        // Each check is a compare and branch of 2 cycles, and the disabled
+        // commands are compiled out, so READ, FAST READ and WRITE only wait
+        // behind RDMR.  New commands go after WRITE.  A jump table would cost
+        // READ more than the two cycles of its check.
+        uint32_t command, polls, bytes = 0;
+#if SIM_SRAM_ENABLE_MODE_REGISTER && SIM_SRAM_ADDR_BITS == 16
+        if (cmd == SIM_SRAM_RDMR_CMD) {
+            // The mode is sent from the next clock, so this is checked first and the
+            // write SM sent straight to its data loop.  This only works at a slow SCK.
+            SIM_SRAM_pio_write->txf[SIM_SRAM_pio_write_sm] = mode_reg << 24;
+            pio_sm_exec(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, pio_encode_jmp(pio_write_offset + sram_write_offset_write_loop));
+            polls = wait_for_cs_high();
+            command = SIM_SRAM_STATS_OTHER;
+        }
+        else
+#endif
+        if (cmd == SIM_SRAM_READ_CMD) {
             // Read - this works by transferring the address direct from the Read PIO SM
             // direct to the read address of the transmit DMA channel.
+#if SIM_SRAM_ENABLE_FLASH
+            // Except in flash, where the address must be mapped.  There is no dummy byte
+            // to cover an XIP cache miss, so this only works at a very slow SCK.
+            if (is_flash_addr(addr_top)) {
+                uint32_t addr;
+                if (!get_word(&addr)) {
+                    abort_transaction();
+                    continue;
+                }
+                dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = flash_addr(addr_top, addr);
+            }
+            else
+#endif
             dma_channel_start(SIM_SRAM_tx_channel2);
 
-            wait_for_cs_high();
-            dma_channel_abort(SIM_SRAM_tx_channel);
+            polls = wait_for_cs_high();
+            bytes = abort_tx_channel();
+
+            // The read SM pushes the bottom 2 bits of the address in a word of
+            // their own, which nothing reads, so a READ aborted in them is only
+            // seen here, before the FIFO is cleared.
+            command = SIM_SRAM_STATS_READ;
+#if SIM_SRAM_ENABLE_STATS
+            if (pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm)) command = SIM_SRAM_STATS_ABORTED;
+#endif
+            reset_pios();
+
+            // If the top of the address never arrived the channel must not take
+            // the next command in its place.  The next command can't be pushed
+            // this soon after the PIOs are re-armed.
+            if (dma_channel_is_busy(SIM_SRAM_tx_channel2)) {
+                dma_channel_abort(SIM_SRAM_tx_channel2);
+                command = SIM_SRAM_STATS_ABORTED;
+            }
+            if (command == SIM_SRAM_STATS_ABORTED) polls = bytes = 0;
+            update_stats(command, polls, bytes);
+            continue;
         }
-        else if (cmd == 0xB) {
-            // Fast read
+        else if (cmd == SIM_SRAM_FAST_READ_CMD || is_status_read(cmd)) {
+            // Fast read, or a status read, which is a FAST READ of a status block
             // Need to patch the write program to do extra delay cycles
-            SIM_SRAM_pio_write->instr_mem[sram_write_offset_addr_loop_end] = pio_encode_jmp(sram_write_offset_fast_read);
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp(pio_write_offset + sram_write_offset_fast_read);
 
             // And change the write size to 8
             hw_clear_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS);
             hw_set_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, 8 << PIO_SM0_SHIFTCTRL_PULL_THRESH_LSB);
 
+#if SIM_SRAM_STATUS_READS
+            uint32_t* status = update_status_block(cmd);
+#endif
+
             // Transfer the address manually
-            uint32_t addr = pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-            addr |= pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-            dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = addr;
+            uint32_t addr;
+            if (!get_addr(&addr)) abort_transaction();
+            else {
+#if SIM_SRAM_STATUS_READS
+                if (status) addr = (uint32_t)status | (addr & 7);
+                else
+#endif
+#if SIM_SRAM_ENABLE_FLASH
+                if (is_flash_addr(addr_top)) addr = flash_addr(addr_top, addr);
+#endif
+                dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = addr;
+#if SIM_SRAM_ENABLE_CONTINUOUS_READ
+                // A status read leaves the mode byte in the FIFO for reset_pios()
+                bool continuous = cmd == SIM_SRAM_FAST_READ_CMD && update_continuous_read();
+#endif
 
-            wait_for_cs_high();
-            dma_channel_abort(SIM_SRAM_tx_channel);
+                polls = wait_for_cs_high();
+                bytes = abort_tx_channel();
+#if SIM_SRAM_ENABLE_CONTINUOUS_READ
+                if (continuous) core1_continuous_read_main(polls, bytes);
+                else
+#endif
+                {
+                    reset_pios();
+                    update_stats(cmd == SIM_SRAM_FAST_READ_CMD ? SIM_SRAM_STATS_FAST_READ : SIM_SRAM_STATS_OTHER, polls, bytes);
+                }
+            }
 
+            // The next command can't reach the end of its address before these
+            // are restored, so they are done after the PIOs are re-armed.
             // Unpatch the write program
-            SIM_SRAM_pio_write->instr_mem[sram_write_offset_addr_loop_end] = pio_encode_jmp_pin(sram_write_offset_addr_two);
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp_pin(pio_write_offset + sram_write_offset_addr_two);
 
             // And change the write size back to 32
             hw_set_bits(&dma_hw->ch[SIM_SRAM_tx_channel].al1_ctrl, 2 << DMA_CH10_CTRL_TRIG_DATA_SIZE_LSB);
             hw_clear_bits(&SIM_SRAM_pio_write->sm[SIM_SRAM_pio_write_sm].shiftctrl, PIO_SM0_SHIFTCTRL_PULL_THRESH_BITS);
+            continue;
         }
-        else if (cmd == 0x2) {
+        else if (cmd == SIM_SRAM_WRITE_CMD) {
             // Write
-            //addr += pio_sm_get_blocking(pio, pio_read_sm) << 8;
-            uint32_t addr = pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-            addr |= pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-            dma_hw->ch[SIM_SRAM_rx_channel].al2_write_addr_trig = addr;
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            begin_snapshot_write();
+#endif
+            uint32_t addr;
+            if (!get_addr(&addr)) {
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                end_snapshot_range(0, 0);
+#endif
+                abort_transaction();
+                continue;
+            }
+#if SIM_SRAM_ENABLE_FLASH
+            if (is_flash_addr(addr_top)) {
+                // The flash region is read only, the data is discarded
+                polls = wait_for_cs_high();
+                reset_pios();
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                end_snapshot_write(addr, 0);
+#endif
+                update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+                continue;
+            }
+#endif
+            uint32_t count = start_write(addr);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            set_snapshot_write_addr(addr);
+#endif
 
-            wait_for_cs_high();
-            while (!pio_sm_is_rx_fifo_empty(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm));
-            dma_channel_abort(SIM_SRAM_rx_channel);
+            polls = wait_for_cs_high();
+            drain_write(SIM_SRAM_pio_read_sm);
+            uint32_t len = write_len(addr, count);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+            end_snapshot_write(addr, len);
+#endif
+#if SIM_SRAM_ENABLE_DOORBELL
+            check_doorbell(addr, len);
+#endif
+#if SIM_SRAM_RECORD_WRITES
+            record_write_len(addr, len);
+#endif
+            update_stats(SIM_SRAM_STATS_WRITE, polls, len);
+            continue;
+        }
+#if SIM_SRAM_ENABLE_CRC
+        else if (cmd == SIM_SRAM_CRC_CMD) {
+            uint32_t addr;
+            if (!get_addr(&addr)) {
+                abort_transaction();
+                continue;
+            }
+
+            // The length is the next 4 bytes.  They are read before the FIFO
+            // is cleared, and the command is ignored if any are missing.
+            polls = wait_for_cs_high();
+            bool have_len = pio_sm_get_rx_fifo_level(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm) >= 4;
+            uint32_t len = 0;
+            if (have_len) {
+                for (int i = 0; i < 4; ++i) {
+                    len = (len << 8) | (SIM_SRAM_pio_read->rxf[SIM_SRAM_pio_read_sm] & 0xff);
+                }
+            }
+
+            reset_pios();
+            if (have_len) {
+                uint32_t end = (uint32_t)emu_ram + SIM_SRAM_SIZE;
+#if SIM_SRAM_ENABLE_FLASH
+                if (is_flash_addr(addr_top)) {
+                    addr = flash_addr(addr_top, addr);
+                    end = flash_region_end;
+                }
+#endif
+                start_crc(addr, end, len);
+            }
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+#endif
+#if SIM_SRAM_ENABLE_BULK
+        else if (cmd == SIM_SRAM_FILL_CMD || cmd == SIM_SRAM_COPY_CMD) {
+            uint32_t addr;
+            if (!get_addr(&addr)) {
+                abort_transaction();
+                continue;
+            }
+
+            // The arguments are read as they arrive, as there are more than
+            // fit in the FIFO.  The command is ignored if any are missing.
+            uint32_t dst = addr, value = 0, len;
+            bool ok;
+            if (cmd == SIM_SRAM_FILL_CMD) {
+                ok = get_bulk_args(&len, 4) == 4 && get_bulk_args(&value, 1) == 1;
+            }
+            else {
+                ok = get_bulk_args(&dst, SIM_SRAM_ADDR_BITS / 8) == SIM_SRAM_ADDR_BITS / 8 &&
+                     get_bulk_args(&len, 4) == 4;
+#if SIM_SRAM_ENABLE_FLASH
+                if (is_flash_addr(dst >> 17)) ok = false;
+#endif
+                dst = (uint32_t)emu_ram + (dst & (SIM_SRAM_SIZE - 1));
+            }
+#if SIM_SRAM_ENABLE_FLASH
+            // The flash region is read only
+            if (is_flash_addr(addr_top)) ok = false;
+#endif
+            polls = wait_for_cs_high();
+            reset_pios();
+
+            if (ok) {
+                dma_channel_abort(SIM_SRAM_bulk_channel);
+                fill_value = value * 0x01010101;
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                // Counted as a WRITE that has finished once it has started,
+                // core0 waits for the channel itself
+                begin_snapshot_write();
+#endif
+                len = start_bulk(dst, cmd == SIM_SRAM_FILL_CMD ? (uint32_t)&fill_value : addr, len,
+                                 cmd == SIM_SRAM_COPY_CMD);
+#if SIM_SRAM_ENABLE_SNAPSHOT
+                end_snapshot_range(dst, dst + len);
+#endif
+#if SIM_SRAM_RECORD_WRITES
+                record_write(dst, dst + len);
+#endif
+            }
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
         }
+#endif
+#if SIM_SRAM_ENABLE_PSRAM_SPI
+        else if (cmd == SIM_SRAM_READ_ID_CMD) {
+            // Read ID has the timing of a READ with the address ignored, so the
+            // ID is sent straight away.  The write SM is patched to wait for
+            // the last address bit and send the ID from its first byte, rather
+            // than skipping the bytes given by the bottom 2 bits of the address.
+            // The command is pushed 16 clocks before the end of the address.
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp(pio_write_offset + sram_write_offset_write_wait);
+            dma_hw->ch[SIM_SRAM_tx_channel].al3_read_addr_trig = (uint32_t)psram_id;
+
+            polls = wait_for_cs_high();
+            bytes = abort_tx_channel();
+            reset_pios();
+            update_stats(SIM_SRAM_STATS_OTHER, polls, bytes);
+
+            // Unpatch the write program, as after a FAST READ
+            SIM_SRAM_pio_write->instr_mem[pio_write_offset + sram_write_offset_addr_loop_end] = pio_encode_jmp_pin(pio_write_offset + sram_write_offset_addr_two);
+            continue;
+        }
+        else if (cmd == SIM_SRAM_WRAP_TOGGLE_CMD || cmd == SIM_SRAM_RESET_CMD) {
+            polls = wait_for_cs_high();
+            reset_pios();
+            set_wrap(cmd == SIM_SRAM_WRAP_TOGGLE_CMD && wrap_size != 32 ? psram_ring_bits_32 : psram_ring_bits_1k);
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+#endif
+#if SIM_SRAM_ENABLE_MODE_REGISTER
+        else if (cmd == SIM_SRAM_WRMR_CMD) {
+#if SIM_SRAM_ADDR_BITS == 24
+            // All but the last bit of the mode byte were pushed with the command,
+            // so a WRMR cut short before them was aborted in wait_for_cmd()
+            uint32_t mode = addr_top << 1;
+            polls = wait_for_cs_high();
+#else
+            // The mode byte is left in the bottom of the read SM's ISR, and X
+            // gives the number of bits of it read.  As in get_cmd(), the low
+            // bits of X are shifted in below the mode byte to push them together.
+            polls = wait_for_cs_high();
+            pio_sm_exec(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_encode_in(pio_x, 4));
+            pio_sm_exec(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_encode_push(false, false));
+            uint32_t mode = pio_sm_get_blocking(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
+            if ((mode & 0xf) > wrmr_mode_x) {
+                // Cut short in the mode byte
+                abort_transaction();
+                continue;
+            }
+            mode >>= 4;
+#endif
+            reset_pios();
+            set_mode(mode);
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+            continue;
+        }
+#endif
+#if SIM_SRAM_ENABLE_SDI
+        else if (cmd == 0x3B) {
+            // EDIO
+            polls = wait_for_cs_high();
+            enter_multi_io_mode(&sram_dual_read_program, &dual_read_config, &sram_dual_write_program, &dual_write_config);
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+
+            // RSTIO
+            polls = core1_multi_io_main();
+            command = SIM_SRAM_STATS_OTHER;
+        }
+#endif
+#if SIM_SRAM_ENABLE_SQI
+        else if (cmd == 0x38) {
+            // EQIO
+            polls = wait_for_cs_high();
+            enter_multi_io_mode(&sram_quad_read_program, &quad_read_config, &sram_quad_write_program, &quad_write_config);
+            update_stats(SIM_SRAM_STATS_OTHER, polls, 0);
+
+            // RSTIO
+            polls = core1_multi_io_main();
+            command = SIM_SRAM_STATS_OTHER;
+        }
+#endif
         else {
             // Ignore unknown command
-            wait_for_cs_high();
+            polls = wait_for_cs_high();
+            command = SIM_SRAM_STATS_UNKNOWN;
         }
-        pio_sm_set_enabled(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, false);
-        pio_sm_clear_fifos(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm);
-        pio_sm_restart(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm);
-        pio_sm_exec(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, pio_encode_jmp(pio_write_offset));
-        pio_sm_set_enabled(SIM_SRAM_pio_write, SIM_SRAM_pio_write_sm, true);
-        pio_sm_set_enabled(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, false);
-        pio_sm_clear_fifos(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-        pio_sm_restart(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm);
-        pio_sm_exec(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, pio_encode_jmp(pio_read_offset));
-        pio_sm_set_enabled(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm, true);            
+        reset_pios();
+        update_stats(command, polls, bytes);
     }
 }
 
 uint8_t* setup_simulated_sram() {
+    // The read SM forms addresses in the RAM from SIM_SRAM_RAM_BASE, so the
+    // linker script must match sram.h
+    if ((uint32_t)emu_ram != SIM_SRAM_RAM_BASE) {
+        panic("emu_ram is at %p, not 0x%08x, use the linker script for this configuration", emu_ram, SIM_SRAM_RAM_BASE);
+    }
+
+#if SIM_SRAM_ENABLE_PERSIST
+    memcpy(emu_ram, (const void*)(XIP_BASE + SIM_SRAM_PERSIST_OFFSET), SIM_SRAM_SIZE);
+#endif
     setup_sram_pio();
 
     setup_rx_channel();
     setup_tx_channel();
+#if SIM_SRAM_ENABLE_CRC
+    setup_crc_channel();
+#endif
+#if SIM_SRAM_ENABLE_BULK
+    setup_bulk_channel();
+#endif
+#if SIM_SRAM_ENABLE_PSRAM_SPI
+    // The APS6404 wraps within 1kB from power up
+    set_wrap(psram_ring_bits_1k);
+#endif
+
+#if SIM_SRAM_NUM_DEVICES > 1
+    // The channels are set up for device 0, only the DREQ changes for the others
+    for (uint device = 0; device < SIM_SRAM_NUM_DEVICES; ++device) {
+        uint32_t treq = pio_get_dreq(SIM_SRAM_pio_read, SIM_SRAM_pio_read_sm + device, false) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB;
+        device_rx_ctrl[device] = (dma_hw->ch[SIM_SRAM_rx_channel].al1_ctrl & ~DMA_CH0_CTRL_TRIG_TREQ_SEL_BITS) | treq;
+        device_tx2_ctrl[device] = (dma_hw->ch[SIM_SRAM_tx_channel2].al1_ctrl & ~DMA_CH0_CTRL_TRIG_TREQ_SEL_BITS) | treq;
+    }
+#endif
 
     hw_set_bits(&bus_ctrl_hw->priority, BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS);
+#if SIM_SRAM_NUM_DEVICES > 1
+    multicore_launch_core1(core1_multi_device_main);
+#else
     multicore_launch_core1(core1_main);
+#endif
 
     return emu_ram;
-}
\ No newline at end of file
+}
+
+#if SIM_SRAM_ENABLE_PERSIST
+int persist_simulated_sram() {
+    int written = 0;
+    for (int s = 0; s < num_sectors; ++s) {
+        uint32_t writes = sector_writes[s];
+        if (writes == sector_writes_persisted[s]) continue;
+
+        // The count is read before the data is copied, so a WRITE during the
+        // copy leaves the sector dirty.
+        __dmb();
+        memcpy(persist_buf, &emu_ram[s * FLASH_SECTOR_SIZE], FLASH_SECTOR_SIZE);
+
+        uint32_t offset = SIM_SRAM_PERSIST_OFFSET + s * FLASH_SECTOR_SIZE;
+        uint32_t ints = save_and_disable_interrupts();
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        flash_range_program(offset, persist_buf, FLASH_SECTOR_SIZE);
+        restore_interrupts(ints);
+
+        sector_writes_persisted[s] = writes;
+        ++written;
+    }
+    return written;
+}
+#endif
+
+#if SIM_SRAM_ENABLE_WRITE_EVENTS
+bool get_simulated_sram_write_event(sim_sram_write_event_t* event) {
+    uint32_t tail = write_event_tail;
+    if (tail == write_event_head) return false;
+
+    __dmb();
+    *event = write_events[tail & (SIM_SRAM_WRITE_EVENT_QUEUE_LEN - 1)];
+    __dmb();
+    write_event_tail = tail + 1;
+    return true;
+}
+
+bool get_simulated_sram_write_event_in_range(sim_sram_write_event_t* event, uint32_t addr, uint32_t len) {
+    while (get_simulated_sram_write_event(event)) {
+        if (event->addr < addr + len && addr < event->addr + event->len) return true;
+    }
+    return false;
+}
+#endif
+
+#if SIM_SRAM_ENABLE_DOORBELL
+bool get_simulated_sram_doorbell(sim_sram_doorbell_t* doorbell) {
+    uint32_t tail = doorbell_tail;
+    if (tail == doorbell_head) return false;
+
+    __dmb();
+    *doorbell = doorbells[tail & (SIM_SRAM_DOORBELL_QUEUE_LEN - 1)];
+    __dmb();
+    doorbell_tail = tail + 1;
+    return true;
+}
+
+void set_simulated_sram_status(uint32_t offset, uint32_t value) {
+    // A single aligned store, so a READ, which moves whole words, never sees
+    // half of it.  FAST READ moves bytes, so it can.
+    *(volatile uint32_t*)&emu_ram[SIM_SRAM_STATUS_ADDR + offset] = value;
+}
+#endif
+
+#if SIM_SRAM_ENABLE_SNAPSHOT
+// Whether a FILL or COPY may still be changing the RAM
+static inline bool bulk_running() {
+#if SIM_SRAM_ENABLE_BULK
+    return dma_channel_is_busy(SIM_SRAM_bulk_channel);
+#else
+    return false;
+#endif
+}
+
+void read_simulated_sram_snapshot(void* dst, uint32_t offset, uint32_t len) {
+    while (true) {
+        uint32_t gen = snapshot.gen;
+        if ((gen & 1) || bulk_running()) continue;
+
+        __dmb();
+        memcpy(dst, &emu_ram[offset], len);
+        __dmb();
+        if (snapshot.gen == gen) return;
+    }
+}
+
+void read_simulated_sram_range_snapshot(void* dst, uint32_t offset, uint32_t len) {
+    const uint32_t start = (uint32_t)emu_ram + offset;
+    const uint32_t end = start + len;
+    while (true) {
+        uint32_t gen = snapshot.gen;
+        __dmb();
+        // A WRITE only changes the RAM from its start address up, or from the
+        // start of the block it wraps within
+        if ((gen & 1) && snapshot.active_low < end) continue;
+        if (bulk_running()) continue;
+
+        memcpy(dst, (const void*)start, len);
+        __dmb();
+        uint32_t new_gen = snapshot.gen;
+        if (new_gen == gen) return;
+
+        // The generation of the first WRITE started after gen was read.  Only
+        // the WRITE in progress, or the last one, can be checked, so retry if
+        // more than one started.
+        uint32_t first = (gen + 1) | 1;
+        if ((int32_t)(new_gen - first) > 1) continue;
+        bool ok;
+        if ((int32_t)(new_gen - first) < 0) ok = true;  // The WRITE in progress finished, it was outside the range
+        else if (new_gen & 1) ok = snapshot.active_low >= end;
+        else ok = snapshot.last_end <= start || snapshot.last_start >= end;
+
+        // The checked range belongs to new_gen if it hasn't moved on since
+        __dmb();
+        if (ok && snapshot.gen == new_gen) return;
+    }
+}
+#endif
+
+#if SIM_SRAM_ENABLE_STATS
+void get_simulated_sram_stats(sim_sram_stats_t* out) {
+    __dmb();
+    memcpy(out, &stats, sizeof(stats));
+}
+#endif
@@ -2,13 +2,204 @@
 // The BSD 3 clause license applies
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "sram_protocol.h"
+
 // Configuration: GPIOs for the SPI interface
 #define SIM_SRAM_SPI_MOSI 2
 #define SIM_SRAM_SPI_SCK  3  // Must be MOSI + 1
 #define SIM_SRAM_SPI_CS   4  // Must be MOSI + 2
-#define SIM_SRAM_SPI_MISO 5
+#define SIM_SRAM_SPI_MISO 5  // Must be MOSI - 1 if SDI or SQI is enabled
+
+// Configuration: Address size.  16 bits gives a 64kB RAM like the 23LC512,
+// at 0x20030000.  24 bits gives a 128kB RAM like the 23LC1024, at
+// 0x20020000, and needs sram_memmap_128k.ld instead of sram_memmap.ld.
+// The top 7 bits of a 24-bit address are ignored, unless the flash region
+// is enabled.
+#define SIM_SRAM_ADDR_BITS 16
+
+#if SIM_SRAM_ADDR_BITS == 24
+#define SIM_SRAM_SIZE 131072
+#elif SIM_SRAM_ADDR_BITS == 16
+#define SIM_SRAM_SIZE 65536
+#else
+#error "SIM_SRAM_ADDR_BITS must be 16 or 24"
+#endif
+
+// Configuration: Place the RAM in the non-striped aliases of the SRAM banks,
+// at 0x21030000 for 64kB, so its DMA never shares a bank with core0 instead
+// of using every 4th word of all four.  Needs sram_memmap_nonstriped.ld, or
+// its _128k or _192k variant, which keep core0's data, bss and heap in the
+// other banks.
+#define SIM_SRAM_NON_STRIPED 0
+
+// Configuration: Enable SDI mode, entered with EDIO (0x3B), and SQI mode,
+// entered with EQIO (0x38).  Both are left with RSTIO (0xFF).
+// The data pins must be consecutive, and are placed below MOSI in reverse
+// order so that the SPI pin layout is unchanged, e.g. for MOSI = 5:
+//   SIO3 = 2, SIO2 = 3, SIO1 (MISO) = 4, SIO0 (MOSI) = 5, SCK = 6, CS = 7
+#define SIM_SRAM_ENABLE_SDI 0
+#define SIM_SRAM_ENABLE_SQI 0
+
+// Configuration: Enable continuous read mode.  A FAST READ with the mode
+// byte SIM_SRAM_CONTINUOUS_READ_MODE in place of its dummy byte enters the
+// mode, and later transactions are FAST READs without the command byte,
+// until one has a different mode byte.  SPI mode only.
+#define SIM_SRAM_ENABLE_CONTINUOUS_READ 0
+#define SIM_SRAM_CONTINUOUS_READ_MODE 0xA0
+
+// Configuration: Serve the top half of the 24-bit address space, from
+// 0x800000, read only from flash through XIP.  Address 0x800000 + n reads
+// SIM_SRAM_FLASH_BASE + n, and writes to the region are ignored.  Use FAST
+// READ, READ only works at a very slow SCK when the XIP cache misses.
+// 24-bit addresses only.
+#define SIM_SRAM_ENABLE_FLASH 0
+#define SIM_SRAM_FLASH_BASE 0x10100000
+
+// Configuration: Persist the RAM to flash.  Core1 records the 4kB sectors
+// each WRITE changes, and persist_simulated_sram(), called on core0, copies
+// just those sectors to the SIM_SRAM_SIZE bytes of flash at
+// SIM_SRAM_PERSIST_OFFSET.  setup_simulated_sram() loads the RAM from there.
+// A sector being written to flash when power is lost is lost.  The linker
+// scripts end the FLASH region at the default SIM_SRAM_PERSIST_OFFSET, so
+// change them to match if it is moved.
+#define SIM_SRAM_ENABLE_PERSIST 0
+#define SIM_SRAM_PERSIST_OFFSET (2 * 1024 * 1024 - SIM_SRAM_SIZE)
+
+// Configuration: Queue an event to core0 after each WRITE, see
+// get_simulated_sram_write_event().  The queue length must be a power of 2.
+#define SIM_SRAM_ENABLE_WRITE_EVENTS 0
+#define SIM_SRAM_WRITE_EVENT_QUEUE_LEN 64
+
+// Configuration: A doorbell window and a status window in the RAM, for
+// handshakes between the SPI master and core0.  A WRITE whose last byte is
+// in the doorbell window queues a doorbell to core0, with the 32-bit word
+// containing that byte, see get_simulated_sram_doorbell(), and wakes core0
+// from __wfe().  Core0 publishes words to the status window with
+// set_simulated_sram_status(), for the master to READ.  Words are little
+// endian, and an SPI mode READ from an aligned word returns it as one value.
+// FAST READ, and READ in SDI or SQI mode, move a byte at a time, so they can
+// return a word torn by a concurrent update: fetch status words with READ.
+// The queue length must be a power of 2.  The windows must be word aligned.
+#define SIM_SRAM_ENABLE_DOORBELL 0
+#define SIM_SRAM_DOORBELL_ADDR 0xFF00
+#define SIM_SRAM_DOORBELL_SIZE 64
+#define SIM_SRAM_STATUS_ADDR 0xFF40
+#define SIM_SRAM_STATUS_SIZE 64
+#define SIM_SRAM_DOORBELL_QUEUE_LEN 16
+
+// Configuration: Let core0 copy parts of the RAM consistently while the
+// master writes it, see read_simulated_sram_snapshot().  Core1 keeps a
+// generation count, odd while a WRITE is in progress, like a seqlock.
+#define SIM_SRAM_ENABLE_SNAPSHOT 0
+
+// Configuration: Count the transactions and bytes of each command, with a
+// histogram of how long CS was low, see get_simulated_sram_stats().
+#define SIM_SRAM_ENABLE_STATS 0
+
+// Configuration: Compute the CRC32 of part of the RAM with the DMA sniffer,
+// while commands continue to be served.  SIM_SRAM_CRC_CMD, the address and
+// a 4 byte length starts it.  SIM_SRAM_CRC_READ_CMD is then sent like a
+// FAST READ of address 0, and returns 4 bytes of 1 while the CRC is running,
+// otherwise 0, then the CRC most significant byte first.  SPI mode only.
+#define SIM_SRAM_ENABLE_CRC 0
+#define SIM_SRAM_CRC_CMD 0xC5
+#define SIM_SRAM_CRC_READ_CMD 0xC6
+
+// Configuration: FILL and COPY commands, run by a memory to memory DMA
+// within the RAM while commands continue to be served.  SIM_SRAM_FILL_CMD
+// is the address, a 4 byte length and the byte to fill with.
+// SIM_SRAM_COPY_CMD is the source address, the destination address and a
+// 4 byte length.  SIM_SRAM_BULK_STATUS_CMD is sent like a FAST READ of
+// address 0, and returns 4 bytes of 1 while busy, otherwise 0, then the
+// bytes remaining.  SPI mode only.
+#define SIM_SRAM_ENABLE_BULK 0
+#define SIM_SRAM_FILL_CMD 0xC1
+#define SIM_SRAM_COPY_CMD 0xC2
+#define SIM_SRAM_BULK_STATUS_CMD 0xC3
+
+// Configuration: The 23LC512 mode register, written by WRMR (0x01) and read
+// by RDMR (0x05).  In page mode reads and writes wrap within the 32 byte
+// page, enforced by the DMA ring wrap.  Byte mode is treated as page mode.
+// Sequential mode, the default, doesn't wrap at the end of the RAM, as the
+// DMA ring can't be as large as the RAM.  RDMR only works at a slow SCK,
+// with 16-bit addresses.  SPI mode only.
+#define SIM_SRAM_ENABLE_MODE_REGISTER 0
+#define SIM_SRAM_WRMR_CMD 0x01
+#define SIM_SRAM_RDMR_CMD 0x05
+#define SIM_SRAM_MODE_BYTE 0x00
+#define SIM_SRAM_MODE_PAGE 0x80
+#define SIM_SRAM_MODE_SEQUENTIAL 0x40
+#define SIM_SRAM_PAGE_SIZE 32
+
+// Configuration: The SPI-only subset of the APS6404 PSRAM's commands.  This
+// is not a full APS6404: Quad Read (0xEB), Quad Write (0x38) and QPI mode are
+// not implemented, so a PSRAM driver must be configured for SPI only, and one
+// using the quad commands will fail.  Read ID (0x9F) returns the 8 bytes of
+// SIM_SRAM_PSRAM_ID, its address is ignored.  Wrap boundary toggle (0xC0)
+// switches reads and writes between wrapping within 1kB, the default, and
+// 32 bytes, enforced by the DMA ring wrap, and reset (0x99) restores 1kB.
+// FAST READ has the APS6404's 8 wait cycles.  24-bit addresses only.
+#define SIM_SRAM_ENABLE_PSRAM_SPI 0
+#define SIM_SRAM_READ_ID_CMD 0x9F
+#define SIM_SRAM_WRAP_TOGGLE_CMD 0xC0
+#define SIM_SRAM_RESET_CMD 0x99
+#define SIM_SRAM_PSRAM_ID {0x0D, 0x5D, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00}  // MF ID, KGD, EID
+
+// Configuration: Emulate up to 3 RAMs on the same bus, each selected by its
+// own CS.  Device n is selected by CS n (SIM_SRAM_SPI_CS, then
+// SIM_SRAM_SPI_CS1 and SIM_SRAM_SPI_CS2, which can be any free GPIOs), is
+// served by read SM SIM_SRAM_pio_read_sm + n, and is the SIM_SRAM_SIZE bytes
+// of the RAM from n * SIM_SRAM_SIZE.  The RAM is at the top of SRAM, so 2
+// devices need sram_memmap_128k.ld and 3 need sram_memmap_192k.ld.
+// The read SMs share one program, so each device costs no PIO instructions,
+// just a pio1 SM and 64kB of RAM.  The write SM serves every device, and no
+// longer waits for CS, so every device on the bus must be emulated.
+// SPI mode with 16-bit addresses, with READ, FAST READ and WRITE only.
+#define SIM_SRAM_NUM_DEVICES 1
+#define SIM_SRAM_SPI_CS1 6
+#define SIM_SRAM_SPI_CS2 7
+
+// The address of the RAM, at the top of SRAM0-3 as placed by the linker script
+#define SIM_SRAM_RAM_BASE ((SIM_SRAM_NON_STRIPED ? 0x21040000 : 0x20040000) - SIM_SRAM_SIZE * SIM_SRAM_NUM_DEVICES)
+
+#if SIM_SRAM_ENABLE_SQI
+#define SIM_SRAM_SPI_SIO3 (SIM_SRAM_SPI_MOSI - 3)
+#endif
+#if (SIM_SRAM_ENABLE_SDI || SIM_SRAM_ENABLE_SQI) && SIM_SRAM_SPI_MISO != SIM_SRAM_SPI_MOSI - 1
+#error "SDI and SQI modes require MISO = MOSI - 1"
+#endif
+#if (SIM_SRAM_ENABLE_SDI || SIM_SRAM_ENABLE_SQI) && SIM_SRAM_ADDR_BITS != 16
+#error "SDI and SQI modes only support 16-bit addresses"
+#endif
+#if SIM_SRAM_ENABLE_FLASH && SIM_SRAM_ADDR_BITS != 24
+#error "The flash region requires 24-bit addresses"
+#endif
+#if SIM_SRAM_ENABLE_PSRAM_SPI && SIM_SRAM_ADDR_BITS != 24
+#error "The PSRAM personality requires 24-bit addresses"
+#endif
+#if SIM_SRAM_ENABLE_PSRAM_SPI && SIM_SRAM_ENABLE_MODE_REGISTER
+#error "The PSRAM personality has no mode register"
+#endif
+#if SIM_SRAM_NUM_DEVICES < 1 || SIM_SRAM_NUM_DEVICES > 3
+#error "SIM_SRAM_NUM_DEVICES must be 1, 2 or 3"
+#endif
+#if SIM_SRAM_NUM_DEVICES > 1 && (SIM_SRAM_ADDR_BITS != 16 || SIM_SRAM_ENABLE_SDI || SIM_SRAM_ENABLE_SQI || \
+                                 SIM_SRAM_ENABLE_CONTINUOUS_READ || SIM_SRAM_ENABLE_PERSIST || SIM_SRAM_ENABLE_CRC || \
+                                 SIM_SRAM_ENABLE_BULK || SIM_SRAM_ENABLE_MODE_REGISTER || SIM_SRAM_ENABLE_PSRAM_SPI)
+#error "Multiple devices only support SPI mode with 16-bit addresses, and READ, FAST READ and WRITE"
+#endif
+#if SIM_SRAM_ENABLE_DOORBELL && ((SIM_SRAM_DOORBELL_ADDR | SIM_SRAM_DOORBELL_SIZE | SIM_SRAM_STATUS_ADDR | SIM_SRAM_STATUS_SIZE) & 3 || \
+                                 SIM_SRAM_DOORBELL_ADDR + SIM_SRAM_DOORBELL_SIZE > SIM_SRAM_SIZE || \
+                                 SIM_SRAM_STATUS_ADDR + SIM_SRAM_STATUS_SIZE > SIM_SRAM_SIZE)
+#error "The doorbell and status windows must be word aligned and inside the RAM"
+#endif
+#if SIM_SRAM_ENABLE_PERSIST && (SIM_SRAM_ENABLE_SDI || SIM_SRAM_ENABLE_SQI || SIM_SRAM_ENABLE_FLASH)
+// The mode switches run from flash, and the flash region reads it, while core0 may be writing it
+#error "Persisting the RAM is not supported with SDI, SQI or the flash region"
+#endif
 
 // The PIO SMs and DMA channels are hardcoded as using dynamic
 // allocation and then reading the values from memory is slightly slower.
@@ -21,14 +212,166 @@
 #define SIM_SRAM_pio_write_sm  1
 #define SIM_SRAM_pio_write     pio0
 
+// Where the write program is loaded in the write PIO's instruction memory.
+// It is checked to fit when sram.c is built.  The read program is loaded
+// wherever pio_add_program() finds room, which is the top of the read PIO.
+#define SIM_SRAM_pio_write_offset 0
+
 // Configuration: DMA channels
 #define SIM_SRAM_rx_channel    0
 #define SIM_SRAM_tx_channel    1
 #define SIM_SRAM_tx_channel2   2
+#define SIM_SRAM_crc_channel   3  // Only claimed if SIM_SRAM_ENABLE_CRC is set
+#define SIM_SRAM_bulk_channel  4  // Only claimed if SIM_SRAM_ENABLE_BULK is set
+
+// The constraints on the configuration above.  A mistake here would
+// otherwise only show as transfers failing at some SCK rates.
+#if SIM_SRAM_SPI_SCK != SIM_SRAM_SPI_MOSI + 1 || SIM_SRAM_SPI_CS != SIM_SRAM_SPI_MOSI + 2
+#error "The PIO programs need SCK = MOSI + 1 and CS = MOSI + 2"
+#endif
+#if SIM_SRAM_SPI_MISO >= SIM_SRAM_SPI_MOSI && SIM_SRAM_SPI_MISO <= SIM_SRAM_SPI_CS
+#error "MISO must not be MOSI, SCK or CS"
+#endif
+#if SIM_SRAM_SPI_MISO < 0 || SIM_SRAM_SPI_MISO > 29 || SIM_SRAM_SPI_MOSI < 0 || SIM_SRAM_SPI_CS > 29
+#error "The SPI pins must be GPIOs 0 to 29"
+#endif
+#if SIM_SRAM_ENABLE_SQI && SIM_SRAM_SPI_MOSI < 3
+#error "SQI mode needs MOSI of at least 3, for SIO3 = MOSI - 3"
+#endif
+#if SIM_SRAM_NUM_DEVICES > 1 && \
+    ((SIM_SRAM_SPI_CS1 >= SIM_SRAM_SPI_MOSI && SIM_SRAM_SPI_CS1 <= SIM_SRAM_SPI_CS) || SIM_SRAM_SPI_CS1 == SIM_SRAM_SPI_MISO)
+#error "SIM_SRAM_SPI_CS1 must not be one of the SPI pins"
+#endif
+#if SIM_SRAM_NUM_DEVICES > 2 && \
+    ((SIM_SRAM_SPI_CS2 >= SIM_SRAM_SPI_MOSI && SIM_SRAM_SPI_CS2 <= SIM_SRAM_SPI_CS) || \
+     SIM_SRAM_SPI_CS2 == SIM_SRAM_SPI_MISO || SIM_SRAM_SPI_CS2 == SIM_SRAM_SPI_CS1)
+#error "SIM_SRAM_SPI_CS2 must not be one of the SPI pins or CS1"
+#endif
+#if SIM_SRAM_pio_read_sm < 0 || SIM_SRAM_pio_write_sm < 0 || SIM_SRAM_pio_write_sm > 3
+#error "The SMs must be 0 to 3"
+#endif
+#if SIM_SRAM_pio_read_sm + SIM_SRAM_NUM_DEVICES > 4
+#error "Each device needs a read SM, from SIM_SRAM_pio_read_sm up"
+#endif
+#if SIM_SRAM_pio_write_offset < 0 || SIM_SRAM_pio_write_offset > 31
+#error "SIM_SRAM_pio_write_offset must be 0 to 31"
+#endif
+#if SIM_SRAM_rx_channel > 11 || SIM_SRAM_tx_channel > 11 || SIM_SRAM_tx_channel2 > 11 || \
+    SIM_SRAM_crc_channel > 11 || SIM_SRAM_bulk_channel > 11
+#error "The DMA channels must be 0 to 11"
+#endif
+#if SIM_SRAM_rx_channel == SIM_SRAM_tx_channel || SIM_SRAM_rx_channel == SIM_SRAM_tx_channel2 || \
+    SIM_SRAM_tx_channel == SIM_SRAM_tx_channel2
+#error "The rx, tx and tx2 DMA channels must be different"
+#endif
+#if SIM_SRAM_ENABLE_CRC && (SIM_SRAM_crc_channel == SIM_SRAM_rx_channel || SIM_SRAM_crc_channel == SIM_SRAM_tx_channel || \
+                            SIM_SRAM_crc_channel == SIM_SRAM_tx_channel2)
+#error "The CRC DMA channel must be different from the others"
+#endif
+#if SIM_SRAM_ENABLE_BULK && (SIM_SRAM_bulk_channel == SIM_SRAM_rx_channel || SIM_SRAM_bulk_channel == SIM_SRAM_tx_channel || \
+                             SIM_SRAM_bulk_channel == SIM_SRAM_tx_channel2 || \
+                             (SIM_SRAM_ENABLE_CRC && SIM_SRAM_bulk_channel == SIM_SRAM_crc_channel))
+#error "The bulk DMA channel must be different from the others"
+#endif
 
 // Setup the simulated SRAM and launch core1 to service the commands.
+// Returns the RAM, SIM_SRAM_SIZE bytes for each device.
 //
 // It is best to call this before other initialization, so that
 // the hardcoded DMA channels and SMs are claimed before other resources
 // are claimed.
-uint8_t* setup_simulated_sram();
\ No newline at end of file
+uint8_t* setup_simulated_sram();
+
+#if SIM_SRAM_ENABLE_PERSIST
+// Write the sectors of the RAM changed since the last call to flash.
+// Returns the number of sectors written.
+//
+// Core0 must not be running from flash while this runs: interrupts are
+// disabled for the erase and program of each sector, around 50ms.  Core1
+// keeps serving commands throughout, and a sector written by the SPI master
+// while it is being copied is written again on the next call.
+int persist_simulated_sram();
+#endif
+
+#if SIM_SRAM_ENABLE_WRITE_EVENTS
+typedef struct {
+    uint32_t addr;  // Offset in the RAM of the first byte written, device n's RAM starts at n * SIM_SRAM_SIZE
+    uint32_t len;   // Bytes written
+    uint32_t seq;   // Counts WRITEs, a gap means events were dropped while the queue was full
+} sim_sram_write_event_t;
+
+// Get the oldest WRITE not yet seen by core0, without blocking.  Returns
+// false if there is none.  WRITEs that didn't reach the data are skipped.
+bool get_simulated_sram_write_event(sim_sram_write_event_t* event);
+
+// As get_simulated_sram_write_event(), but discard events that don't
+// overlap the len bytes of the RAM from addr.
+bool get_simulated_sram_write_event_in_range(sim_sram_write_event_t* event, uint32_t addr, uint32_t len);
+#endif
+
+#if SIM_SRAM_ENABLE_DOORBELL
+typedef struct {
+    uint32_t addr;   // Offset in the RAM of the word in the doorbell window
+    uint32_t value;  // The word, once the WRITE had finished
+    uint32_t seq;    // Counts doorbells, a gap means some were dropped while the queue was full
+} sim_sram_doorbell_t;
+
+// Get the oldest doorbell not yet seen by core0, without blocking.  Returns
+// false if there is none.
+bool get_simulated_sram_doorbell(sim_sram_doorbell_t* doorbell);
+
+// Publish a word to the status window, at offset bytes from its start,
+// which must be a multiple of 4.  Only an SPI mode READ is sure to see the
+// whole word, old or new.  With several devices each has a doorbell
+// and a status window, device n's SIM_SRAM_SIZE * n bytes further on.
+void set_simulated_sram_status(uint32_t offset, uint32_t value);
+#endif
+
+#if SIM_SRAM_ENABLE_SNAPSHOT
+// Copy len bytes from offset in the RAM to dst, retrying until no WRITE,
+// FILL or COPY was in progress at any time during the copy.  The copy is
+// of the RAM as it was between two WRITEs, though it may take as long as the
+// master keeps writing.
+void read_simulated_sram_snapshot(void* dst, uint32_t offset, uint32_t len);
+
+// As read_simulated_sram_snapshot(), but only retries for a WRITE that may
+// have changed the range copied, so WRITEs elsewhere don't delay it.  It
+// still retries if more than one WRITE started during the copy.
+void read_simulated_sram_range_snapshot(void* dst, uint32_t offset, uint32_t len);
+#endif
+
+// The commands counted.  EDIO, EQIO, RSTIO, the CRC, FILL, COPY, WRMR, RDMR
+// and PSRAM commands and WRITEs to the flash region count as other, and transfer no bytes.
+// Transactions the master ended before the command and address were complete
+// count as aborted, with no CS low time.
+enum {
+    SIM_SRAM_STATS_READ,
+    SIM_SRAM_STATS_FAST_READ,
+    SIM_SRAM_STATS_WRITE,
+    SIM_SRAM_STATS_CONT_READ,
+    SIM_SRAM_STATS_OTHER,
+    SIM_SRAM_STATS_UNKNOWN,
+    SIM_SRAM_STATS_ABORTED,
+    SIM_SRAM_STATS_NUM_COMMANDS
+};
+
+// The CS low time is measured in polls of CS by core1, each about 5 SYS
+// clocks, from the end of the address until CS goes high.  Bucket n counts
+// transactions with fewer than 16 << n polls, the last bucket the rest.
+#define SIM_SRAM_STATS_BUCKETS 8
+
+typedef struct {
+    uint32_t count;
+    uint32_t bytes;     // Bytes the DMA transferred, reads include those prefetched into the PIO FIFO
+    uint32_t cs_low[SIM_SRAM_STATS_BUCKETS];
+} sim_sram_command_stats_t;
+
+typedef struct {
+    sim_sram_command_stats_t command[SIM_SRAM_STATS_NUM_COMMANDS];
+} sim_sram_stats_t;
+
+#if SIM_SRAM_ENABLE_STATS
+// Copy the statistics since setup_simulated_sram().  Core1 updates them
+// while they are copied, so counters may differ by the last transaction.
+void get_simulated_sram_stats(sim_sram_stats_t* stats);
+#endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#include <string.h>
+
+#include "sram_protocol.h"
+
+enum {
+    PHASE_IGNORE,
+    PHASE_CMD,
+    PHASE_ADDR,
+    PHASE_DUMMY,
+    PHASE_READ,
+    PHASE_WRITE
+};
+
+void sim_sram_protocol_init(sim_sram_protocol_t* p, uint8_t* ram, uint32_t size, int addr_bits) {
+    p->ram = ram;
+    p->mask = size - 1;
+    p->addr = 0;
+    p->addr_bytes = addr_bits / 8;
+    p->cmd = 0;
+    p->phase = PHASE_IGNORE;
+    p->remaining = 0;
+}
+
+void sim_sram_protocol_begin(sim_sram_protocol_t* p) {
+    p->phase = PHASE_CMD;
+}
+
+void sim_sram_protocol_end(sim_sram_protocol_t* p) {
+    p->phase = PHASE_IGNORE;
+}
+
+void sim_sram_protocol_exchange(sim_sram_protocol_t* p, const uint8_t* out, uint8_t* in, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        // The data phases run to the end of the RAM at a time, and stop there
+        size_t n = 1;
+        switch (p->phase) {
+        case PHASE_CMD:
+            p->cmd = out[i];
+            if (p->cmd == SIM_SRAM_READ_CMD || p->cmd == SIM_SRAM_FAST_READ_CMD || p->cmd == SIM_SRAM_WRITE_CMD) {
+                p->phase = PHASE_ADDR;
+                p->addr = 0;
+                p->remaining = p->addr_bytes;
+            }
+            else p->phase = PHASE_IGNORE;
+            break;
+        case PHASE_ADDR:
+            p->addr = (p->addr << 8) | out[i];
+            if (--p->remaining == 0) {
+                p->addr &= p->mask;
+                if (p->cmd == SIM_SRAM_WRITE_CMD) p->phase = PHASE_WRITE;
+                else p->phase = p->cmd == SIM_SRAM_FAST_READ_CMD ? PHASE_DUMMY : PHASE_READ;
+            }
+            break;
+        case PHASE_DUMMY:
+            p->phase = PHASE_READ;
+            break;
+        case PHASE_READ:
+            n = len - i;
+            if (n > p->mask + 1 - p->addr) n = p->mask + 1 - p->addr;
+            if (in) memcpy(&in[i], &p->ram[p->addr], n);
+            p->addr += n;
+            if (p->addr > p->mask) p->phase = PHASE_IGNORE;
+            i += n;
+            continue;
+        case PHASE_WRITE:
+            n = len - i;
+            if (n > p->mask + 1 - p->addr) n = p->mask + 1 - p->addr;
+            memcpy(&p->ram[p->addr], &out[i], n);
+            p->addr += n;
+            if (p->addr > p->mask) p->phase = PHASE_IGNORE;
+            break;
+        default:
+            n = len - i;
+            break;
+        }
+        if (in) memset(&in[i], SIM_SRAM_PROTOCOL_IDLE_BYTE, n);
+        i += n;
+    }
+}
+
+void sim_sram_protocol_transfer(sim_sram_protocol_t* p, const uint8_t* out, uint8_t* in, size_t len) {
+    sim_sram_protocol_begin(p);
+    sim_sram_protocol_exchange(p, out, in, len);
+    sim_sram_protocol_end(p);
+}
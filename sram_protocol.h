@@ -0,0 +1,48 @@
+// Copyright 2023 (c) Michael Bell
+// The BSD 3 clause license applies
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The commands served by core1_main in every configuration
+#define SIM_SRAM_READ_CMD 0x03
+#define SIM_SRAM_FAST_READ_CMD 0x0B
+#define SIM_SRAM_WRITE_CMD 0x02
+
+// The command set of the RAM, byte by byte, without the PIOs and DMA, so it
+// runs on any host.  This is READ, FAST READ with its dummy byte, and WRITE
+// in sequential mode, with other commands ignored until CS goes high, as
+// core1_main serves them without the optional features in sram.h.  With
+// 24-bit addresses the top bits of the address are ignored.  A WRITE stops
+// at the end of the RAM and the rest of its data is discarded, as in
+// core1_main.  MISO reads SIM_SRAM_PROTOCOL_IDLE_BYTE except during READ
+// data, and also for READ data past the end of the RAM, where core1_main
+// returns whatever follows the RAM in the RP2040's memory.  The timing
+// simulator checks it against the firmware's behaviour.
+#define SIM_SRAM_PROTOCOL_IDLE_BYTE 0xFF
+
+typedef struct {
+    uint8_t* ram;
+    uint32_t mask;        // Size of the RAM - 1, it must be a power of 2
+    uint32_t addr;
+    uint8_t addr_bytes;
+    uint8_t cmd;
+    uint8_t phase;
+    uint8_t remaining;    // Address bytes still to come
+} sim_sram_protocol_t;
+
+void sim_sram_protocol_init(sim_sram_protocol_t* p, uint8_t* ram, uint32_t size, int addr_bits);
+
+// CS falls, the next byte is a command
+void sim_sram_protocol_begin(sim_sram_protocol_t* p);
+
+// Exchange len bytes with CS low, which may be split over any number of
+// calls.  in may be NULL if MISO isn't wanted.
+void sim_sram_protocol_exchange(sim_sram_protocol_t* p, const uint8_t* out, uint8_t* in, size_t len);
+
+// CS rises, bytes are ignored until the next begin
+void sim_sram_protocol_end(sim_sram_protocol_t* p);
+
+// A whole transaction: begin, exchange and end
+void sim_sram_protocol_transfer(sim_sram_protocol_t* p, const uint8_t* out, uint8_t* in, size_t len);